@@ -0,0 +1,137 @@
+/* Include guard */
+#if !defined(BLUENOISE_H)
+#define BLUENOISE_H
+
+/* Includes */
+#include <nh_base.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Blue-noise dither mask, generated at startup with void and cluster
+ * (Ulichney 1993). Energy is a toroidal Gaussian of the pattern's ones,
+ * the tightest cluster is the one with the most energy and the largest
+ * void the zero with the least:
+ *
+ *   1. scatter ones, then move the tightest cluster into the largest void
+ *      until that stops changing anything
+ *   2. rank the ones by removing tightest clusters, last removed first
+ *   3. rank the zeros by filling largest voids
+ *
+ * Every texel ends up with a unique rank, neighbouring ranks sit far apart.
+ */
+
+/* Consts */
+#define BLUE_NOISE_SIZE     64  /* Must match common.compute */
+#define BLUE_NOISE_TEXELS   (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE)
+#define BLUE_NOISE_SIGMA    1.5f
+#define BLUE_NOISE_INITIAL  10  /* 1 in this many texels start as ones */
+
+/* Structs */
+typedef struct {
+  u8 *pattern;                  /* Binary pattern, 1 or 0 per texel */
+  f32 *energy;                  /* Gaussian of the ones around each texel */
+  f32 *gaussian;                /* By toroidal x and y offset */
+} blue_noise_t;
+
+/* Set or clear a texel, updating everyone's energy */
+static void blue_noise_set(blue_noise_t *noise, u32 texel, u8 value) {
+  if (noise->pattern[texel] == value) return;
+  noise->pattern[texel] = value;
+  const f32 sign = value ? 1.0f : -1.0f;
+  const u32 tx = texel % BLUE_NOISE_SIZE, ty = texel / BLUE_NOISE_SIZE;
+  for (u32 y = 0; y < BLUE_NOISE_SIZE; y++) {
+    const u32 dy = (y + BLUE_NOISE_SIZE - ty) % BLUE_NOISE_SIZE;
+    for (u32 x = 0; x < BLUE_NOISE_SIZE; x++) {
+      const u32 dx = (x + BLUE_NOISE_SIZE - tx) % BLUE_NOISE_SIZE;
+      noise->energy[y * BLUE_NOISE_SIZE + x] += sign * noise->gaussian[dy * BLUE_NOISE_SIZE + dx];
+    }
+  }
+}
+/* Most energetic one, or least energetic zero */
+static u32 blue_noise_find(const blue_noise_t *noise, u8 value) {
+  u32 best = 0;
+  bool found = false;
+  for (u32 i = 0; i < BLUE_NOISE_TEXELS; i++) {
+    if (noise->pattern[i] != value) continue;
+    if (!found
+        || (value && noise->energy[i] > noise->energy[best])
+        || (!value && noise->energy[i] < noise->energy[best])) {
+      best = i;
+      found = true;
+    }
+  }
+  return best;
+}
+
+/* Ranks of every texel normalised to [0, 1), mask holds BLUE_NOISE_TEXELS */
+bool blue_noise_generate(f32 *mask) {
+  blue_noise_t noise = {
+    (u8 *)calloc(BLUE_NOISE_TEXELS, sizeof(u8)),
+    (f32 *)calloc(BLUE_NOISE_TEXELS, sizeof(f32)),
+    (f32 *)malloc(sizeof(f32) * BLUE_NOISE_TEXELS),
+  };
+  u8 *prototype = (u8 *)malloc(BLUE_NOISE_TEXELS);
+  if (noise.pattern == NH_NULL || noise.energy == NH_NULL || noise.gaussian == NH_NULL || prototype == NH_NULL) {
+    free(noise.pattern);
+    free(noise.energy);
+    free(noise.gaussian);
+    free(prototype);
+    return false;
+  }
+  for (u32 y = 0; y < BLUE_NOISE_SIZE; y++) {
+    for (u32 x = 0; x < BLUE_NOISE_SIZE; x++) {
+      const f32 dx = (f32)(x < BLUE_NOISE_SIZE / 2 ? x : BLUE_NOISE_SIZE - x);
+      const f32 dy = (f32)(y < BLUE_NOISE_SIZE / 2 ? y : BLUE_NOISE_SIZE - y);
+      noise.gaussian[y * BLUE_NOISE_SIZE + x] =
+        expf(-(dx * dx + dy * dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+    }
+  }
+
+  /* Initial pattern - fixed LCG, so every run gets the same mask */
+  u32 state = 1u;
+  u32 ones = 0;
+  while (ones < BLUE_NOISE_TEXELS / BLUE_NOISE_INITIAL) {
+    state = state * 1664525u + 1013904223u;
+    const u32 texel = (state >> 8) % BLUE_NOISE_TEXELS;
+    if (noise.pattern[texel]) continue;
+    blue_noise_set(&noise, texel, 1);
+    ones++;
+  }
+  for (;;) {
+    const u32 cluster = blue_noise_find(&noise, 1);
+    blue_noise_set(&noise, cluster, 0);
+    const u32 void_texel = blue_noise_find(&noise, 0);
+    blue_noise_set(&noise, void_texel, 1);
+    if (void_texel == cluster) break;
+  }
+  memcpy(prototype, noise.pattern, BLUE_NOISE_TEXELS);
+
+  /* Ones, densest first out */
+  for (u32 rank = ones; rank-- > 0;) {
+    const u32 cluster = blue_noise_find(&noise, 1);
+    blue_noise_set(&noise, cluster, 0);
+    mask[cluster] = (f32)rank;
+  }
+  /* Zeros, emptiest first in - the pattern is back to the prototype */
+  for (u32 i = 0; i < BLUE_NOISE_TEXELS; i++) {
+    blue_noise_set(&noise, i, prototype[i]);
+  }
+  for (u32 rank = ones; rank < BLUE_NOISE_TEXELS; rank++) {
+    const u32 void_texel = blue_noise_find(&noise, 0);
+    blue_noise_set(&noise, void_texel, 1);
+    mask[void_texel] = (f32)rank;
+  }
+  for (u32 i = 0; i < BLUE_NOISE_TEXELS; i++) {
+    mask[i] = (mask[i] + 0.5f) / (f32)BLUE_NOISE_TEXELS;
+  }
+
+  free(noise.pattern);
+  free(noise.energy);
+  free(noise.gaussian);
+  free(prototype);
+  return true;
+}
+
+#endif /* BLUENOISE_H */
@@ -0,0 +1,224 @@
+/* Include guard */
+#if !defined(BVH_H)
+#define BVH_H
+
+/* Includes */
+#include <nh_base.h>
+#include <math.h>
+#include <stdlib.h>
+
+/*
+ * Bounding volume hierarchy, built on the host with a binned surface area
+ * heuristic. Nodes are stored depth-first: the first child of an interior
+ * node is the next node, and every node keeps a miss link to the node that
+ * follows its subtree. That makes traversal stackless:
+ *
+ *   node = 0
+ *   while node < node_count:
+ *     if ray misses node:  node = node.miss
+ *     elif node is leaf:   test primitives; node = node.miss
+ *     else:                node = node + 1
+ *
+ * Leaves index a range of refs, which are indices into the primitive list
+ * the hierarchy was built from.
+ */
+
+/* Consts */
+#define BVH_BINS            16
+#define BVH_MAX_LEAF        8   /* Must fit in BVH_COUNT_MASK */
+#define BVH_COUNT_BITS      4
+#define BVH_COUNT_MASK      ((1u << BVH_COUNT_BITS) - 1u)
+#define BVH_TRAVERSAL_COST  1.0f
+#define BVH_PADDING         1e-4f
+
+/* Structs */
+typedef struct {
+  nh_vec3_t min;
+  nh_vec3_t max;
+} bvh_aabb_t;
+/* 32 bytes, matches BvhNode in common.compute (std430) */
+typedef struct {
+  nh_vec3_t min;
+  u32 miss;                     /* Node after this subtree */
+  nh_vec3_t max;
+  u32 prims;                    /* Leaf: first ref << 4 | count, else 0 */
+} bvh_node_t;
+typedef struct {
+  bvh_node_t *nodes;
+  u32 node_count;
+  u32 *refs;                    /* Primitive indices in leaf order */
+  u32 ref_count;
+} bvh_t;
+typedef struct {
+  const bvh_aabb_t *bounds;     /* Per primitive */
+  nh_vec3_t *centroids;         /* Per primitive */
+  bvh_t *bvh;
+} bvh_builder_t;
+
+/* AABB utils */
+static inline bvh_aabb_t bvh_aabb_empty(void) {
+  return (bvh_aabb_t){
+    {INFINITY, INFINITY, INFINITY},
+    {-INFINITY, -INFINITY, -INFINITY}
+  };
+}
+static inline void bvh_aabb_grow(bvh_aabb_t *a, nh_vec3_t p) {
+  a->min.x = fminf(a->min.x, p.x);
+  a->min.y = fminf(a->min.y, p.y);
+  a->min.z = fminf(a->min.z, p.z);
+  a->max.x = fmaxf(a->max.x, p.x);
+  a->max.y = fmaxf(a->max.y, p.y);
+  a->max.z = fmaxf(a->max.z, p.z);
+}
+static inline void bvh_aabb_merge(bvh_aabb_t *a, const bvh_aabb_t *b) {
+  bvh_aabb_grow(a, b->min);
+  bvh_aabb_grow(a, b->max);
+}
+static inline f32 bvh_aabb_area(const bvh_aabb_t *a) {
+  f32 x = a->max.x - a->min.x, y = a->max.y - a->min.y, z = a->max.z - a->min.z;
+  if (x < 0.0f || y < 0.0f || z < 0.0f) return 0.0f;
+  return 2.0f * (x * y + y * z + z * x);
+}
+static inline f32 bvh_axis(nh_vec3_t v, u32 axis) {
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+/* Build */
+static void bvh_make_leaf(bvh_builder_t *b, u32 index, u32 first, u32 count) {
+  b->bvh->nodes[index].prims = (first << BVH_COUNT_BITS) | count;
+}
+static void bvh_build_node(bvh_builder_t *b, u32 first, u32 count) {
+  bvh_t *bvh = b->bvh;
+  u32 *refs = bvh->refs;
+  const u32 index = bvh->node_count++;
+  bvh_node_t *node = &bvh->nodes[index];
+
+  /* Bounds of primitives and of their centroids */
+  bvh_aabb_t bounds = bvh_aabb_empty(), centroid_bounds = bvh_aabb_empty();
+  for (u32 i = first; i < first + count; i++) {
+    bvh_aabb_merge(&bounds, &b->bounds[refs[i]]);
+    bvh_aabb_grow(&centroid_bounds, b->centroids[refs[i]]);
+  }
+  /* Pad so flat primitives (walls) never fall between slabs */
+  const f32 pad = BVH_PADDING * (1.0f + sqrtf(bvh_aabb_area(&bounds)));
+  node->min = (nh_vec3_t){bounds.min.x - pad, bounds.min.y - pad, bounds.min.z - pad};
+  node->max = (nh_vec3_t){bounds.max.x + pad, bounds.max.y + pad, bounds.max.z + pad};
+  node->prims = 0;
+  if (count <= 1) {
+    bvh_make_leaf(b, index, first, count);
+    node->miss = bvh->node_count;
+    return;
+  }
+
+  /* Binned SAH over all three axes */
+  f32 best_cost = INFINITY;
+  u32 best_axis = 0, best_split = 0;
+  for (u32 axis = 0; axis < 3; axis++) {
+    const f32 lo = bvh_axis(centroid_bounds.min, axis);
+    const f32 extent = bvh_axis(centroid_bounds.max, axis) - lo;
+    if (extent <= 0.0f) continue;
+    bvh_aabb_t bin_bounds[BVH_BINS];
+    u32 bin_counts[BVH_BINS] = {0};
+    for (u32 i = 0; i < BVH_BINS; i++) bin_bounds[i] = bvh_aabb_empty();
+    for (u32 i = first; i < first + count; i++) {
+      u32 bin = (u32)((bvh_axis(b->centroids[refs[i]], axis) - lo) / extent * BVH_BINS);
+      if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+      bin_counts[bin]++;
+      bvh_aabb_merge(&bin_bounds[bin], &b->bounds[refs[i]]);
+    }
+    /* Sweep from the right, then from the left */
+    f32 right_area[BVH_BINS];
+    u32 right_count[BVH_BINS];
+    bvh_aabb_t acc = bvh_aabb_empty();
+    u32 n = 0;
+    for (u32 i = BVH_BINS - 1; i > 0; i--) {
+      bvh_aabb_merge(&acc, &bin_bounds[i]);
+      n += bin_counts[i];
+      right_area[i] = bvh_aabb_area(&acc);
+      right_count[i] = n;
+    }
+    acc = bvh_aabb_empty();
+    n = 0;
+    for (u32 i = 0; i < BVH_BINS - 1; i++) {
+      bvh_aabb_merge(&acc, &bin_bounds[i]);
+      n += bin_counts[i];
+      if (n == 0 || right_count[i + 1] == 0) continue;
+      f32 cost = bvh_aabb_area(&acc) * n + right_area[i + 1] * right_count[i + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = i + 1;
+      }
+    }
+  }
+
+  /* Leaf if splitting doesn't pay off */
+  const f32 parent_area = bvh_aabb_area(&bounds);
+  const f32 split_cost = BVH_TRAVERSAL_COST
+    + (parent_area > 0.0f ? best_cost / parent_area : (f32)count);
+  if (count <= BVH_MAX_LEAF && split_cost >= (f32)count) {
+    bvh_make_leaf(b, index, first, count);
+    node->miss = bvh->node_count;
+    return;
+  }
+
+  /* Partition refs */
+  u32 mid = first;
+  if (best_cost < INFINITY) {
+    const f32 lo = bvh_axis(centroid_bounds.min, best_axis);
+    const f32 extent = bvh_axis(centroid_bounds.max, best_axis) - lo;
+    for (u32 i = first; i < first + count; i++) {
+      u32 bin = (u32)((bvh_axis(b->centroids[refs[i]], best_axis) - lo) / extent * BVH_BINS);
+      if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+      if (bin < best_split) {
+        u32 tmp = refs[i];
+        refs[i] = refs[mid];
+        refs[mid++] = tmp;
+      }
+    }
+  }
+  /* All centroids coincide - split the range in half */
+  if (mid == first || mid == first + count) {
+    mid = first + count / 2;
+  }
+
+  bvh_build_node(b, first, mid - first);
+  bvh_build_node(b, mid, first + count - mid);
+  bvh->nodes[index].miss = bvh->node_count;
+}
+/* Build over count primitive bounds, returns false on allocation failure */
+bool bvh_build(bvh_t *bvh, const bvh_aabb_t *bounds, u32 count) {
+  bvh->node_count = 0;
+  bvh->ref_count = count;
+  bvh->nodes = (bvh_node_t *)malloc(sizeof(bvh_node_t) * (2 * count + 1));
+  bvh->refs = (u32 *)malloc(sizeof(u32) * (count + 1));
+  nh_vec3_t *centroids = (nh_vec3_t *)malloc(sizeof(nh_vec3_t) * (count + 1));
+  if (bvh->nodes == NH_NULL || bvh->refs == NH_NULL || centroids == NH_NULL) {
+    free(bvh->nodes);
+    free(bvh->refs);
+    free(centroids);
+    return false;
+  }
+  for (u32 i = 0; i < count; i++) {
+    bvh->refs[i] = i;
+    centroids[i] = (nh_vec3_t){
+      0.5f * (bounds[i].min.x + bounds[i].max.x),
+      0.5f * (bounds[i].min.y + bounds[i].max.y),
+      0.5f * (bounds[i].min.z + bounds[i].max.z)
+    };
+  }
+  bvh_builder_t builder = {bounds, centroids, bvh};
+  bvh_build_node(&builder, 0, count);
+  free(centroids);
+  return true;
+}
+void bvh_destroy(bvh_t *bvh) {
+  free(bvh->nodes);
+  free(bvh->refs);
+  bvh->nodes = NH_NULL;
+  bvh->refs = NH_NULL;
+  bvh->node_count = 0;
+  bvh->ref_count = 0;
+}
+
+#endif /* BVH_H */
@@ -0,0 +1,359 @@
+/* Include guard */
+#if !defined(CAPTURE_H)
+#define CAPTURE_H
+
+/* Includes */
+#include <nh_base.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+/* Project headers */
+#include "loadgl.h"
+#include "output.h"
+
+/*
+ * Frames read back from the GPU without stalling it. The displayed texture
+ * is copied into one of a ring of CAPTURE_SLOTS pixel pack buffers as RGBA8,
+ * with a fence after it. The oldest slot is picked up once its fence has
+ * passed - polled every frame, never waited on - and handed to a writer
+ * thread, which converts and writes it while the next frames render.
+ * When every slot is still busy nothing is read back that frame, the window
+ * never waits for the writer.
+ *
+ * A frame can go to either or both of:
+ *
+ *   screenshot  PNG through output.h, at the traced resolution
+ *   video       raw rgb24 frames, top row first, at a size fixed when
+ *               recording starts - frames traced smaller are scaled up
+ *               nearest-neighbour, like the window does. Written to a file,
+ *               or to a command's stdin if the path starts with '|'
+ *
+ * Video frames are due at a fixed rate of wall clock time. One that comes
+ * late is written as many times as it was due, so the stream plays back in
+ * real time whatever the frame rate was. The displayed texture is already
+ * tonemapped when there is a resolve pass, otherwise reading it back as
+ * bytes clamps it the same way the window shows it.
+ */
+
+/* Consts */
+#define CAPTURE_SLOTS       3   /* Readbacks in flight or being written */
+#define CAPTURE_SCREENSHOT  1   /* What a slot's frame goes to */
+#define CAPTURE_VIDEO       2
+#define CAPTURE_PATH_SIZE   256
+#define CAPTURE_MAX_REPEAT  8   /* Copies of one late video frame, the rest are dropped */
+#define CAPTURE_DRAIN_NS    1000000000 /* Readback wait when stopping */
+
+/* Structs */
+typedef struct {
+  u32 pbo;                      /* Pixel pack buffer */
+  size_t capacity;              /* Its size in bytes */
+  u8 *mapped;                   /* Persistent mapping, NH_NULL if unsupported */
+  u8 *pixels;                   /* RGBA8, bottom row first, stride apart */
+  GLsync fence;                 /* After the readback */
+  u32 width, height, stride;    /* Region captured, texture row length */
+  u32 kinds;                    /* CAPTURE_SCREENSHOT and/or CAPTURE_VIDEO */
+  u32 repeat;                   /* Times the video frame is written */
+  char path[CAPTURE_PATH_SIZE]; /* Screenshot file */
+} capture_slot_t;
+typedef struct {
+  capture_slot_t slots[CAPTURE_SLOTS];
+  bool persistent;              /* Slots persistently mapped? */
+  u32 next;                     /* Slot the next readback goes to */
+  u32 read;                     /* Oldest readback in flight */
+  u32 reading;                  /* Readbacks in flight */
+  /* Writer thread */
+  SDL_Thread *thread;
+  SDL_sem *work, *done;         /* Slots to write, slots written */
+  u32 write;                    /* Writer's next slot */
+  bool quit;
+  SDL_atomic_t failed;          /* Writer couldn't write the video */
+  f32 *rows;                    /* Writer's screenshot rows */
+  size_t rows_size;
+  u8 *frame;                    /* Writer's video frame */
+  size_t frame_size;
+  /* Screenshot */
+  bool screenshot;              /* Requested, not read back yet */
+  char screenshot_path[CAPTURE_PATH_SIZE];
+  /* Video */
+  FILE *video;                  /* Stream, NH_NULL when not recording */
+  bool pipe;                    /* Opened with popen */
+  u32 video_width, video_height; /* Frame size */
+  u64 interval;                 /* Performance counter ticks per frame */
+  u64 next_at;                  /* When the next frame is due */
+  u64 frames;                   /* Frames queued, copies counted */
+  u64 dropped;                  /* Frames due that never got a copy */
+} capture_t;
+
+/* Grow a writer buffer, false if it can't be */
+static bool capture_reserve(void **buffer, size_t *size, size_t needed) {
+  if (*size >= needed) return true;
+  void *grown = realloc(*buffer, needed);
+  if (grown == NH_NULL) return false;
+  *buffer = grown;
+  *size = needed;
+  return true;
+}
+static void capture_write_screenshot(capture_t *capture, const capture_slot_t *slot) {
+  const u32 width = slot->width, height = slot->height;
+  if (!capture_reserve((void **)&capture->rows, &capture->rows_size, sizeof(f32) * 4 * width * height)) {
+    NH_ERROR("Failed to allocate screenshot %s", slot->path);
+    return;
+  }
+  for (u32 y = 0; y < height; y++) {
+    const u8 *src = slot->pixels + 4 * (size_t)(height - 1 - y) * slot->stride;
+    f32 *dst = capture->rows + 4 * (size_t)y * width;
+    for (u32 i = 0; i < 4 * width; i++) dst[i] = (f32)src[i] / 255.0f;
+  }
+  output_t output;
+  if (!output_open(&output, slot->path, width, height)) {
+    NH_ERROR("Failed to create %s", slot->path);
+    return;
+  }
+  if (!output_write(&output, capture->rows, height)) {
+    fclose(output.file);
+    NH_ERROR("Failed to write %s", slot->path);
+    return;
+  }
+  if (!output_close(&output)) {
+    NH_ERROR("Failed to finish %s", slot->path);
+    return;
+  }
+  NH_INFO("Saved %s (%ux%u)", slot->path, width, height);
+}
+static void capture_write_video(capture_t *capture, const capture_slot_t *slot) {
+  const u32 width = capture->video_width, height = capture->video_height;
+  const size_t size = 3 * (size_t)width * height;
+  if (!capture_reserve((void **)&capture->frame, &capture->frame_size, size)) {
+    SDL_AtomicSet(&capture->failed, 1);
+    return;
+  }
+  for (u32 y = 0; y < height; y++) {
+    /* Top row first, the slot is bottom row first */
+    const u32 source_y = slot->height - 1 - (u32)((u64)y * slot->height / height);
+    const u8 *src = slot->pixels + 4 * (size_t)source_y * slot->stride;
+    u8 *dst = capture->frame + 3 * (size_t)y * width;
+    for (u32 x = 0; x < width; x++) {
+      const u8 *pixel = src + 4 * (size_t)((u64)x * slot->width / width);
+      dst[3 * x + 0] = pixel[0];
+      dst[3 * x + 1] = pixel[1];
+      dst[3 * x + 2] = pixel[2];
+    }
+  }
+  for (u32 i = 0; i < slot->repeat; i++) {
+    if (fwrite(capture->frame, 1, size, capture->video) != size) {
+      SDL_AtomicSet(&capture->failed, 1);
+      return;
+    }
+  }
+}
+/* Writes slots in the order they were read back */
+static int capture_writer(void *data) {
+  capture_t *capture = (capture_t *)data;
+  for (;;) {
+    SDL_SemWait(capture->work);
+    if (capture->quit) break;
+    const capture_slot_t *slot = &capture->slots[capture->write];
+    capture->write = (capture->write + 1) % CAPTURE_SLOTS;
+    if (slot->kinds & CAPTURE_SCREENSHOT) capture_write_screenshot(capture, slot);
+    if ((slot->kinds & CAPTURE_VIDEO) && SDL_AtomicGet(&capture->failed) == 0) {
+      capture_write_video(capture, slot);
+    }
+    SDL_SemPost(capture->done);
+  }
+  return 0;
+}
+/* Hand the oldest readback to the writer if its fence has passed */
+static bool capture_collect(capture_t *capture, u64 timeout) {
+  if (capture->reading == 0) return false;
+  capture_slot_t *slot = &capture->slots[capture->read];
+  const GLenum status = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+  if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return false;
+  glDeleteSync(slot->fence);
+  slot->fence = NH_NULL;
+  if (!capture->persistent) {
+    const size_t size = 4 * (size_t)slot->stride * slot->height;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    const void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    if (mapped != NH_NULL) memcpy(slot->pixels, mapped, size);
+    else slot->kinds = 0;
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+  capture->read = (capture->read + 1) % CAPTURE_SLOTS;
+  capture->reading--;
+  SDL_SemPost(capture->work);
+  return true;
+}
+/* Make a free slot big enough for size bytes, its buffer is recreated if not */
+static bool capture_resize_slot(capture_t *capture, capture_slot_t *slot, size_t size) {
+  if (slot->capacity >= size) return true;
+  glDeleteBuffers(1, &slot->pbo);
+  if (!capture->persistent) free(slot->pixels);
+  slot->mapped = slot->pixels = NH_NULL;
+  slot->capacity = 0;
+  glGenBuffers(1, &slot->pbo);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+  if (capture->persistent) {
+    const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NH_NULL, flags);
+    slot->mapped = slot->pixels = (u8 *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+  } else {
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, NH_NULL, GL_STREAM_READ);
+    slot->pixels = (u8 *)malloc(size);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  if (slot->pixels == NH_NULL) return false;
+  slot->capacity = size;
+  return true;
+}
+/* Wait for every readback and the writer to finish with them */
+static void capture_drain(capture_t *capture) {
+  while (capture->reading > 0) {
+    if (!capture_collect(capture, CAPTURE_DRAIN_NS)) {
+      /* Lost - drop it rather than hang */
+      capture_slot_t *slot = &capture->slots[capture->read];
+      glDeleteSync(slot->fence);
+      slot->fence = NH_NULL;
+      slot->kinds = 0;
+      capture->read = (capture->read + 1) % CAPTURE_SLOTS;
+      capture->reading--;
+      SDL_SemPost(capture->work);
+    }
+  }
+  for (u32 i = 0; i < CAPTURE_SLOTS; i++) SDL_SemWait(capture->done);
+  for (u32 i = 0; i < CAPTURE_SLOTS; i++) SDL_SemPost(capture->done);
+}
+
+/* Create the writer thread, buffers are made on first use */
+bool capture_init(capture_t *capture) {
+  *capture = (capture_t){0};
+  capture->persistent = hasBufferStorageGL();
+  capture->work = SDL_CreateSemaphore(0);
+  capture->done = SDL_CreateSemaphore(CAPTURE_SLOTS);
+  if (capture->work == NH_NULL || capture->done == NH_NULL) return false;
+  capture->thread = SDL_CreateThread(capture_writer, "capture_writer", capture);
+  if (capture->thread == NH_NULL) return false;
+  NH_LOG_ENTRY("Capture buffers: %s", capture->persistent ? "persistent mapping" : "mapped on read");
+  return true;
+}
+/* Start writing video frames of width by height at fps to path, a
+ * command's stdin if it starts with '|' */
+bool capture_start_video(capture_t *capture, const char *path, u32 width, u32 height, u32 fps) {
+  /* capture_frame divides by the interval */
+  capture->interval = fps > 0 ? SDL_GetPerformanceFrequency() / fps : 0;
+  NH_ASSERT_MSG(capture->interval > 0, "Bad capture frame rate");
+  capture->pipe = path[0] == '|';
+  if (capture->pipe) {
+    /* A command that quits early shows up as a failed write */
+    signal(SIGPIPE, SIG_IGN);
+    capture->video = popen(path + 1, "w");
+  } else {
+    capture->video = fopen(path, "wb");
+  }
+  if (capture->video == NH_NULL) return false;
+  SDL_AtomicSet(&capture->failed, 0);
+  capture->video_width = width;
+  capture->video_height = height;
+  capture->next_at = SDL_GetPerformanceCounter();
+  capture->frames = 0;
+  capture->dropped = 0;
+  return true;
+}
+bool capture_recording(const capture_t *capture) {
+  return capture->video != NH_NULL;
+}
+/* Has the writer failed to write the video? */
+bool capture_failed(capture_t *capture) {
+  return SDL_AtomicGet(&capture->failed) != 0;
+}
+/* Write the frames still in flight and close the stream, false if any of
+ * the video couldn't be written */
+bool capture_stop_video(capture_t *capture) {
+  if (capture->video == NH_NULL) return true;
+  capture_drain(capture);
+  bool success = !capture_failed(capture);
+  if (capture->pipe) success = pclose(capture->video) == 0 && success;
+  else success = fclose(capture->video) == 0 && success;
+  capture->video = NH_NULL;
+  return success;
+}
+/* Save the next frame captured to path */
+void capture_screenshot(capture_t *capture, const char *path) {
+  capture->screenshot = true;
+  strncpy(capture->screenshot_path, path, CAPTURE_PATH_SIZE - 1);
+  capture->screenshot_path[CAPTURE_PATH_SIZE - 1] = '\0';
+}
+/* Call once a frame after texture is drawn: hands finished readbacks to the
+ * writer, then reads back the bottom left width by height of texture if a
+ * screenshot or video frame wants it and a slot is free */
+void capture_frame(capture_t *capture, u32 texture, u32 texture_width, u32 texture_height, u32 width, u32 height) {
+  while (capture_collect(capture, 0));
+  u32 kinds = 0, repeat = 0;
+  if (capture->screenshot) kinds |= CAPTURE_SCREENSHOT;
+  if (capture->video != NH_NULL) {
+    const u64 now = SDL_GetPerformanceCounter();
+    if (now >= capture->next_at) {
+      kinds |= CAPTURE_VIDEO;
+      repeat = (u32)((now - capture->next_at) / capture->interval) + 1;
+    }
+  }
+  if (kinds == 0 || SDL_SemTryWait(capture->done) != 0) return;
+  capture_slot_t *slot = &capture->slots[capture->next];
+  if (!capture_resize_slot(capture, slot, 4 * (size_t)texture_width * texture_height)) {
+    NH_ERROR("Failed to allocate capture buffer");
+    capture->screenshot = false;
+    SDL_SemPost(capture->done);
+    return;
+  }
+  /* Only taken once the slot is sure */
+  if (kinds & CAPTURE_VIDEO) {
+    capture->next_at += (u64)repeat * capture->interval;
+    if (repeat > CAPTURE_MAX_REPEAT) {
+      capture->dropped += repeat - CAPTURE_MAX_REPEAT;
+      repeat = CAPTURE_MAX_REPEAT;
+    }
+    capture->frames += repeat;
+  }
+  if (kinds & CAPTURE_SCREENSHOT) {
+    memcpy(slot->path, capture->screenshot_path, CAPTURE_PATH_SIZE);
+    capture->screenshot = false;
+  }
+  slot->width = width;
+  slot->height = height;
+  slot->stride = texture_width;
+  slot->kinds = kinds;
+  slot->repeat = repeat;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, NH_NULL);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  capture->next = (capture->next + 1) % CAPTURE_SLOTS;
+  capture->reading++;
+}
+/* Finish what is in flight, stop the writer and free the buffers */
+void capture_destroy(capture_t *capture) {
+  if (capture->thread != NH_NULL) {
+    capture_stop_video(capture);
+    capture_drain(capture);
+    capture->quit = true;
+    SDL_SemPost(capture->work);
+    SDL_WaitThread(capture->thread, NH_NULL);
+  }
+  for (u32 i = 0; i < CAPTURE_SLOTS; i++) {
+    capture_slot_t *slot = &capture->slots[i];
+    glDeleteBuffers(1, &slot->pbo);
+    if (!capture->persistent) free(slot->pixels);
+  }
+  if (capture->work != NH_NULL) SDL_DestroySemaphore(capture->work);
+  if (capture->done != NH_NULL) SDL_DestroySemaphore(capture->done);
+  free(capture->rows);
+  free(capture->frame);
+  *capture = (capture_t){0};
+}
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,166 @@
+/* Include guard */
+#if !defined(CONVERGE_H)
+#define CONVERGE_H
+
+/* Includes */
+#include <nh_base.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Project headers */
+#include "bvh.h"
+
+/*
+ * Convergence benchmark. Each fixed camera pose is accumulated for a number
+ * of frames, and at every power of two the image is compared against a
+ * reference rendered with far more samples. Errors are recorded against
+ * wall time and samples per pixel, and the time to reach
+ * CONVERGE_THRESHOLD relMSE is what gets compared between runs.
+ *
+ * Poses are placed within the scene's bounds, so any loaded scene gets
+ * views too. References are PFM (float RGB, bottom row first, as OpenGL
+ * reads textures back) named <scene>-<pose>.pfm. Reports are CSV:
+ *
+ *   scene,pose,frame,samples_per_pixel,ms,rmse,relmse
+ *
+ * and a report from an earlier run can be read back as a baseline.
+ */
+
+/* Consts */
+#define CONVERGE_WIDTH      256   /* Benchmark image */
+#define CONVERGE_HEIGHT     256
+#define CONVERGE_FRAMES     256   /* Default frames per pose */
+#define CONVERGE_REFERENCE_FRAMES 4096 /* Default frames per reference */
+#define CONVERGE_THRESHOLD  0.1   /* relMSE counted as converged */
+#define CONVERGE_TOLERANCE  0.1   /* Slower than the baseline by this is a regression */
+#define CONVERGE_EPSILON    0.01  /* Keeps relMSE finite where the reference is black */
+#define CONVERGE_MAX_POINTS 32    /* Checkpoints per pose, powers of two */
+#define CONVERGE_MAX_FRAMES (1u << 30) /* 31 powers of two and the last frame fit the points */
+
+/* Structs */
+typedef struct {
+  nh_vec3_t position;           /* Fraction of the scene's bounds, may be outside */
+  f32 angle_x, angle_y;         /* Yaw, pitch */
+  f32 focal_length;
+} converge_pose_t;
+typedef struct {
+  u32 frame;                    /* Frames accumulated */
+  f64 samples_per_pixel;        /* Mean over the image */
+  f64 ms;                       /* Wall time so far, readbacks excluded */
+  f64 rmse;
+  f64 relmse;                   /* Squared error over squared reference */
+} converge_point_t;
+
+/* Globals */
+const converge_pose_t converge_poses[] = {
+  {{0.5f, 0.55f, -0.75f}, 0.0f, -0.3f, 1.0f},   /* Built-in scene's start view */
+  {{0.5f, 0.5f, 0.1f}, 0.0f, 0.0f, 1.0f},       /* Inside, facing +z */
+  {{0.15f, 0.8f, 0.15f}, -0.6f, -0.7f, 1.2f},   /* High corner, looking down */
+};
+#define CONVERGE_POSES (sizeof(converge_poses) / sizeof(converge_poses[0]))
+
+/* Camera position of a pose */
+nh_vec3_t converge_pose_camera(const converge_pose_t *pose, const bvh_node_t *root) {
+  return (nh_vec3_t){
+    root->min.x + pose->position.x * (root->max.x - root->min.x),
+    root->min.y + pose->position.y * (root->max.y - root->min.y),
+    root->min.z + pose->position.z * (root->max.z - root->min.z),
+  };
+}
+
+/* Reference image - rgba in, rgb out */
+bool converge_write_pfm(const char *path, const f32 *rgba, u32 width, u32 height) {
+  FILE *file = fopen(path, "wb");
+  if (file == NH_NULL) return false;
+  /* Negative scale: little endian */
+  fprintf(file, "PF\n%u %u\n-1.0\n", width, height);
+  bool success = true;
+  for (u32 i = 0; i < width * height && success; i++) {
+    success = fwrite(&rgba[4 * i], sizeof(f32), 3, file) == 3;
+  }
+  return fclose(file) == 0 && success;
+}
+/* rgb of width * height, NH_NULL if missing or another size */
+f32 *converge_read_pfm(const char *path, u32 width, u32 height) {
+  FILE *file = fopen(path, "rb");
+  if (file == NH_NULL) return NH_NULL;
+  u32 file_width, file_height;
+  f32 scale;
+  f32 *rgb = NH_NULL;
+  if (fscanf(file, "PF %u %u %f", &file_width, &file_height, &scale) == 3
+      && fgetc(file) == '\n'
+      && file_width == width && file_height == height && scale < 0.0f) {
+    rgb = (f32 *)malloc(sizeof(f32) * 3 * width * height);
+    if (rgb != NH_NULL && fread(rgb, sizeof(f32) * 3, width * height, file) != width * height) {
+      free(rgb);
+      rgb = NH_NULL;
+    }
+  }
+  fclose(file);
+  return rgb;
+}
+
+/* Error of rgba against the rgb reference, over every channel */
+void converge_error(const f32 *rgba, const f32 *reference, u32 pixels, f64 *rmse, f64 *relmse) {
+  f64 squared = 0.0, relative = 0.0;
+  for (u32 i = 0; i < pixels; i++) {
+    for (u32 c = 0; c < 3; c++) {
+      const f64 r = reference[3 * i + c];
+      const f64 d = rgba[4 * i + c] - r;
+      squared += d * d;
+      relative += d * d / (r * r + CONVERGE_EPSILON);
+    }
+  }
+  *rmse = sqrt(squared / (3.0 * pixels));
+  *relmse = relative / (3.0 * pixels);
+}
+
+/*
+ * Time and samples to reach threshold relMSE, interpolated between the
+ * checkpoints either side - error falls as a power of time, so in log-log.
+ * False if it never got there.
+ */
+bool converge_time_to_threshold(
+    const converge_point_t *points, u32 count, f64 threshold, f64 *ms, f64 *samples_per_pixel) {
+  for (u32 i = 0; i < count; i++) {
+    if (points[i].relmse > threshold) continue;
+    if (i == 0 || points[i - 1].relmse <= points[i].relmse) {
+      *ms = points[i].ms;
+      *samples_per_pixel = points[i].samples_per_pixel;
+      return true;
+    }
+    const converge_point_t *a = &points[i - 1], *b = &points[i];
+    const f64 t = (log(threshold) - log(a->relmse)) / (log(b->relmse) - log(a->relmse));
+    *ms = exp(log(a->ms) + t * (log(b->ms) - log(a->ms)));
+    *samples_per_pixel = exp(log(a->samples_per_pixel)
+        + t * (log(b->samples_per_pixel) - log(a->samples_per_pixel)));
+    return true;
+  }
+  return false;
+}
+
+/* Report */
+void converge_write_header(FILE *report) {
+  fprintf(report, "scene,pose,frame,samples_per_pixel,ms,rmse,relmse\n");
+}
+void converge_write_point(FILE *report, const char *scene, u32 pose, const converge_point_t *point) {
+  fprintf(report, "%s,%u,%u,%.3f,%.3f,%.6g,%.6g\n", scene, pose, point->frame,
+      point->samples_per_pixel, point->ms, point->rmse, point->relmse);
+}
+/* Checkpoints of scene's pose from an earlier report, returns how many */
+u32 converge_read_points(FILE *report, const char *scene, u32 pose, converge_point_t *points) {
+  char line[256], line_scene[128];
+  u32 count = 0, line_pose;
+  converge_point_t point;
+  rewind(report);
+  while (count < CONVERGE_MAX_POINTS && fgets(line, sizeof(line), report) != NH_NULL) {
+    if (sscanf(line, "%127[^,],%u,%u,%lf,%lf,%lf,%lf", line_scene, &line_pose, &point.frame,
+          &point.samples_per_pixel, &point.ms, &point.rmse, &point.relmse) != 7) continue;
+    if (strcmp(line_scene, scene) == 0 && line_pose == pose) points[count++] = point;
+  }
+  return count;
+}
+
+#endif /* CONVERGE_H */
@@ -0,0 +1,666 @@
+/* Include guard */
+#if !defined(CPU_RENDER_H)
+#define CPU_RENDER_H
+
+/* Includes */
+#include <nh_base.h>
+#include <SDL2/SDL.h>
+#include <math.h>
+#include <stdlib.h>
+
+/* Project headers */
+#include "scene.h"
+#include "lights.h"
+
+/*
+ * CPU path tracer - a line-by-line port of common.compute and
+ * shader.compute, so the two backends produce statistically equivalent
+ * images. The image is split into tiles; every worker starts with a
+ * contiguous run of tiles and steals from the back of other workers' runs
+ * once its own is empty.
+ */
+
+/* Consts */
+#define CPU_MAX_BOUNCES     8
+#define CPU_NUM_RAYS        4
+#define CPU_TILE_SIZE       32
+#define CPU_MAX_THREADS     64
+#define CPU_PI              3.14159265359f
+#define CPU_NO_HIT          0xFFFFFFFFu
+#define CPU_SHADOW_EPSILON  1e-3f
+
+/* Structs */
+typedef struct {
+  nh_vec3_t origin;
+  nh_vec3_t direction;
+} cpu_ray_t;
+typedef struct {
+  bool did_hit;
+  f32 distance;
+  nh_vec3_t position;
+  nh_vec3_t normal;
+  const material_t *material;
+  u32 ref;                      /* Primitive, CPU_NO_HIT on a miss */
+  u32 instance;                 /* Scene instance it was placed by */
+} cpu_hit_info_t;
+/* Per-frame inputs, the same as the compute shader uniforms */
+typedef struct {
+  f32 width, height;            /* Window dimensions */
+  f32 focal_length;
+  f32 angle_x, angle_y;
+  f32 test_in;
+  u32 roulette_depth;           /* Surfaces hit before Russian roulette */
+  u32 random_seed;
+  u32 ticks;
+  nh_vec3_t camera;
+} cpu_frame_t;
+/* Queue of tiles [head, tail) owned by one worker */
+typedef struct {
+  SDL_SpinLock lock;
+  u32 head, tail;
+} cpu_queue_t;
+struct cpu_renderer_t;
+typedef struct {
+  struct cpu_renderer_t *renderer;
+  u32 index;
+  SDL_sem *start;               /* Posted once per frame, for this worker only */
+  u64 rays;                     /* Rays cast during the current frame, by this worker only */
+} cpu_worker_t;
+typedef struct cpu_renderer_t {
+  /* Image */
+  u32 width, height;            /* Image dimensions */
+  f32 *image;                   /* Accumulated RGBA image */
+  u32 tiles_x, tiles_y;         /* Tile grid */
+  /* Scene */
+  const scene_t *scene;         /* Scene to render */
+  const light_table_t *lights;  /* Its emissive triangles */
+  /* Threads */
+  u32 num_threads;
+  SDL_Thread *threads[CPU_MAX_THREADS];
+  cpu_worker_t workers[CPU_MAX_THREADS];
+  cpu_queue_t queues[CPU_MAX_THREADS];
+  SDL_sem *done;                /* Frame completion, once per worker */
+  bool quit;
+  /* Current frame */
+  cpu_frame_t frame;
+} cpu_renderer_t;
+
+/* Vector utils */
+static inline nh_vec3_t cpu_vec3(f32 x, f32 y, f32 z) {
+  return (nh_vec3_t){x, y, z};
+}
+static inline nh_vec3_t cpu_add(nh_vec3_t a, nh_vec3_t b) {
+  return (nh_vec3_t){a.x + b.x, a.y + b.y, a.z + b.z};
+}
+static inline nh_vec3_t cpu_sub(nh_vec3_t a, nh_vec3_t b) {
+  return (nh_vec3_t){a.x - b.x, a.y - b.y, a.z - b.z};
+}
+static inline nh_vec3_t cpu_mul(nh_vec3_t a, nh_vec3_t b) {
+  return (nh_vec3_t){a.x * b.x, a.y * b.y, a.z * b.z};
+}
+static inline nh_vec3_t cpu_scale(nh_vec3_t a, f32 s) {
+  return (nh_vec3_t){a.x * s, a.y * s, a.z * s};
+}
+static inline f32 cpu_dot(nh_vec3_t a, nh_vec3_t b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+static inline nh_vec3_t cpu_cross(nh_vec3_t a, nh_vec3_t b) {
+  return (nh_vec3_t){
+    a.y * b.z - a.z * b.y,
+    a.z * b.x - a.x * b.z,
+    a.x * b.y - a.y * b.x
+  };
+}
+static inline nh_vec3_t cpu_normalize(nh_vec3_t a) {
+  return cpu_scale(a, 1.0f / sqrtf(cpu_dot(a, a)));
+}
+static inline nh_vec3_t cpu_mix(nh_vec3_t a, nh_vec3_t b, f32 t) {
+  return cpu_add(a, cpu_scale(cpu_sub(b, a), t));
+}
+
+/* RNG - PCG (RXS-M-XS), the GPU's default sampler */
+static inline f32 cpu_random_number(u32 *state) {
+  *state = *state * 747796405u + 2891336453u;
+  u32 word = ((*state >> ((*state >> 28u) + 4u)) ^ *state) * 277803737u;
+  return (f32)(((word >> 22u) ^ word) >> 8) * (1.0f / 16777216.0f);
+}
+/* A random direction on the unit sphere */
+static inline nh_vec3_t cpu_random_direction(u32 *state) {
+  f32 z = 1.0f - 2.0f * cpu_random_number(state);
+  f32 angle = 2.0f * CPU_PI * cpu_random_number(state);
+  f32 r = sqrtf(fmaxf(1.0f - z * z, 0.0f));
+  return cpu_vec3(r * cosf(angle), r * sinf(angle), z);
+}
+/* Random point in a circle */
+static inline nh_vec2_t cpu_random_point_in_circle(u32 *state) {
+  f32 angle = cpu_random_number(state) * 2.0f * CPU_PI;
+  f32 r = sqrtf(cpu_random_number(state));
+  return (nh_vec2_t){cosf(angle) * r, sinf(angle) * r};
+}
+
+/* Intersection with a bounding box, up to max_distance */
+static inline bool cpu_intersection_aabb(const bvh_node_t *node, cpu_ray_t ray, nh_vec3_t inv_direction, f32 max_distance) {
+  f32 tx0 = (node->min.x - ray.origin.x) * inv_direction.x;
+  f32 tx1 = (node->max.x - ray.origin.x) * inv_direction.x;
+  f32 ty0 = (node->min.y - ray.origin.y) * inv_direction.y;
+  f32 ty1 = (node->max.y - ray.origin.y) * inv_direction.y;
+  f32 tz0 = (node->min.z - ray.origin.z) * inv_direction.z;
+  f32 tz1 = (node->max.z - ray.origin.z) * inv_direction.z;
+  f32 enter = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), fmaxf(fminf(tz0, tz1), 0.0f));
+  f32 exit = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), fminf(fmaxf(tz0, tz1), max_distance));
+  return enter <= exit;
+}
+/* Distance to a sphere, INFINITY on a miss */
+static inline f32 cpu_distance_sphere(nh_vec3_t center, f32 radius, cpu_ray_t ray) {
+  nh_vec3_t oc = cpu_sub(ray.origin, center);
+  f32 a = cpu_dot(ray.direction, ray.direction);
+  f32 b = 2.0f * cpu_dot(oc, ray.direction);
+  f32 c = cpu_dot(oc, oc) - radius * radius;
+  f32 discriminant = b * b - 4.0f * a * c;
+  if (discriminant < 0.0f) {
+    return INFINITY;
+  }
+  f32 t = (-b - sqrtf(discriminant)) / (2.0f * a);
+  return t > 0.0f ? t : INFINITY;
+}
+/* Distance to a triangle, INFINITY on a miss */
+static inline f32 cpu_distance_triangle(nh_vec3_t v0, nh_vec3_t v1, nh_vec3_t v2, cpu_ray_t ray) {
+  nh_vec3_t e1 = cpu_sub(v1, v0);
+  nh_vec3_t e2 = cpu_sub(v2, v0);
+  if (cpu_dot(cpu_cross(e1, e2), ray.direction) > 0.0f) {
+    return INFINITY;
+  }
+  nh_vec3_t p = cpu_cross(ray.direction, e2);
+  f32 det = cpu_dot(e1, p);
+  if (det == 0.0f) {
+    return INFINITY;
+  }
+  f32 inv_det = 1.0f / det;
+  nh_vec3_t t = cpu_sub(ray.origin, v0);
+  f32 u = cpu_dot(t, p) * inv_det;
+  if (u < 0.0f || u > 1.0f) {
+    return INFINITY;
+  }
+  nh_vec3_t q = cpu_cross(t, e1);
+  f32 v = cpu_dot(ray.direction, q) * inv_det;
+  if (v < 0.0f || u + v > 1.0f) {
+    return INFINITY;
+  }
+  f32 t2 = cpu_dot(e2, q) * inv_det;
+  return t2 < 0.0f ? INFINITY : t2;
+}
+/* Distance to a primitive, spheres then triangles */
+static inline f32 cpu_distance_primitive(const scene_t *scene, u32 ref, cpu_ray_t ray) {
+  if (ref < scene->sphere_count) {
+    const sphere_t *sphere = &scene->spheres[ref];
+    return cpu_distance_sphere(sphere->center, sphere->radius, ray);
+  }
+  const triangle_t *triangle = &scene->triangles[ref - scene->sphere_count];
+  return cpu_distance_triangle(
+      scene->vertices[triangle->v0].position, scene->vertices[triangle->v1].position,
+      scene->vertices[triangle->v2].position, ray);
+}
+/* A ray moved into an instance's mesh space, distances along it unchanged */
+static inline cpu_ray_t cpu_instance_ray(const tlas_instance_t *instance, cpu_ray_t ray) {
+  const f32 (*m)[4] = instance->world_to_mesh;
+  const nh_vec3_t o = ray.origin, d = ray.direction;
+  return (cpu_ray_t){
+    cpu_vec3(m[0][0] * o.x + m[0][1] * o.y + m[0][2] * o.z + m[0][3],
+             m[1][0] * o.x + m[1][1] * o.y + m[1][2] * o.z + m[1][3],
+             m[2][0] * o.x + m[2][1] * o.y + m[2][2] * o.z + m[2][3]),
+    cpu_vec3(m[0][0] * d.x + m[0][1] * d.y + m[0][2] * d.z,
+             m[1][0] * d.x + m[1][1] * d.y + m[1][2] * d.z,
+             m[2][0] * d.x + m[2][1] * d.y + m[2][2] * d.z),
+  };
+}
+/* Closest primitive of an instance's mesh closer than closest_distance */
+static inline u32 cpu_closest_hit_mesh(const scene_t *scene, const tlas_instance_t *instance, cpu_ray_t ray, f32 *closest_distance) {
+  const bvh_t *bvh = &scene->bvh;
+  ray = cpu_instance_ray(instance, ray);
+  nh_vec3_t inv_direction = cpu_vec3(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  u32 closest_ref = CPU_NO_HIT;
+  u32 node = instance->root;
+  while (node < instance->end) {
+    const bvh_node_t *bvh_node = &bvh->nodes[node];
+    if (!cpu_intersection_aabb(bvh_node, ray, inv_direction, *closest_distance)) {
+      node = bvh_node->miss;
+      continue;
+    }
+    u32 count = bvh_node->prims & BVH_COUNT_MASK;
+    if (count == 0) {
+      node++;
+      continue;
+    }
+    u32 first = bvh_node->prims >> BVH_COUNT_BITS;
+    for (u32 i = first; i < first + count; i++) {
+      u32 ref = bvh->refs[i];
+      f32 distance = cpu_distance_primitive(scene, ref, ray);
+      if (distance < *closest_distance) {
+        *closest_distance = distance;
+        closest_ref = ref;
+      }
+    }
+    node = bvh_node->miss;
+  }
+  return closest_ref;
+}
+/* Closest intersection - stackless traversal of both levels, as in common.compute */
+static inline cpu_hit_info_t cpu_closest_intersection(const scene_t *scene, cpu_ray_t ray) {
+  const tlas_t *tlas = &scene->tlas;
+  nh_vec3_t inv_direction = cpu_vec3(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  f32 closest_distance = INFINITY;
+  u32 closest_ref = CPU_NO_HIT, closest_slot = 0;
+  u32 node = 0;
+  while (node < tlas->nodes[0].miss) {
+    const bvh_node_t *tlas_node = &tlas->nodes[node];
+    if (!cpu_intersection_aabb(tlas_node, ray, inv_direction, closest_distance)) {
+      node = tlas_node->miss;
+      continue;
+    }
+    u32 count = tlas_node->prims & BVH_COUNT_MASK;
+    if (count == 0) {
+      node++;
+      continue;
+    }
+    u32 first = tlas_node->prims >> BVH_COUNT_BITS;
+    for (u32 slot = first; slot < first + count; slot++) {
+      u32 ref = cpu_closest_hit_mesh(scene, &tlas->instances[slot], ray, &closest_distance);
+      if (ref != CPU_NO_HIT) {
+        closest_ref = ref;
+        closest_slot = slot;
+      }
+    }
+    node = tlas_node->miss;
+  }
+
+  /* Full hit info for the closest primitive only, normal from mesh space */
+  if (closest_ref == CPU_NO_HIT) {
+    cpu_hit_info_t no_hit = {false, INFINITY, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, NH_NULL, CPU_NO_HIT, CPU_NO_HIT};
+    return no_hit;
+  }
+  const f32 (*m)[4] = tlas->instances[closest_slot].world_to_mesh;
+  cpu_hit_info_t hit_info;
+  nh_vec3_t normal;
+  hit_info.did_hit = true;
+  hit_info.distance = closest_distance;
+  hit_info.position = cpu_add(ray.origin, cpu_scale(cpu_normalize(ray.direction), closest_distance));
+  if (closest_ref < scene->sphere_count) {
+    const sphere_t *sphere = &scene->spheres[closest_ref];
+    const nh_vec3_t p = hit_info.position;
+    normal = cpu_sub(cpu_vec3(
+        m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]), sphere->center);
+    hit_info.material = &scene->materials[sphere->material];
+  } else {
+    const triangle_t *triangle = &scene->triangles[closest_ref - scene->sphere_count];
+    const nh_vec3_t v0 = scene->vertices[triangle->v0].position;
+    normal = cpu_cross(cpu_sub(scene->vertices[triangle->v1].position, v0),
+        cpu_sub(scene->vertices[triangle->v2].position, v0));
+    hit_info.material = &scene->materials[triangle->material];
+  }
+  hit_info.normal = cpu_normalize(cpu_vec3(
+      m[0][0] * normal.x + m[1][0] * normal.y + m[2][0] * normal.z,
+      m[0][1] * normal.x + m[1][1] * normal.y + m[2][1] * normal.z,
+      m[0][2] * normal.x + m[1][2] * normal.y + m[2][2] * normal.z));
+  hit_info.ref = closest_ref;
+  hit_info.instance = scene->tlas_instances[closest_slot];
+  return hit_info;
+}
+/* Anything in an instance's mesh closer than max_distance? */
+static inline bool cpu_any_hit_mesh(const scene_t *scene, const tlas_instance_t *instance, cpu_ray_t ray, f32 max_distance) {
+  const bvh_t *bvh = &scene->bvh;
+  ray = cpu_instance_ray(instance, ray);
+  nh_vec3_t inv_direction = cpu_vec3(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  u32 node = instance->root;
+  while (node < instance->end) {
+    const bvh_node_t *bvh_node = &bvh->nodes[node];
+    if (!cpu_intersection_aabb(bvh_node, ray, inv_direction, max_distance)) {
+      node = bvh_node->miss;
+      continue;
+    }
+    u32 count = bvh_node->prims & BVH_COUNT_MASK;
+    if (count == 0) {
+      node++;
+      continue;
+    }
+    u32 first = bvh_node->prims >> BVH_COUNT_BITS;
+    for (u32 i = first; i < first + count; i++) {
+      if (cpu_distance_primitive(scene, bvh->refs[i], ray) < max_distance) {
+        return true;
+      }
+    }
+    node = bvh_node->miss;
+  }
+  return false;
+}
+/* Anything closer than max_distance? - stops at the first hit */
+static inline bool cpu_any_hit(const scene_t *scene, cpu_ray_t ray, f32 max_distance) {
+  const tlas_t *tlas = &scene->tlas;
+  nh_vec3_t inv_direction = cpu_vec3(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  u32 node = 0;
+  while (node < tlas->nodes[0].miss) {
+    const bvh_node_t *tlas_node = &tlas->nodes[node];
+    if (!cpu_intersection_aabb(tlas_node, ray, inv_direction, max_distance)) {
+      node = tlas_node->miss;
+      continue;
+    }
+    u32 count = tlas_node->prims & BVH_COUNT_MASK;
+    if (count == 0) {
+      node++;
+      continue;
+    }
+    u32 first = tlas_node->prims >> BVH_COUNT_BITS;
+    for (u32 slot = first; slot < first + count; slot++) {
+      if (cpu_any_hit_mesh(scene, &tlas->instances[slot], ray, max_distance)) {
+        return true;
+      }
+    }
+    node = tlas_node->miss;
+  }
+  return false;
+}
+/* Solid angle pdf of the diffuse lobe, see diffuse_pdf in common.compute */
+static inline f32 cpu_diffuse_pdf(nh_vec3_t normal, nh_vec3_t direction, f32 roughness) {
+  f32 cos_phi = cpu_dot(normal, direction);
+  if (cos_phi <= 0.0f) {
+    return 0.0f;
+  }
+  f32 k = (1.0f - roughness) / roughness;
+  f32 sin_phi = sqrtf(fmaxf(1.0f - cos_phi * cos_phi, 0.0f));
+  if (k * sin_phi >= 1.0f) {
+    return 0.0f;
+  }
+  f32 theta = acosf(cos_phi) + asinf(k * sin_phi);
+  if (theta >= 0.5f * CPU_PI) {
+    return 0.0f;
+  }
+  f32 jacobian = 1.0f + k * cos_phi / sqrtf(1.0f - k * k * sin_phi * sin_phi);
+  f32 ratio = sin_phi > 1e-4f ? sinf(theta) / sin_phi : jacobian;
+  return cosf(theta) / CPU_PI * ratio * jacobian;
+}
+/* Solid angle pdf of light sampling, see light_pdf in common.compute */
+static inline f32 cpu_light_pdf(const light_table_t *lights, const material_t *material, f32 distance, f32 cos_light) {
+  return light_luminance(material) / lights->total_power * distance * distance / cos_light;
+}
+static inline f32 cpu_power_heuristic(f32 pdf, f32 other_pdf) {
+  return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+/* Russian roulette, see survives_roulette in common.compute */
+static inline bool cpu_survives_roulette(u32 bounce, u32 roulette_depth, nh_vec3_t *ray_color, u32 *state) {
+  f32 roll = cpu_random_number(state);
+  if (bounce + 1 < roulette_depth) {
+    return true;
+  }
+  f32 survival = fminf(fmaxf(ray_color->x, fmaxf(ray_color->y, ray_color->z)), 1.0f);
+  if (roll >= survival) {
+    return false;
+  }
+  *ray_color = cpu_scale(*ray_color, 1.0f / survival);
+  return true;
+}
+/* Next event estimation with the shadow ray, what it adds to the path */
+static nh_vec3_t cpu_sample_light(
+    const scene_t *scene, const light_table_t *lights, const cpu_hit_info_t *hit_info,
+    nh_vec3_t ray_color, bool is_diffuse, u32 *state, f32 test_in, u64 *rays) {
+  nh_vec3_t none = cpu_vec3(0.0f, 0.0f, 0.0f);
+  /* Always drawn, as on the GPU */
+  f32 pick = cpu_random_number(state) * (f32)lights->count;
+  f32 bu = cpu_random_number(state);
+  f32 bv = cpu_random_number(state);
+  if (!is_diffuse || lights->count == 0) {
+    return none;
+  }
+  /* Alias table */
+  u32 index = (u32)pick < lights->count - 1 ? (u32)pick : lights->count - 1;
+  const light_t *light = &lights->lights[index];
+  if (pick - floorf(pick) >= light->threshold) {
+    light = &lights->lights[light->alias];
+  }
+  /* Uniform point on the triangle */
+  nh_vec3_t v0 = light->v0, v1 = light->v1, v2 = light->v2;
+  f32 su = sqrtf(bu);
+  nh_vec3_t point = cpu_add(cpu_add(cpu_scale(v0, 1.0f - su), cpu_scale(v1, su * (1.0f - bv))), cpu_scale(v2, su * bv));
+
+  nh_vec3_t to_light = cpu_sub(point, hit_info->position);
+  f32 distance = sqrtf(cpu_dot(to_light, to_light));
+  nh_vec3_t direction = cpu_scale(to_light, 1.0f / distance);
+  f32 cos_light = -cpu_dot(direction, cpu_normalize(cpu_cross(cpu_sub(v1, v0), cpu_sub(v2, v0))));
+  f32 bsdf_pdf = cpu_diffuse_pdf(hit_info->normal, direction, hit_info->material->roughness);
+  if (cos_light <= 0.0f || bsdf_pdf <= 0.0f) {
+    return none;
+  }
+  /* Shadow ray */
+  cpu_ray_t shadow_ray = {cpu_add(hit_info->position, cpu_scale(hit_info->normal, CPU_SHADOW_EPSILON)), direction};
+  (*rays)++;
+  if (cpu_any_hit(scene, shadow_ray, distance - 2.0f * CPU_SHADOW_EPSILON)) {
+    return none;
+  }
+  const material_t *material = &scene->materials[light->material];
+  f32 pdf = cpu_light_pdf(lights, material, distance, cos_light);
+  nh_vec3_t emitted_light = cpu_scale(material->emission_color, material->emission_strength * test_in);
+  return cpu_scale(cpu_mul(cpu_mul(ray_color, hit_info->material->albedo), emitted_light),
+      bsdf_pdf * cpu_power_heuristic(pdf, bsdf_pdf) / pdf);
+}
+/* Trace ray */
+static nh_vec3_t cpu_trace_ray(
+    const scene_t *scene, const light_table_t *lights, const cpu_frame_t *frame, cpu_ray_t ray, u32 *state, u64 *rays) {
+  const f32 test_in = frame->test_in;
+  nh_vec3_t incoming_light = cpu_vec3(0.0f, 0.0f, 0.0f);
+  nh_vec3_t ray_color = cpu_vec3(1.0f, 1.0f, 1.0f);
+  f32 bsdf_pdf = 0.0f;
+  bool no_hit = true;
+
+  for (u32 i = 0; i < CPU_MAX_BOUNCES; i++) {
+    cpu_hit_info_t hit_info = cpu_closest_intersection(scene, ray);
+    (*rays)++;
+    if (!hit_info.did_hit) {
+      break;
+    }
+    no_hit = false;
+    const material_t *material = hit_info.material;
+    /* Emission, weighted against light sampling having picked this point */
+    nh_vec3_t emitted_light = cpu_scale(material->emission_color, material->emission_strength * test_in);
+    f32 weight = 1.0f;
+    if (bsdf_pdf > 0.0f && hit_info.ref >= scene->sphere_count && lights->count > 0) {
+      f32 pdf = cpu_light_pdf(lights, material, hit_info.distance, -cpu_dot(ray.direction, hit_info.normal));
+      weight = cpu_power_heuristic(bsdf_pdf, pdf);
+    }
+    incoming_light = cpu_add(incoming_light, cpu_scale(cpu_mul(emitted_light, ray_color), weight));
+
+    ray.origin = hit_info.position;
+    nh_vec3_t diffuse = cpu_normalize(cpu_add(hit_info.normal, cpu_random_direction(state)));
+    nh_vec3_t specular = hit_info.normal;
+    /* Both rolls are always drawn, as on the GPU */
+    bool is_specular = cpu_random_number(state) < material->specular_probability;
+    bool is_refraction = cpu_random_number(state) > material->opacity;
+    bool is_diffuse = !is_specular && !is_refraction && material->roughness > 0.0f;
+    incoming_light = cpu_add(incoming_light,
+        cpu_sample_light(scene, lights, &hit_info, ray_color, is_diffuse && i + 1 < CPU_MAX_BOUNCES, state, test_in, rays));
+    if (is_refraction) {
+      f32 eta = is_specular ? material->ior : 1.0f / material->ior;
+      f32 cosi = cpu_dot(ray.direction, hit_info.normal);
+      f32 k = 1.0f - eta * eta * (1.0f - cosi * cosi);
+      ray.direction = cpu_sub(
+          cpu_scale(cpu_sub(ray.direction, cpu_scale(hit_info.normal, cosi)), eta),
+          cpu_scale(hit_info.normal, sqrtf(k))
+      );
+    } else {
+      ray.direction = cpu_normalize(cpu_mix(specular, diffuse, material->roughness * (f32)!is_specular));
+    }
+    bsdf_pdf = is_diffuse ? cpu_diffuse_pdf(hit_info.normal, ray.direction, material->roughness) : 0.0f;
+
+    ray_color = cpu_mul(ray_color, cpu_mix(material->albedo, material->specular_color, (f32)is_specular));
+    if (i + 1 < CPU_MAX_BOUNCES && !cpu_survives_roulette(i, frame->roulette_depth, &ray_color, state)) {
+      break;
+    }
+  }
+
+  if (no_hit)
+    return cpu_vec3(0.05f, 0.125f, 0.25f);
+  else
+    return incoming_light;
+}
+/* Camera ray direction through a point on the [-1, 1] image plane */
+nh_vec3_t cpu_camera_direction(const cpu_frame_t *frame, f32 target_x, f32 target_y) {
+  nh_vec3_t d = cpu_normalize(cpu_vec3(target_x, target_y, frame->focal_length));
+  /* Rotate by yaw, then pitch */
+  f32 cx = cosf(frame->angle_x), sx = sinf(frame->angle_x);
+  d = cpu_vec3(cx * d.x - sx * d.z, d.y, sx * d.x + cx * d.z);
+  f32 cy = cosf(frame->angle_y), sy = sinf(frame->angle_y);
+  d = cpu_vec3(d.x, cy * d.y + sy * d.z, -sy * d.y + cy * d.z);
+  return d;
+}
+/* Render one pixel, the equivalent of main() in shader.compute */
+static void cpu_render_pixel(cpu_renderer_t *renderer, u32 x, u32 y, u64 *rays) {
+  const cpu_frame_t *frame = &renderer->frame;
+  u32 seed = 0;
+  seed += frame->random_seed * 12092u;
+  seed += x * 3452u;
+  seed += y * 1234u;
+  seed += frame->ticks * 17492u;
+
+  /* Get ray target position */
+  f32 target_x = (f32)x / (f32)renderer->width * 2.0f - 1.0f;
+  f32 target_y = (f32)y / (f32)renderer->height * 2.0f - 1.0f;
+  target_y /= frame->width / frame->height;
+
+  /* Set ray properties */
+  cpu_ray_t ray;
+  ray.origin = frame->camera;
+  ray.direction = cpu_camera_direction(frame, target_x, target_y);
+
+  /* Trace ray multiple times, take average */
+  nh_vec3_t avg_color = cpu_vec3(0.0f, 0.0f, 0.0f);
+  for (u32 i = 0; i < CPU_NUM_RAYS; i++) {
+    nh_vec2_t offset = cpu_random_point_in_circle(&seed);
+    ray.origin = cpu_add(ray.origin, cpu_vec3(offset.x * 0.005f, offset.y * 0.005f, 0.0f));
+    avg_color = cpu_add(avg_color, cpu_trace_ray(renderer->scene, renderer->lights, frame, ray, &seed, rays));
+  }
+  avg_color = cpu_scale(avg_color, 1.0f / (f32)CPU_NUM_RAYS);
+
+  /* Accumulate */
+  f32 *pixel = &renderer->image[4 * (y * renderer->width + x)];
+  nh_vec3_t prev_color = cpu_vec3(pixel[0], pixel[1], pixel[2]);
+  nh_vec3_t color = cpu_mix(prev_color, avg_color, 1.0f / (f32)(frame->ticks + 1));
+  pixel[0] = color.x;
+  pixel[1] = color.y;
+  pixel[2] = color.z;
+  pixel[3] = 1.0f;
+}
+
+/* Scheduling */
+static bool cpu_pop_tile(cpu_queue_t *queue, u32 *tile) {
+  bool found = false;
+  SDL_AtomicLock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *tile = queue->head++;
+    found = true;
+  }
+  SDL_AtomicUnlock(&queue->lock);
+  return found;
+}
+static bool cpu_steal_tile(cpu_queue_t *queue, u32 *tile) {
+  bool found = false;
+  SDL_AtomicLock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *tile = --queue->tail;
+    found = true;
+  }
+  SDL_AtomicUnlock(&queue->lock);
+  return found;
+}
+static void cpu_render_tile(cpu_renderer_t *renderer, u32 tile, u64 *rays) {
+  u32 x0 = (tile % renderer->tiles_x) * CPU_TILE_SIZE;
+  u32 y0 = (tile / renderer->tiles_x) * CPU_TILE_SIZE;
+  u32 x1 = x0 + CPU_TILE_SIZE < renderer->width ? x0 + CPU_TILE_SIZE : renderer->width;
+  u32 y1 = y0 + CPU_TILE_SIZE < renderer->height ? y0 + CPU_TILE_SIZE : renderer->height;
+  for (u32 y = y0; y < y1; y++) {
+    for (u32 x = x0; x < x1; x++) {
+      cpu_render_pixel(renderer, x, y, rays);
+    }
+  }
+}
+static int cpu_worker(void *data) {
+  cpu_worker_t *worker = (cpu_worker_t *)data;
+  cpu_renderer_t *renderer = worker->renderer;
+  for (;;) {
+    SDL_SemWait(worker->start);
+    if (renderer->quit) break;
+    worker->rays = 0;
+    u32 tile;
+    /* Own tiles first, front to back */
+    while (cpu_pop_tile(&renderer->queues[worker->index], &tile)) {
+      cpu_render_tile(renderer, tile, &worker->rays);
+    }
+    /* Then steal from the back of the others */
+    for (u32 i = 1; i < renderer->num_threads; i++) {
+      cpu_queue_t *victim = &renderer->queues[(worker->index + i) % renderer->num_threads];
+      while (cpu_steal_tile(victim, &tile)) {
+        cpu_render_tile(renderer, tile, &worker->rays);
+      }
+    }
+    SDL_SemPost(renderer->done);
+  }
+  return 0;
+}
+
+/* Create worker threads and the accumulation image */
+void cpu_renderer_init(cpu_renderer_t *renderer, u32 width, u32 height, const scene_t *scene, const light_table_t *lights) {
+  renderer->scene = scene;
+  renderer->lights = lights;
+  renderer->width = width;
+  renderer->height = height;
+  renderer->image = (f32 *)calloc((size_t)width * height * 4, sizeof(f32));
+  renderer->tiles_x = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  renderer->tiles_y = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  renderer->num_threads = (u32)SDL_GetCPUCount();
+  if (renderer->num_threads < 1) renderer->num_threads = 1;
+  if (renderer->num_threads > CPU_MAX_THREADS) renderer->num_threads = CPU_MAX_THREADS;
+  renderer->done = SDL_CreateSemaphore(0);
+  renderer->quit = false;
+  for (u32 i = 0; i < renderer->num_threads; i++) {
+    renderer->queues[i] = (cpu_queue_t){0};
+    renderer->workers[i] = (cpu_worker_t){renderer, i, SDL_CreateSemaphore(0), 0};
+    renderer->threads[i] = SDL_CreateThread(cpu_worker, "cpu_worker", &renderer->workers[i]);
+  }
+}
+/* Change the image size, keeping the threads - call between frames */
+void cpu_renderer_resize(cpu_renderer_t *renderer, u32 width, u32 height) {
+  free(renderer->image);
+  renderer->width = width;
+  renderer->height = height;
+  renderer->image = (f32 *)calloc((size_t)width * height * 4, sizeof(f32));
+  renderer->tiles_x = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  renderer->tiles_y = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+}
+/* Render and accumulate one frame, returns the number of rays cast */
+u64 cpu_renderer_render(cpu_renderer_t *renderer, const cpu_frame_t *frame) {
+  renderer->frame = *frame;
+  /* Hand every worker a contiguous run of tiles */
+  const u32 num_tiles = renderer->tiles_x * renderer->tiles_y;
+  for (u32 i = 0; i < renderer->num_threads; i++) {
+    renderer->queues[i].head = num_tiles * i / renderer->num_threads;
+    renderer->queues[i].tail = num_tiles * (i + 1) / renderer->num_threads;
+  }
+  /* One start each, so every worker runs this frame exactly once */
+  for (u32 i = 0; i < renderer->num_threads; i++) SDL_SemPost(renderer->workers[i].start);
+  for (u32 i = 0; i < renderer->num_threads; i++) SDL_SemWait(renderer->done);
+  u64 rays = 0;
+  for (u32 i = 0; i < renderer->num_threads; i++) rays += renderer->workers[i].rays;
+  return rays;
+}
+/* Join worker threads and free the image */
+void cpu_renderer_destroy(cpu_renderer_t *renderer) {
+  renderer->quit = true;
+  for (u32 i = 0; i < renderer->num_threads; i++) SDL_SemPost(renderer->workers[i].start);
+  for (u32 i = 0; i < renderer->num_threads; i++) {
+    SDL_WaitThread(renderer->threads[i], NH_NULL);
+    SDL_DestroySemaphore(renderer->workers[i].start);
+  }
+  SDL_DestroySemaphore(renderer->done);
+  free(renderer->image);
+  renderer->image = NH_NULL;
+}
+
+#endif /* CPU_RENDER_H */
@@ -0,0 +1,216 @@
+/* Include guard */
+#if !defined(DISTRIBUTE_H)
+#define DISTRIBUTE_H
+
+/* Includes */
+#include <nh_base.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Offline renders split over worker processes, on this machine or others.
+ * The coordinator listens, every worker connects and is handed units of
+ * work until there are none left. Addresses are either:
+ *
+ *   unix:PATH   a Unix socket, for workers on the same machine
+ *   HOST:PORT   TCP, an empty HOST listens on every interface
+ *
+ * Messages are the structs below as they are in memory, so every process
+ * has to be the same build on the same kind of machine - the version says
+ * which layout it is. A session:
+ *
+ *   worker       dist_hello_t, with a hash of the scene it loaded
+ *   coordinator  dist_job_t, or hangs up on a different scene
+ *   coordinator  dist_unit_t, count 0 when there is no more work
+ *   worker       dist_result_t then the tile's RGBA floats, bottom row first
+ *   ...          units and results until the stopping unit
+ *
+ * A unit is a run of a tile's dispatches, so workers take disjoint sample
+ * ranges of the same pixels as well as different tiles. A result is the
+ * mean over the unit's samples and how many there were, which is what the
+ * coordinator weights it by. A worker that goes away has its unit handed
+ * out again, and so does one that stops partway through a message for
+ * DIST_TIMEOUT_MS - the coordinator reads a whole message once poll says
+ * one has started, so a stalled worker or a stray client that never says
+ * hello only holds it up that long.
+ */
+
+/* Consts */
+#define DIST_MAGIC          0x54534944 /* "DIST" */
+#define DIST_VERSION        1
+#define DIST_MAX_WORKERS    64  /* Connections the coordinator serves at once */
+#define DIST_BANDS          4   /* Bands of tiles the coordinator merges at once */
+#define DIST_CONNECT_TRIES  50  /* A worker may start before the coordinator */
+#define DIST_CONNECT_DELAY_MS 100
+#define DIST_TIMEOUT_MS     2000 /* Longest the coordinator waits on one read or write */
+
+/* Structs */
+/* First message, from the worker */
+typedef struct {
+  u32 magic, version;
+  u32 scene;                    /* dist_hash of the scene, must match */
+  u32 padding;
+} dist_hello_t;
+/* What to render, the same for every unit */
+typedef struct {
+  u32 width, height;            /* Whole image */
+  u32 tile;                     /* Tile side */
+  u32 sampler;                  /* SAMPLER_* */
+  u32 roulette_depth;
+  f32 test_in;                  /* Light strength */
+  f32 camera[6];                /* x, y, z, yaw, pitch, focal length */
+} dist_job_t;
+/* Some of a tile's dispatches, see dist_tile_rect */
+typedef struct {
+  u32 id;                       /* Seeds the worker's random numbers */
+  u32 tile;                     /* Tile index, bands from the top */
+  u32 first;                    /* Dispatch, frame_index starts here */
+  u32 count;                    /* Dispatches, 0 to stop */
+} dist_unit_t;
+/* Answer to a unit, columns x rows RGBA floats follow */
+typedef struct {
+  dist_unit_t unit;
+  u32 samples;                  /* Per pixel, the mean's weight */
+  u32 columns, rows;
+  u32 padding;
+} dist_result_t;
+/* A connected worker, as the coordinator sees it */
+typedef struct {
+  int fd;                       /* -1 for a free slot */
+  i64 unit;                     /* Index of the unit it has, -1 if idle */
+} dist_worker_t;
+
+/* FNV-1a, hash 2166136261 to start */
+u32 dist_hash(u32 hash, const void *data, size_t size) {
+  const u8 *bytes = (const u8 *)data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+/* Left, bottom, columns and rows of a tile - band index / tiles across,
+ * counted from the top like run_render, OpenGL rows from the bottom */
+void dist_tile_rect(const dist_job_t *job, u32 index, u32 rect[4]) {
+  const u32 tiles_x = (job->width + job->tile - 1) / job->tile;
+  const u32 left = index % tiles_x * job->tile;
+  const u32 top = job->height - index / tiles_x * job->tile;
+  rect[2] = job->width - left < job->tile ? job->width - left : job->tile;
+  rect[3] = top < job->tile ? top : job->tile;
+  rect[0] = left;
+  rect[1] = top - rect[3];
+}
+/* Socket for address, unix:PATH or HOST:PORT, bound and listening or
+ * connected. Returns -1 on failure */
+static int dist_socket(const char *address, bool listening) {
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(address + 5) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, address + 5);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    /* A coordinator that did not exit cleanly leaves the path behind */
+    if (listening) unlink(addr.sun_path);
+    const bool success = listening
+      ? bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, DIST_MAX_WORKERS) == 0
+      : connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!success) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+  char host[256];
+  const char *port = strrchr(address, ':');
+  if (port == NH_NULL || (size_t)(port - address) >= sizeof(host)) return -1;
+  memcpy(host, address, port - address);
+  host[port - address] = '\0';
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  struct addrinfo *infos;
+  if (getaddrinfo(host[0] != '\0' ? host : NH_NULL, port + 1, &hints, &infos) != 0) return -1;
+  int fd = -1;
+  for (struct addrinfo *info = infos; info != NH_NULL && fd < 0; info = info->ai_next) {
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd < 0) continue;
+    const int on = 1;
+    if (listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    const bool success = listening
+      ? bind(fd, info->ai_addr, info->ai_addrlen) == 0 && listen(fd, DIST_MAX_WORKERS) == 0
+      : connect(fd, info->ai_addr, info->ai_addrlen) == 0;
+    if (!success) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(infos);
+  return fd;
+}
+/* Coordinator's listening socket, -1 on failure */
+int dist_listen(const char *address) {
+  return dist_socket(address, true);
+}
+/* Next worker to connect, reads and writes time out after DIST_TIMEOUT_MS.
+ * Returns -1 on failure */
+int dist_accept(int listener) {
+  const int fd = accept(listener, NH_NULL, NH_NULL);
+  if (fd < 0) return -1;
+  const struct timeval timeout = {DIST_TIMEOUT_MS / 1000, DIST_TIMEOUT_MS % 1000 * 1000};
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+      || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+/* Close it, removing a Unix socket's path */
+void dist_close_listener(int fd, const char *address) {
+  close(fd);
+  if (strncmp(address, "unix:", 5) == 0) unlink(address + 5);
+}
+/* Worker's connection, retried for a while. Returns -1 on failure */
+int dist_connect(const char *address) {
+  const struct timespec delay = {0, DIST_CONNECT_DELAY_MS * 1000000L};
+  for (u32 i = 0; i < DIST_CONNECT_TRIES; i++) {
+    const int fd = dist_socket(address, false);
+    if (fd >= 0) return fd;
+    nanosleep(&delay, NH_NULL);
+  }
+  return -1;
+}
+/* Whole messages, false if the other end went away or timed out */
+bool dist_send(int fd, const void *data, size_t size) {
+  const u8 *bytes = (const u8 *)data;
+  while (size > 0) {
+    const ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    bytes += sent;
+    size -= (size_t)sent;
+  }
+  return true;
+}
+bool dist_receive(int fd, void *data, size_t size) {
+  u8 *bytes = (u8 *)data;
+  while (size > 0) {
+    const ssize_t received = recv(fd, bytes, size, 0);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) return false;
+    bytes += received;
+    size -= (size_t)received;
+  }
+  return true;
+}
+
+#endif /* DISTRIBUTE_H */
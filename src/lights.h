@@ -0,0 +1,154 @@
+/* Include guard */
+#if !defined(LIGHTS_H)
+#define LIGHTS_H
+
+/* Includes */
+#include <nh_base.h>
+#include <math.h>
+#include <stdlib.h>
+
+/* Project headers */
+#include "scene.h"
+
+/*
+ * Lights for next event estimation - every emissive triangle, picked in
+ * proportion to its power (emission luminance times area) with an alias
+ * table (Vose), so picking one costs the same however many there are:
+ *
+ *   i = floor(u * count)
+ *   if fract(u * count) >= lights[i].threshold:  i = lights[i].alias
+ *
+ * A point is then uniform over the triangle, so the pdf over area is the
+ * light's emission luminance over total_power - the shaders work that out
+ * from the material when a BSDF ray hits a light, no lookup needed. The
+ * test input scales every light alike and is left out.
+ *
+ * A light is an emissive triangle as an instance places it: a mesh placed
+ * twice gives two of each, one placed nowhere gives none. Corners are kept
+ * in world space, so the table is built for a point in time like the top
+ * level - when moving, spinning instances carry lights and it is built
+ * again as they turn.
+ */
+
+/* Structs - std430, mirror Light in common.compute */
+typedef struct {
+  nh_vec3_t v0;                 /* Corners in world space */
+  f32 threshold;                /* Keep this light below it, take the alias above */
+  nh_vec3_t v1;
+  u32 alias;                    /* Index into lights */
+  nh_vec3_t v2;
+  u32 material;                 /* Index into the scene's materials */
+} light_t;
+_Static_assert(sizeof(light_t) == 48, "light_t must match std430");
+typedef struct {
+  light_t *lights;
+  u32 count;
+  f32 total_power;
+  bool moving;                  /* Some are in spinning instances */
+} light_table_t;
+
+/* Emission luminance, power per unit area */
+static inline f32 light_luminance(const material_t *material) {
+  const nh_vec3_t c = material->emission_color;
+  return (0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z) * material->emission_strength;
+}
+static inline f32 light_area(const light_t *light) {
+  const nh_vec3_t a = light->v0, b = light->v1, c = light->v2;
+  const nh_vec3_t e1 = {b.x - a.x, b.y - a.y, b.z - a.z};
+  const nh_vec3_t e2 = {c.x - a.x, c.y - a.y, c.z - a.z};
+  const nh_vec3_t n = {e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x};
+  return 0.5f * sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+}
+/* Primitive p of the scene if it is an emissive triangle, else NH_NULL */
+static inline const triangle_t *light_triangle(const scene_t *scene, u32 p) {
+  if (p < scene->sphere_count) return NH_NULL;
+  const triangle_t *triangle = &scene->triangles[p - scene->sphere_count];
+  return light_luminance(&scene->materials[triangle->material]) > 0.0f ? triangle : NH_NULL;
+}
+
+void lights_destroy(light_table_t *table) {
+  free(table->lights);
+  *table = (light_table_t){0};
+}
+/* Build the table with instances time seconds into their spin, no lights
+ * is not an error */
+bool lights_build(light_table_t *table, const scene_t *scene, f32 time) {
+  *table = (light_table_t){0};
+  for (u32 i = 0; i < scene->instance_count; i++) {
+    const instance_t *instance = &scene->instances[i];
+    const mesh_t *mesh = &scene->meshes[instance->mesh];
+    for (u32 p = mesh->first; p < mesh->first + mesh->count; p++) {
+      if (light_triangle(scene, p) == NH_NULL) continue;
+      table->count++;
+      if (instance->spin != 0.0f) table->moving = true;
+    }
+  }
+  if (table->count == 0) return true;
+  table->lights = (light_t *)malloc(sizeof(light_t) * table->count);
+  f64 *power = (f64 *)malloc(sizeof(f64) * table->count);
+  u32 *work = (u32 *)malloc(sizeof(u32) * 2 * table->count);
+  if (table->lights == NH_NULL || power == NH_NULL || work == NH_NULL) {
+    free(table->lights);
+    free(power);
+    free(work);
+    *table = (light_table_t){0};
+    return false;
+  }
+  f64 total = 0.0;
+  u32 light = 0;
+  for (u32 i = 0; i < scene->instance_count; i++) {
+    const instance_t *instance = &scene->instances[i];
+    const mesh_t *mesh = &scene->meshes[instance->mesh];
+    f32 m[3][4];
+    scene_instance_transform(instance, time, m);
+    for (u32 p = mesh->first; p < mesh->first + mesh->count; p++) {
+      const triangle_t *triangle = light_triangle(scene, p);
+      if (triangle == NH_NULL) continue;
+      table->lights[light] = (light_t){
+        scene_transform_point(m, scene->vertices[triangle->v0].position), 1.0f,
+        scene_transform_point(m, scene->vertices[triangle->v1].position), light,
+        scene_transform_point(m, scene->vertices[triangle->v2].position), triangle->material,
+      };
+      power[light] = (f64)light_luminance(&scene->materials[triangle->material])
+        * light_area(&table->lights[light]);
+      total += power[light];
+      light++;
+    }
+  }
+  table->total_power = (f32)total;
+  /* Degenerate triangles only - they add nothing, so no lights */
+  if (total <= 0.0) {
+    free(power);
+    free(work);
+    lights_destroy(table);
+    return true;
+  }
+
+  /* Vose: scale to a mean of 1, then fill each light below 1 up from one
+   * above. Stacks of both, small from the front of work, large from halfway */
+  u32 *small = work, *large = work + table->count;
+  u32 small_count = 0, large_count = 0;
+  for (u32 i = 0; i < table->count; i++) {
+    power[i] *= table->count / total;
+    if (power[i] < 1.0) small[small_count++] = i;
+    else large[large_count++] = i;
+  }
+  while (small_count > 0 && large_count > 0) {
+    const u32 s = small[--small_count];
+    const u32 l = large[large_count - 1];
+    table->lights[s].threshold = (f32)power[s];
+    table->lights[s].alias = l;
+    /* What l gave away, it may be small now */
+    power[l] -= 1.0 - power[s];
+    if (power[l] < 1.0) {
+      large_count--;
+      small[small_count++] = l;
+    }
+  }
+  /* Leftovers are 1 up to rounding, they keep themselves */
+  free(power);
+  free(work);
+  return true;
+}
+
+#endif /* LIGHTS_H */
@@ -4,6 +4,7 @@
 
 /* Includes */
 #include <nh_base.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
 #include <GL/glext.h>
@@ -13,6 +14,26 @@ PFNGLGENBUFFERSPROC glGenBuffers = NH_NULL;
 PFNGLBINDBUFFERPROC glBindBuffer = NH_NULL;
 PFNGLBUFFERDATAPROC glBufferData = NH_NULL;
 PFNGLDELETEBUFFERSPROC glDeleteBuffers = NH_NULL;
+PFNGLBUFFERSUBDATAPROC glBufferSubData = NH_NULL;
+PFNGLGETBUFFERSUBDATAPROC glGetBufferSubData = NH_NULL;
+PFNGLBINDBUFFERBASEPROC glBindBufferBase = NH_NULL;
+PFNGLMAPBUFFERRANGEPROC glMapBufferRange = NH_NULL;
+PFNGLUNMAPBUFFERPROC glUnmapBuffer = NH_NULL;
+PFNGLBUFFERSTORAGEPROC glBufferStorage = NH_NULL;
+/* Strings */
+PFNGLGETSTRINGIPROC glGetStringi = NH_NULL;
+/* Sync objects */
+PFNGLFENCESYNCPROC glFenceSync = NH_NULL;
+PFNGLCLIENTWAITSYNCPROC glClientWaitSync = NH_NULL;
+PFNGLDELETESYNCPROC glDeleteSync = NH_NULL;
+/* Queries */
+PFNGLGENQUERIESPROC glGenQueries = NH_NULL;
+PFNGLDELETEQUERIESPROC glDeleteQueries = NH_NULL;
+PFNGLBEGINQUERYPROC glBeginQuery = NH_NULL;
+PFNGLENDQUERYPROC glEndQuery = NH_NULL;
+PFNGLQUERYCOUNTERPROC glQueryCounter = NH_NULL;
+PFNGLGETQUERYOBJECTIVPROC glGetQueryObjectiv = NH_NULL;
+PFNGLGETQUERYOBJECTUI64VPROC glGetQueryObjectui64v = NH_NULL;
 /* Shaders */
 PFNGLCREATESHADERPROC glCreateShader = NH_NULL;
 PFNGLSHADERSOURCEPROC glShaderSource = NH_NULL;
@@ -28,6 +49,10 @@ PFNGLGETPROGRAMIVPROC glGetProgramiv = NH_NULL;
 PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog = NH_NULL;
 PFNGLUSEPROGRAMPROC glUseProgram = NH_NULL;
 PFNGLDELETEPROGRAMPROC glDeleteProgram = NH_NULL;
+PFNGLPROGRAMPARAMETERIPROC glProgramParameteri = NH_NULL;
+PFNGLGETPROGRAMBINARYPROC glGetProgramBinary = NH_NULL;
+PFNGLPROGRAMBINARYPROC glProgramBinary = NH_NULL;
+PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreadsKHR = NH_NULL;
 /* Uniforms */
 PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation = NH_NULL;
 PFNGLUNIFORM1FVPROC glUniform1fv = NH_NULL;
@@ -37,6 +62,7 @@ PFNGLUNIFORM4FVPROC glUniform4fv = NH_NULL;
 PFNGLUNIFORMMATRIX4FVPROC glUniformMatrix4fv = NH_NULL;
 PFNGLUNIFORM1FPROC glUniform1f = NH_NULL;
 PFNGLUNIFORM1UIPROC glUniform1ui = NH_NULL;
+PFNGLUNIFORM2IPROC glUniform2i = NH_NULL;
 /* Attributes */
 PFNGLGETATTRIBLOCATIONPROC glGetAttribLocation = NH_NULL;
 PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer = NH_NULL;
@@ -51,6 +77,7 @@ PFNGLCOPYIMAGESUBDATAPROC glCopyImageSubData = NH_NULL;
 /* Compute shaders */
 PFNGLDISPATCHCOMPUTEPROC glDispatchCompute = NH_NULL;
 PFNGLMEMORYBARRIERPROC glMemoryBarrier = NH_NULL;
+PFNGLDISPATCHCOMPUTEINDIRECTPROC glDispatchComputeIndirect = NH_NULL;
 
 /* Function to load */
 bool loadGL(void) {
@@ -64,6 +91,41 @@ bool loadGL(void) {
   if (glBufferData == NH_NULL) return false;
   glDeleteBuffers = (PFNGLDELETEBUFFERSPROC) SDL_GL_GetProcAddress("glDeleteBuffers");
   if (glDeleteBuffers == NH_NULL) return false;
+  glBufferSubData = (PFNGLBUFFERSUBDATAPROC) SDL_GL_GetProcAddress("glBufferSubData");
+  if (glBufferSubData == NH_NULL) return false;
+  glGetBufferSubData = (PFNGLGETBUFFERSUBDATAPROC) SDL_GL_GetProcAddress("glGetBufferSubData");
+  if (glGetBufferSubData == NH_NULL) return false;
+  glBindBufferBase = (PFNGLBINDBUFFERBASEPROC) SDL_GL_GetProcAddress("glBindBufferBase");
+  if (glBindBufferBase == NH_NULL) return false;
+  glMapBufferRange = (PFNGLMAPBUFFERRANGEPROC) SDL_GL_GetProcAddress("glMapBufferRange");
+  if (glMapBufferRange == NH_NULL) return false;
+  glUnmapBuffer = (PFNGLUNMAPBUFFERPROC) SDL_GL_GetProcAddress("glUnmapBuffer");
+  if (glUnmapBuffer == NH_NULL) return false;
+
+  glGetStringi = (PFNGLGETSTRINGIPROC) SDL_GL_GetProcAddress("glGetStringi");
+  if (glGetStringi == NH_NULL) return false;
+
+  glFenceSync = (PFNGLFENCESYNCPROC) SDL_GL_GetProcAddress("glFenceSync");
+  if (glFenceSync == NH_NULL) return false;
+  glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC) SDL_GL_GetProcAddress("glClientWaitSync");
+  if (glClientWaitSync == NH_NULL) return false;
+  glDeleteSync = (PFNGLDELETESYNCPROC) SDL_GL_GetProcAddress("glDeleteSync");
+  if (glDeleteSync == NH_NULL) return false;
+
+  glGenQueries = (PFNGLGENQUERIESPROC) SDL_GL_GetProcAddress("glGenQueries");
+  if (glGenQueries == NH_NULL) return false;
+  glDeleteQueries = (PFNGLDELETEQUERIESPROC) SDL_GL_GetProcAddress("glDeleteQueries");
+  if (glDeleteQueries == NH_NULL) return false;
+  glBeginQuery = (PFNGLBEGINQUERYPROC) SDL_GL_GetProcAddress("glBeginQuery");
+  if (glBeginQuery == NH_NULL) return false;
+  glEndQuery = (PFNGLENDQUERYPROC) SDL_GL_GetProcAddress("glEndQuery");
+  if (glEndQuery == NH_NULL) return false;
+  glQueryCounter = (PFNGLQUERYCOUNTERPROC) SDL_GL_GetProcAddress("glQueryCounter");
+  if (glQueryCounter == NH_NULL) return false;
+  glGetQueryObjectiv = (PFNGLGETQUERYOBJECTIVPROC) SDL_GL_GetProcAddress("glGetQueryObjectiv");
+  if (glGetQueryObjectiv == NH_NULL) return false;
+  glGetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC) SDL_GL_GetProcAddress("glGetQueryObjectui64v");
+  if (glGetQueryObjectui64v == NH_NULL) return false;
 
   glCreateShader = (PFNGLCREATESHADERPROC) SDL_GL_GetProcAddress("glCreateShader");
   if (glCreateShader == NH_NULL) return false;
@@ -109,6 +171,8 @@ bool loadGL(void) {
   if (glUniform1f == NH_NULL) return false;
   glUniform1ui = (PFNGLUNIFORM1UIPROC) SDL_GL_GetProcAddress("glUniform1ui");
   if (glUniform1ui == NH_NULL) return false;
+  glUniform2i = (PFNGLUNIFORM2IPROC) SDL_GL_GetProcAddress("glUniform2i");
+  if (glUniform2i == NH_NULL) return false;
 
   glEnableVertexAttribArray = (PFNGLENABLEVERTEXATTRIBARRAYPROC) SDL_GL_GetProcAddress("glEnableVertexAttribArray");
   if (glEnableVertexAttribArray == NH_NULL) return false;
@@ -123,17 +187,58 @@ bool loadGL(void) {
   glDeleteVertexArrays = (PFNGLDELETEVERTEXARRAYSPROC) SDL_GL_GetProcAddress("glDeleteVertexArrays");
   if (glDeleteVertexArrays == NH_NULL) return false;
 
+  /* OpenGL 4.1 only - may be missing, programs are compiled every time */
+  glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC) SDL_GL_GetProcAddress("glProgramParameteri");
+  glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC) SDL_GL_GetProcAddress("glGetProgramBinary");
+  glProgramBinary = (PFNGLPROGRAMBINARYPROC) SDL_GL_GetProcAddress("glProgramBinary");
+  /* KHR_parallel_shader_compile, or the ARB version - see hasExtensionGL() */
+  glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+  if (glMaxShaderCompilerThreadsKHR == NH_NULL) {
+    glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+  }
+
+  /* OpenGL 4.3 only - may be missing, the CPU renderer is used instead */
   glBindImageTexture = (PFNGLBINDIMAGETEXTUREPROC) SDL_GL_GetProcAddress("glBindImageTexture");
-  if (glBindImageTexture == NH_NULL) return false;
   glCopyImageSubData = (PFNGLCOPYIMAGESUBDATAPROC) SDL_GL_GetProcAddress("glCopyImageSubData");
-  if (glCopyImageSubData == NH_NULL) return false;
 
   glDispatchCompute = (PFNGLDISPATCHCOMPUTEPROC) SDL_GL_GetProcAddress("glDispatchCompute");
-  if (glDispatchCompute == NH_NULL) return false;
   glMemoryBarrier = (PFNGLMEMORYBARRIERPROC) SDL_GL_GetProcAddress("glMemoryBarrier");
-  if (glMemoryBarrier == NH_NULL) return false;
+  glDispatchComputeIndirect = (PFNGLDISPATCHCOMPUTEINDIRECTPROC) SDL_GL_GetProcAddress("glDispatchComputeIndirect");
+
+  /* OpenGL 4.4 only - may be missing, buffers are not persistently mapped */
+  glBufferStorage = (PFNGLBUFFERSTORAGEPROC) SDL_GL_GetProcAddress("glBufferStorage");
 
   return true;
 }
+/* Are compute shaders usable? Call after loadGL() */
+bool hasComputeGL(void) {
+  i32 major = 0, minor = 0;
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  glGetIntegerv(GL_MINOR_VERSION, &minor);
+  if (major < 4 || (major == 4 && minor < 3)) return false;
+  return glBindImageTexture != NH_NULL
+    && glDispatchCompute != NH_NULL
+    && glMemoryBarrier != NH_NULL
+    && glDispatchComputeIndirect != NH_NULL;
+}
+/* Does the context list the extension? Call after loadGL() - function
+ * pointers alone say nothing, GLX hands them out for any name */
+bool hasExtensionGL(const char *name) {
+  i32 count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (i32 i = 0; i < count; i++) {
+    const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, (u32)i);
+    if (extension != NH_NULL && strcmp(extension, name) == 0) return true;
+  }
+  return false;
+}
+/* Can buffers be persistently mapped? Call after loadGL() */
+bool hasBufferStorageGL(void) {
+  i32 major = 0, minor = 0;
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  glGetIntegerv(GL_MINOR_VERSION, &minor);
+  if (major < 4 || (major == 4 && minor < 4)) return false;
+  return glBufferStorage != NH_NULL;
+}
 
 #endif /* LOADGL_H */
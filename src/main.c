@@ -1,3 +1,6 @@
+/* POSIX - mmap in scene.h */
+#define _POSIX_C_SOURCE 200809L
+
 /* Neushoorn includes */
 #include <nh_base.h>
 #include <ext/nh_logging.h>
@@ -8,12 +11,27 @@
 #include <SDL2/SDL_opengl.h>
 
 /* stdlib includes */
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 /* Project headers */
 #include "loadgl.h"
+#include "programs.h"
+#include "scene.h"
+#include "lights.h"
+#include "cpu_render.h"
+#include "rayquery.h"
+#include "ui.h"
+#include "profiler.h"
+#include "bluenoise.h"
+#include "converge.h"
+#include "watch.h"
+#include "output.h"
+#include "capture.h"
+#include "distribute.h"
 
 /* Structs */
 typedef struct {
@@ -25,17 +43,120 @@ typedef struct {
   u8 for_active; /* Is SDL_SCANCODE */
   f32 sensitivity;
 } slider_t;
-
+/* Camera a frame was traced with, what reprojection maps pixels back through */
+typedef struct {
+  nh_vec3_t camera;
+  f32 angle_x, angle_y;
+  f32 focal_length;
+  i32 render_width, render_height;
+} view_t;
+/* A program hot reload can rebuild, and where the program in use is kept */
+typedef struct {
+  u32 *program;                 /* Replaced once the whole batch has linked */
+  program_desc_t desc;          /* What it is built from */
+  program_build_t build;        /* This batch's build */
+  bool dirty;                   /* A file it reads changed since its last build */
+  bool building;                /* In the batch being built */
+} reload_slot_t;
 /* Consts */
-#define COMPUTE_WIDTH       512
-#define COMPUTE_HEIGHT      512
+#define BENCH_WIDTH         512 /* Benchmark image, independent of the window */
+#define BENCH_HEIGHT        512
+#define TARGET_FRAME_MS     33.3f /* Default frame time to hold while moving */
+#define MAX_RENDER_SCALE    4   /* Coarsest resolution divisor */
+#define REFINE_FRAMES       4   /* Frames accumulated before refining when still */
+#define ADAPTIVE_THRESHOLD  0.02f /* Default relative standard error of a converged pixel */
+#define DENOISE_ITERATIONS  4   /* A-trous passes, the step doubles each time */
+#define TRACE_GROUP_WIDTH   16  /* Default local_size_x and y of shader.compute */
+#define TRACE_GROUP_HEIGHT  16
+#define TUNE_GROUPS         4   /* Workgroup sizes timed, see tune_groups */
+#define TUNE_WARMUP         1   /* Dispatches per size not timed */
+#define TUNE_DISPATCHES     3   /* Dispatches per size timed */
+#define DENOISE_GROUP_SIZE  8   /* local_size_x and y of denoise.compute */
+#define REPROJECT_GROUP_SIZE 8  /* local_size_x and y of reproject.compute */
+#define RESOLVE_GROUP_SIZE  8   /* local_size_x and y of resolve.compute */
+#define TONEMAP_CLAMP       0   /* Tonemap operators, must match resolve.compute */
+#define TONEMAP_REINHARD    1
+#define TONEMAP_ACES        2
+#define TONEMAPS            3
+#define SAMPLER_PCG         0   /* Sampler types, must match common.compute */
+#define SAMPLER_SOBOL       1
+#define SAMPLER_BLUE_NOISE  2
+#define SAMPLERS            3
 #define FONT_COLS           24
 #define FONT_ROWS           4
+#define NUM_RAYS            4   /* Defined for the kernels, see create_compute_program */
+#define MAX_BOUNCES         8
+#define ROULETTE_DEPTH      3   /* Default surfaces hit before Russian roulette */
+#define PATH_END_ESCAPED    0   /* Why paths end, must match common.compute */
+#define PATH_END_ROULETTE   1
+#define PATH_END_MAX_BOUNCES 2
+#define PATH_ENDS           3
+/* Ray counter block, u32 offsets - must match common.compute */
+#define COUNTER_RAYS          0
+#define COUNTER_PATH_LENGTHS  1
+#define COUNTER_PATH_ENDS     (COUNTER_PATH_LENGTHS + MAX_BOUNCES + 1)
+#define COUNTERS              (COUNTER_PATH_ENDS + PATH_ENDS)
+#define BENCH_FRAMES        256 /* Default number of benchmark dispatches */
+#define BENCH_WARMUP        8   /* Dispatches not included in the results */
+#define PROGRAM_CACHE_DIR   "program_cache" /* Default program binary cache */
+#define RENDER_WIDTH        3840 /* Default offline render size */
+#define RENDER_HEIGHT       2160
+#define RENDER_SAMPLES      1024 /* Default offline samples per pixel */
+#define RENDER_MAX_SAMPLES  (1u << 20) /* More would take days per tile */
+#define RENDER_TILE         256 /* Default tile side, the render target's size */
+#define RENDER_MAX_TILE     16384 /* Past any texture size, see tile_fits */
+#define UNIT_DISPATCHES     16  /* Default dispatches a worker takes at a time */
+#define RECORD_PATH         "capture.rgb" /* Default video, see start_recording */
+#define RECORD_FPS          30  /* Default video frame rate */
+#define RECORD_MAX_FPS      240 /* Faster than any display worth recording */
+#define RELOAD_SLOTS        16  /* Programs hot reload keeps track of */
+#define RELOAD_DELAY_MS     100 /* Quiet time after a save before rebuilding */
+#define RELOAD_STRING_SIZE  80  /* HUD line, about the width of the window */
+/* Wavefront kernels, sizes must match wavefront.compute */
+#define WAVEFRONT_GENERATE    0
+#define WAVEFRONT_EXTEND      1
+#define WAVEFRONT_SHADE       2
+#define WAVEFRONT_DISPATCH    3
+#define WAVEFRONT_SHADOW      4
+#define WAVEFRONT_ACCUMULATE  5
+#define WAVEFRONT_KERNELS     6
+#define WAVEFRONT_GROUP_SIZE  64  /* local_size_x, defined for the kernels */
+#define WAVEFRONT_PATH_SIZE   64  /* sizeof(Path) */
+#define WAVEFRONT_SHADOW_SIZE 48  /* sizeof(ShadowRay) */
+#define WAVEFRONT_ARGS_SIZE   40  /* Wavefront block */
+#define WAVEFRONT_SHADOW_ARGS 12  /* Offset of shadow_args */
 
 const char *font_chars =  " !\"#$%&'()*+,-./01234567"
                           "89:;<=>?@ABCDEFGHIJKLMNO"
                           "PQRSTUVWXYZ[\\]^_`abcdefg"
                           "hijklmnopqrstuvwxyz{|}~";
+/* Megakernel workgroup sizes the tuner times, width by height */
+const u32 tune_groups[TUNE_GROUPS][2] = {{8, 8}, {16, 8}, {16, 16}, {32, 32}};
+const char *wavefront_defines[WAVEFRONT_KERNELS] = {
+  "#define KERNEL_GENERATE\n",
+  "#define KERNEL_EXTEND\n",
+  "#define KERNEL_SHADE\n",
+  "#define KERNEL_DISPATCH\n",
+  "#define KERNEL_SHADOW\n",
+  "#define KERNEL_ACCUMULATE\n",
+};
+/* Per SAMPLER_*: --sampler option, log name and HUD hint */
+const char *sampler_options[SAMPLERS] = {"pcg", "sobol", "blue-noise"};
+const char *sampler_names[SAMPLERS] = {"PCG", "Sobol", "blue-noise"};
+const char *sampler_hints[SAMPLERS] = {
+  "[G]          = sampler: PCG",
+  "[G]          = sampler: Sobol",
+  "[G]          = sampler: blue noise",
+};
+/* Per TONEMAP_*: --tonemap option, log name and HUD hint */
+const char *tonemap_options[TONEMAPS] = {"clamp", "reinhard", "aces"};
+const char *tonemap_names[TONEMAPS] = {"clamp", "Reinhard", "ACES"};
+const char *tonemap_hints[TONEMAPS] = {
+  "[X]          = tonemap: clamp",
+  "[X]          = tonemap: Reinhard",
+  "[X]          = tonemap: ACES",
+};
+const char *path_end_names[PATH_ENDS] = {"escaped", "roulette", "max_bounces"};
 const f32 vertices[] = {
   -1.0f, -1.0f, 0.0f,   0.0f, 0.0f,
    1.0f, -1.0f, 0.0f,   1.0f, 0.0f,
@@ -57,10 +178,92 @@ struct {
   u32 vbo;                      /* Vertex buffer object */
   u32 vao;                      /* Vertex array object */
   u32 shader_program;           /* Shader program */
+  program_cache_t programs;     /* Program binaries from earlier runs */
+  const char *program_cache_dir; /* Where they are, NH_NULL for none */
+  /* Hot reload */
+  watch_t watch;                /* Shader source changes, fd -1 if not watching */
+  reload_slot_t reload_slots[RELOAD_SLOTS]; /* Every program, how to rebuild it */
+  u32 reload_slot_count;        /* Slots in use */
+  u64 reload_at;                /* Counter value to start a batch at, 0 for none */
+  u64 reload_start;             /* When the batch being built started */
+  bool reloading;               /* Batch being built? */
+  char reload_string[RELOAD_STRING_SIZE]; /* Last batch's outcome */
   u32 texture;                  /* Texture */
   u32 font_texture;             /* Font texture */
   u32 compute_shader;           /* Compute shader */
-  u32 solid_shader;             /* Solid shader */
+  u32 group_width, group_height; /* Its workgroup size, from --group, the cache or tuning */
+  bool morton;                  /* Morton order inside its workgroups */
+  bool tune;                    /* Time the workgroup sizes at startup */
+  ui_t ui;                      /* HUD batcher */
+  u32 ray_counter;              /* Ray and path counters storage buffer */
+  bool has_compute;             /* Compute shaders usable? */
+  /* Wavefront pipeline */
+  bool use_wavefront;           /* Wavefront kernels instead of the megakernel */
+  bool has_wavefront;           /* Wavefront kernels compiled? */
+  u32 wavefront_kernels[WAVEFRONT_KERNELS]; /* Kernel programs */
+  u32 path_buffer;              /* Path state storage buffer */
+  u32 ray_queue_buffer;         /* Ray queues storage buffer */
+  u32 shadow_queue_buffer;      /* Shadow ray queue storage buffer */
+  u32 wavefront_buffer;         /* Queue counts and indirect dispatch args */
+  u32 accumulation_buffer;      /* Per-pixel sample sums */
+  /* Resolution */
+  i32 image_width, image_height;   /* Render target, the window's size */
+  i32 render_width, render_height; /* Pixels traced, top left of the target */
+  u32 render_scale;             /* Resolution divisor: 1, 2 or 4 */
+  i32 view_x, view_y;           /* Where the render target is in the view, see run_render */
+  i32 view_width, view_height;  /* The whole view, 0 when it is the render target */
+  f32 target_ms;                /* Frame time to hold while moving */
+  char resolution_string[64];   /* Resolution string */
+  /* Adaptive sampling */
+  bool adaptive;                /* Stop sampling converged pixels */
+  f32 adaptive_threshold;       /* Relative standard error counted as converged */
+  u32 pixel_stats_buffer;       /* Per-pixel sample statistics */
+  /* Russian roulette */
+  u32 roulette_depth;           /* Surfaces hit before it, MAX_BOUNCES for none */
+  /* Denoiser */
+  bool denoise;                 /* Filter the image before drawing it */
+  bool has_denoise;             /* Denoise kernel compiled? */
+  u32 denoise_program;          /* Denoise kernel */
+  u32 normal_depth_texture;     /* First-hit normal and distance */
+  u32 albedo_texture;           /* First-hit albedo */
+  u32 denoise_textures[2];      /* Ping-pong between iterations */
+  /* Display image */
+  bool has_resolve;             /* Resolve kernel compiled? Else the quad shows texture as is */
+  u32 resolve_program;          /* Resolve kernel */
+  u32 display_texture;          /* Tonemapped and sRGB encoded, what the quad samples */
+  u32 display_format;           /* GL_RGBA8 or GL_R11F_G11F_B10F */
+  u32 tonemap;                  /* TONEMAP_*, how the resolve maps HDR to display */
+  f32 exposure;                 /* Stops applied before it */
+  /* Temporal reprojection */
+  bool has_reproject;           /* Reprojection kernel compiled? */
+  u32 reproject_program;        /* Reprojection kernel */
+  bool history_valid;           /* Image and statistics hold a traced frame? */
+  bool reset_history;           /* This frame's pixels start over */
+  view_t history_view;          /* Camera they were traced with */
+  f32 history_test_in;          /* Light strength they were traced with */
+  u32 history_texture;          /* Previous image, swaps with texture */
+  u32 history_stats_buffer;     /* Previous statistics, swaps with pixel_stats_buffer */
+  /* Sampler */
+  u32 sampler;                  /* SAMPLER_*, what random numbers come from */
+  u32 frame_index;              /* GPU frames traced, never reset */
+  u32 blue_noise_buffer;        /* Blue-noise mask storage buffer */
+  /* Scene */
+  const char *scene_path;       /* Scene file, built-in scene if NH_NULL */
+  scene_t scene;                /* Geometry, materials and BVH */
+  u32 sphere_buffer;            /* Spheres storage buffer */
+  u32 triangle_buffers[3];      /* Triangles as first vertex and two edges */
+  u32 bvh_node_buffer;          /* BVH nodes storage buffer */
+  u32 bvh_ref_buffer;           /* BVH primitive refs storage buffer */
+  u32 material_buffer;          /* Materials storage buffer */
+  light_table_t lights;         /* Emissive triangles, for light sampling */
+  u32 light_buffer;             /* Lights storage buffer */
+  u32 tlas_buffer;              /* Top level uniform buffer, over instances */
+  bool animate;                 /* Spin instances that have a spin */
+  f32 animation_time;           /* Seconds animated so far */
+  f32 history_animation_time;   /* Where instances were for the history */
+  /* CPU renderer */
+  bool use_cpu;                 /* Render on the CPU instead */
+  cpu_renderer_t cpu;           /* CPU renderer */
   /* Other state */
   f32 focal_length;             /* Focal length */
   u32 ticks;                    /* Ticks since last movement */
@@ -68,10 +271,46 @@ struct {
   f32 fps;                      /* Frames per second */
   char fps_string[64];          /* FPS string */
   char delta_string[64];        /* Delta time string */
+  char pick_string[64];         /* Last picked primitive */
+  /* Profiling */
+  profiler_t profiler;          /* GPU timings per stage */
+  const char *profile_path;     /* CSV of the timings, or NH_NULL */
+  char gpu_string[64];          /* GPU frame and trace times */
+  char stages_string[64];       /* GPU denoise, blit and HUD times */
+  char invocations_string[64];  /* Compute invocations */
   f32 test_in;                  /* An input used for testing */
   f32 angle_x, angle_y;         /* Camera rotation: yaw, pitch */
   nh_vec3_t camera;             /* Camera position */
   u8 active_slider;             /* Active slider */
+  /* Benchmark */
+  bool bench;                   /* Run headless benchmark instead */
+  u32 bench_frames;             /* Number of dispatches to time */
+  /* Convergence benchmark */
+  const char *converge_dir;     /* References, run it if not NH_NULL */
+  u32 converge_frames;          /* Frames per pose */
+  bool render_references;       /* Render the references instead */
+  u32 reference_frames;         /* Frames per reference */
+  const char *report_path;      /* CSV of the checkpoints, or NH_NULL */
+  const char *baseline_path;    /* Earlier report to compare with, or NH_NULL */
+  /* Offline render */
+  const char *output_path;      /* PNG or EXR to render, run it if not NH_NULL */
+  u32 output_width, output_height; /* Its size */
+  u32 output_samples;           /* Samples per pixel */
+  u32 tile_size;                /* Tile side, the render target is one tile */
+  const char *camera_string;    /* --camera, NH_NULL for the starting view */
+  bool resume;                  /* Carry on from the checkpoint */
+  /* Distributed render */
+  const char *coordinate_address; /* Hand the offline render out to workers here */
+  const char *worker_address;   /* Render units for the coordinator there */
+  u32 unit_dispatches;          /* Dispatches in a unit of work */
+  /* Capture */
+  capture_t capture;            /* Screenshots and video, read back without stalling */
+  bool has_capture;             /* Writer thread running? */
+  const char *record_path;      /* Video file, or '|' and a command to pipe it to */
+  bool record;                  /* Start recording straight away */
+  u32 record_fps;               /* Video frame rate */
+  u32 screenshots;              /* Taken this run, numbers the files */
+  char capture_string[64];      /* Recording progress */
 } state;
 
 /* More state */
@@ -81,79 +320,296 @@ slider_t sliders[] = {
 };
 
 /* Utils */
-char *get_file_contents(const char *filename) {
-  FILE *file = fopen(filename, "rb");
-  if (file == NH_NULL) {
-    return NH_NULL;
-  }
-  fseek(file, 0, SEEK_END);
-  size_t filesize = ftell(file);
-  fseek(file, 0, SEEK_SET);
-  char *contents = (char *)malloc(filesize + 1);
-  fread(contents, 1, filesize, file);
-  fclose(file);
-  contents[filesize] = '\0';
-  return contents;
-}
-void render_character(char c, nh_vec2_t pos, f32 scale) {
-  /* RENDER CHARACTER */
-  u32 char_vao, char_vbo;
-  /* Create character vao */
-  glGenVertexArrays(1, &char_vao);
-  glBindVertexArray(char_vao);
-  /* Find character */
-  u8 char_row, char_col;
-  bool char_found = false;
-  for (u8 i = 0; i < FONT_ROWS * FONT_COLS; i++) {
-    if (font_chars[i] == c) {
-      char_row = i / FONT_COLS;
-      char_col = i % FONT_COLS;
-      char_found = true;
-      break;
-    }
+/* Create a program into *program, returns it or 0 on failure. Ones that
+ * work get a reload slot, so hot reload can replace them */
+u32 create_program(u32 *program, const program_desc_t *desc) {
+  *program = program_create(&state.programs, desc);
+  if (*program == 0) return 0;
+  if (state.reload_slot_count == RELOAD_SLOTS) {
+    NH_ERROR("No reload slot for %s, raise RELOAD_SLOTS", desc->name);
+  } else {
+    state.reload_slots[state.reload_slot_count++] = (reload_slot_t){program, *desc, {0}, false, false};
   }
-  if (!char_found) {
-    char_row = 3;
-    char_col = 23;
-  }
-  /* Create char_vertices */
-  f32 x = 1.0f / (f32)FONT_COLS;
-  f32 y = 1.0f / (f32)FONT_ROWS;
-  f32 char_vertices[] = {
-    pos.x-scale, pos.y-scale, 1.0f, x*char_col, y*(char_row+1),
-    pos.x+scale, pos.y-scale, 1.0f, x*(char_col+1), y*(char_row+1),
-    pos.x+scale, pos.y+scale, 1.0f, x*(char_col+1), y*char_row,
-    pos.x-scale, pos.y-scale, 1.0f, x*char_col, y*(char_row+1),
-    pos.x+scale, pos.y+scale, 1.0f, x*(char_col+1), y*char_row,
-    pos.x-scale, pos.y+scale, 1.0f, x*char_col, y*char_row,
+  return *program;
+}
+/* Compute program from common.compute then filename. Every kernel gets the
+ * sample and bounce counts, defines add to them */
+program_desc_t compute_program_desc(const char *filename, const char *defines) {
+  program_desc_t desc = {filename, {{GL_COMPUTE_SHADER, {"common.compute", filename}}}, 1, {0}};
+  snprintf(desc.defines, sizeof(desc.defines), "#define MAX_BOUNCES %d\n#define NUM_RAYS %d\n%s",
+      MAX_BOUNCES, NUM_RAYS, defines);
+  return desc;
+}
+/* Megakernel with the workgroup size in state */
+program_desc_t trace_program_desc(void) {
+  char defines[256];
+  snprintf(defines, sizeof(defines), "#define GROUP_WIDTH %u\n#define GROUP_HEIGHT %u\n%s",
+      state.group_width, state.group_height, state.morton ? "#define MORTON_ORDER\n" : "");
+  return compute_program_desc("shader.compute", defines);
+}
+/* Compute program, returns 0 on failure */
+u32 create_compute_program(u32 *program, const char *filename, const char *defines) {
+  const program_desc_t desc = compute_program_desc(filename, defines);
+  return create_program(program, &desc);
+}
+/* Vertex and fragment program, returns 0 on failure */
+u32 create_draw_program(u32 *program, const char *vertex_file, const char *fragment_file) {
+  const program_desc_t desc = {
+    fragment_file,
+    {{GL_VERTEX_SHADER, {vertex_file, NH_NULL}}, {GL_FRAGMENT_SHADER, {fragment_file, NH_NULL}}},
+    2, {0},
   };
-  /* Create character vbo */
-  glGenBuffers(1, &char_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, char_vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(f32) * 6 * 5, char_vertices, GL_STATIC_DRAW);
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(f32), (void *)0);
-  glEnableVertexAttribArray(1);
-  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(f32), (void *)(3 * sizeof(f32)));
-  /* Bind texture */
-  glBindTexture(GL_TEXTURE_2D, state.font_texture);
-  /* Render character */
-  glUseProgram(state.shader_program);
-  glBindVertexArray(char_vao);
-  glDrawArrays(GL_TRIANGLES, 0, 6);
-  glBindVertexArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glDeleteVertexArrays(1, &char_vao);
-  glDeleteBuffers(1, &char_vbo);
+  return create_program(program, &desc);
+}
+u32 create_storage_buffer(u32 binding, size_t size, const void *data) {
+  u32 buffer;
+  glGenBuffers(1, &buffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+  /* Empty sections (no spheres, say) still need something bound */
+  if (size == 0) {
+    size = 16;
+    data = NH_NULL;
+  }
+  glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, GL_STATIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  return buffer;
+}
+bool load_scene(void) {
+  u64 start = SDL_GetPerformanceCounter();
+  bool success = state.scene_path != NH_NULL
+    ? scene_load(&state.scene, state.scene_path)
+    : scene_builtin(&state.scene);
+  u64 end = SDL_GetPerformanceCounter();
+  if (!success) {
+    NH_ERROR("Failed to load scene %s: %s",
+        state.scene_path != NH_NULL ? state.scene_path : "(built-in)", scene_error);
+    return false;
+  }
+  NH_LOG_ENTRY(
+      "Scene: %u spheres, %u triangles, %u materials, %u meshes, %u instances, %u BVH nodes, %.2fms",
+      state.scene.sphere_count, state.scene.triangle_count, state.scene.material_count,
+      state.scene.mesh_count, state.scene.instance_count, state.scene.bvh.node_count,
+      (f64)(end - start) * 1000.0 / (f64)SDL_GetPerformanceFrequency()
+  );
+  /* Light table, not part of the scene file */
+  start = SDL_GetPerformanceCounter();
+  if (!lights_build(&state.lights, &state.scene, 0.0f)) {
+    NH_ERROR("Failed to build light table: out of memory");
+    return false;
+  }
+  end = SDL_GetPerformanceCounter();
+  NH_LOG_ENTRY(
+      "Lights: %u emissive triangles%s, %.2fms",
+      state.lights.count, state.lights.moving ? " (moving)" : "", (f64)(end - start) * 1000.0 / (f64)SDL_GetPerformanceFrequency()
+  );
+  return true;
+}
+/* One path per target pixel, each queue can hold all of them */
+void create_wavefront_buffers(void) {
+  const size_t num_paths = (size_t)state.image_width * state.image_height;
+  state.path_buffer = create_storage_buffer(8, WAVEFRONT_PATH_SIZE * num_paths, NH_NULL);
+  state.ray_queue_buffer = create_storage_buffer(9, 2 * sizeof(u32) * num_paths, NH_NULL);
+  state.shadow_queue_buffer = create_storage_buffer(10, WAVEFRONT_SHADOW_SIZE * num_paths, NH_NULL);
+  /* The kernels expect the ray counts to start at zero */
+  const u32 zeros[WAVEFRONT_ARGS_SIZE / sizeof(u32)] = {0};
+  state.wavefront_buffer = create_storage_buffer(11, WAVEFRONT_ARGS_SIZE, zeros);
+  state.accumulation_buffer = create_storage_buffer(12, 4 * sizeof(f32) * num_paths, NH_NULL);
+}
+/* Texture for the compute kernels */
+u32 create_texture(u32 format, i32 width, i32 height) {
+  u32 texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexImage2D(
+      GL_TEXTURE_2D, 0, format, width, height, 0,
+      GL_RGBA, GL_FLOAT, NH_NULL
+  );
   glBindTexture(GL_TEXTURE_2D, 0);
+  return texture;
 }
-f32 render_string(const char *str, nh_vec2_t pos, f32 scale) {
-  f32 size = 0;
-  for (u32 i = 0; str[i] != '\0'; i++) {
-    render_character(str[i], (nh_vec2_t){pos.x+(i+1)*scale, pos.y}, scale);
-    size += scale;
+/* One the size of the render target */
+u32 create_target_texture(u32 format) {
+  return create_texture(format, state.image_width, state.image_height);
+}
+/* Trace 1/scale of the target in each direction, restarting accumulation */
+void set_render_scale(u32 scale) {
+  state.render_scale = scale;
+  state.render_width = (state.image_width + (i32)scale - 1) / (i32)scale;
+  state.render_height = (state.image_height + (i32)scale - 1) / (i32)scale;
+  cpu_renderer_resize(&state.cpu, (u32)state.render_width, (u32)state.render_height);
+  sprintf(state.resolution_string, "Resolution: %dx%d (1/%u)",
+      state.render_width, state.render_height, scale);
+  state.ticks = 0;
+}
+/* Reallocate everything sized by the render target */
+void resize_render_target(i32 width, i32 height) {
+  state.image_width = width > 0 ? width : 1;
+  state.image_height = height > 0 ? height : 1;
+  glBindTexture(GL_TEXTURE_2D, state.texture);
+  glTexImage2D(
+      GL_TEXTURE_2D,
+      0,
+      GL_RGBA32F,
+      state.image_width, /* Width */
+      state.image_height, /* Height */
+      0,
+      GL_RGBA,
+      GL_UNSIGNED_BYTE,
+      NULL
+  );
+  glBindTexture(GL_TEXTURE_2D, 0);
+  if (state.has_compute) {
+    glBindImageTexture(0, state.texture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+    glDeleteBuffers(1, &state.pixel_stats_buffer);
+    glDeleteBuffers(1, &state.history_stats_buffer);
+    state.pixel_stats_buffer = create_storage_buffer(
+        13, 4 * sizeof(f32) * (size_t)state.image_width * state.image_height, NH_NULL);
+    state.history_stats_buffer = create_storage_buffer(
+        14, 4 * sizeof(f32) * (size_t)state.image_width * state.image_height, NH_NULL);
+    glDeleteTextures(1, &state.history_texture);
+    state.history_texture = create_target_texture(GL_RGBA32F);
+    /* Features are written by the tracing kernels, read by the denoiser */
+    glDeleteTextures(1, &state.normal_depth_texture);
+    glDeleteTextures(1, &state.albedo_texture);
+    glDeleteTextures(2, state.denoise_textures);
+    state.normal_depth_texture = create_target_texture(GL_RGBA32F);
+    state.albedo_texture = create_target_texture(GL_RGBA16F);
+    state.denoise_textures[0] = create_target_texture(GL_RGBA32F);
+    state.denoise_textures[1] = create_target_texture(GL_RGBA32F);
+    glBindImageTexture(1, state.normal_depth_texture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+    glBindImageTexture(2, state.albedo_texture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA16F);
+    glDeleteTextures(1, &state.display_texture);
+    state.display_texture = create_target_texture(state.display_format);
+  }
+  if (state.has_wavefront) {
+    glDeleteBuffers(1, &state.path_buffer);
+    glDeleteBuffers(1, &state.ray_queue_buffer);
+    glDeleteBuffers(1, &state.shadow_queue_buffer);
+    glDeleteBuffers(1, &state.wavefront_buffer);
+    glDeleteBuffers(1, &state.accumulation_buffer);
+    create_wavefront_buffers();
+  }
+  state.history_valid = false;
+  set_render_scale(state.render_scale);
+}
+/*
+ * While moving, pick the resolution that holds the target frame time - a
+ * step is 4x the pixels, so only go finer with room for that. Once still,
+ * refine a step every REFINE_FRAMES frames back to full resolution.
+ */
+void update_render_scale(void) {
+  u32 scale = state.render_scale;
+  if (state.ticks == 0) {
+    f32 ms = state.delta_time * 1000.0f;
+    if (ms > state.target_ms && scale < MAX_RENDER_SCALE) scale *= 2;
+    else if (ms * 4.0f < state.target_ms * 0.8f && scale > 1) scale /= 2;
+  } else if (state.ticks >= REFINE_FRAMES && scale > 1) {
+    scale /= 2;
+  }
+  if (scale != state.render_scale) set_render_scale(scale);
+}
+/* Triangles as three arrays the ray tests read without chasing vertex
+ * indices: first vertex with the material index's bits in w, then the
+ * edges from it to the other two */
+void upload_triangles(void) {
+  const scene_t *scene = &state.scene;
+  const size_t size = sizeof(f32) * 4 * scene->triangle_count;
+  f32 *arrays[3];
+  for (u32 i = 0; i < 3; i++) {
+    arrays[i] = (f32 *)malloc(size > 0 ? size : 1);
+    NH_ASSERT_MSG(arrays[i] != NH_NULL, "Failed to allocate triangles");
   }
-  return size;
+  for (u32 i = 0; i < scene->triangle_count; i++) {
+    const triangle_t *triangle = &scene->triangles[i];
+    const nh_vec3_t v0 = scene->vertices[triangle->v0].position;
+    const nh_vec3_t v1 = scene->vertices[triangle->v1].position;
+    const nh_vec3_t v2 = scene->vertices[triangle->v2].position;
+    f32 *out_v0 = &arrays[0][4 * i], *out_e1 = &arrays[1][4 * i], *out_e2 = &arrays[2][4 * i];
+    out_v0[0] = v0.x;
+    out_v0[1] = v0.y;
+    out_v0[2] = v0.z;
+    memcpy(&out_v0[3], &triangle->material, sizeof(f32));
+    out_e1[0] = v1.x - v0.x;
+    out_e1[1] = v1.y - v0.y;
+    out_e1[2] = v1.z - v0.z;
+    out_e1[3] = 0.0f;
+    out_e2[0] = v2.x - v0.x;
+    out_e2[1] = v2.y - v0.y;
+    out_e2[2] = v2.z - v0.z;
+    out_e2[3] = 0.0f;
+  }
+  /* Bindings of TriangleV0, TriangleE1 and TriangleE2 */
+  const u32 bindings[3] = {3, 6, 17};
+  for (u32 i = 0; i < 3; i++) {
+    state.triangle_buffers[i] = create_storage_buffer(bindings[i], size, arrays[i]);
+    free(arrays[i]);
+  }
+}
+/* Sections go straight from the scene (or its file mapping) to the GPU,
+ * apart from the triangles */
+void upload_scene(void) {
+  const scene_t *scene = &state.scene;
+  u64 start = SDL_GetPerformanceCounter();
+  state.sphere_buffer = create_storage_buffer(
+      2, sizeof(sphere_t) * scene->sphere_count, scene->spheres);
+  upload_triangles();
+  state.bvh_node_buffer = create_storage_buffer(
+      4, sizeof(bvh_node_t) * scene->bvh.node_count, scene->bvh.nodes);
+  state.bvh_ref_buffer = create_storage_buffer(
+      5, sizeof(u32) * scene->bvh.ref_count, scene->bvh.refs);
+  state.material_buffer = create_storage_buffer(
+      7, sizeof(material_t) * scene->material_count, scene->materials);
+  state.light_buffer = create_storage_buffer(
+      16, sizeof(light_t) * state.lights.count, state.lights.lights);
+  /* The top level changes when instances move, see update_instances */
+  glGenBuffers(1, &state.tlas_buffer);
+  glBindBuffer(GL_UNIFORM_BUFFER, state.tlas_buffer);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(tlas_t), &scene->tlas, GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER, 0, state.tlas_buffer);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  u64 end = SDL_GetPerformanceCounter();
+  NH_LOG_ENTRY(
+      "Scene upload: %.2fms",
+      (f64)(end - start) * 1000.0 / (f64)SDL_GetPerformanceFrequency()
+  );
+}
+/* Move animated instances on by the frame's time. Only the top level is
+ * rebuilt and uploaded - meshes stay where they are - and the light table
+ * if spinning instances carry lights */
+void update_instances(void) {
+  if (!state.animate || !scene_animated(&state.scene)) return;
+  state.animation_time += state.delta_time;
+  if (!scene_place_instances(&state.scene, state.animation_time)) {
+    NH_ERROR("Failed to place instances: %s", scene_error);
+    state.animate = false;
+    return;
+  }
+  if (state.lights.moving) {
+    lights_destroy(&state.lights);
+    NH_ASSERT_MSG(lights_build(&state.lights, &state.scene, state.animation_time),
+        "Failed to build light table: out of memory");
+  }
+  if (state.has_compute) {
+    glBindBuffer(GL_UNIFORM_BUFFER, state.tlas_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(tlas_t), &state.scene.tlas);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    /* Same lights in new places, so the same size */
+    if (state.lights.moving) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, state.light_buffer);
+      glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(light_t) * state.lights.count, state.lights.lights);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+  }
+  state.ticks = 0;
+}
+/* HUD text and sliders, queued for ui_end() */
+f32 render_string(const char *str, nh_vec2_t pos, f32 scale) {
+  return ui_text(&state.ui, str, pos, scale);
 }
 void render_slider(slider_t slider) {
   const f32 start_x = render_string(slider.text, slider.pos, 0.025f) + 0.025f;
@@ -162,47 +618,1413 @@ void render_slider(slider_t slider) {
   /*render_string("=", (nh_vec2_t){slider.pos.x+slider_x, slider.pos.y}, 0.025f);*/
   render_string("]", (nh_vec2_t){slider.pos.x+start_x+max_length, slider.pos.y}, 0.025f);
   render_string("[", (nh_vec2_t){slider.pos.x+start_x-0.025f, slider.pos.y}, 0.025f);
-  /* Create slider vao */
-  u32 slider_vao, slider_vbo;
-  glGenVertexArrays(1, &slider_vao);
-  glBindVertexArray(slider_vao);
-  /* Create slider_vertices - position, texture coords */
-  f32 slider_vertices[] = {
-    slider.pos.x + start_x,  slider.pos.y-0.025f,  0.5f,   0.0f, 0.0f,
-    slider.pos.x + slider_x, slider.pos.y-0.025f,  0.5f,   1.0f, 0.0f,
-    slider.pos.x + slider_x, slider.pos.y+0.025f,  0.5f,   1.0f, 1.0f,
-    slider.pos.x + start_x,  slider.pos.y-0.025f,  0.5f,   0.0f, 0.0f,
-    slider.pos.x + slider_x, slider.pos.y+0.025f,  0.5f,   1.0f, 1.0f,
-    slider.pos.x + start_x,  slider.pos.y+0.025f,  0.5f,   0.0f, 1.0f
+  const nh_vec3_t color = slider.active
+    ? (nh_vec3_t){1.0f, 1.0f, 1.0f}
+    : (nh_vec3_t){0.4f, 0.4f, 0.4f};
+  ui_rect(&state.ui,
+      slider.pos.x + start_x, slider.pos.y - 0.025f,
+      slider.pos.x + slider_x, slider.pos.y + 0.025f, color);
+}
+
+/* Uniforms from common.compute */
+void set_trace_uniforms(u32 program, u32 seed) {
+  glUseProgram(program);
+  glUniform1f(glGetUniformLocation(program, "width"), (f32)state.width);
+  glUniform1f(glGetUniformLocation(program, "height"), (f32)state.height);
+  glUniform1f(glGetUniformLocation(program, "focal_length"), state.focal_length);
+  glUniform1f(glGetUniformLocation(program, "angle_x"), state.angle_x);
+  glUniform1f(glGetUniformLocation(program, "angle_y"), state.angle_y);
+  glUniform1f(glGetUniformLocation(program, "test_in"), (f32)state.test_in);
+  glUniform1ui(glGetUniformLocation(program, "random_seed"), seed);
+  glUniform1ui(glGetUniformLocation(program, "ticks"), state.ticks);
+  glUniform3fv(glGetUniformLocation(program, "camera"), 1, (f32 *)&state.camera);
+  glUniform1ui(glGetUniformLocation(program, "count_rays"), state.bench);
+  glUniform1ui(glGetUniformLocation(program, "num_spheres"), state.scene.sphere_count);
+  glUniform2i(glGetUniformLocation(program, "render_size"), state.render_width, state.render_height);
+  glUniform2i(glGetUniformLocation(program, "view_offset"), state.view_x, state.view_y);
+  glUniform2i(glGetUniformLocation(program, "view_size"),
+      state.view_width > 0 ? state.view_width : state.render_width,
+      state.view_height > 0 ? state.view_height : state.render_height);
+  glUniform1ui(glGetUniformLocation(program, "adaptive"), state.adaptive);
+  glUniform1f(glGetUniformLocation(program, "adaptive_threshold"), state.adaptive_threshold);
+  glUniform1ui(glGetUniformLocation(program, "reset_history"), state.reset_history);
+  glUniform1ui(glGetUniformLocation(program, "sampler_type"), state.sampler);
+  glUniform1ui(glGetUniformLocation(program, "frame_index"), state.frame_index);
+  glUniform1ui(glGetUniformLocation(program, "num_lights"), state.lights.count);
+  glUniform1f(glGetUniformLocation(program, "light_power"), state.lights.total_power);
+  glUniform1ui(glGetUniformLocation(program, "roulette_depth"), state.roulette_depth);
+}
+void dispatch_compute(void) {
+  /* Set uniforms */
+  set_trace_uniforms(state.compute_shader, (u32)rand());
+
+  /* Dispatch compute shader */
+  /* Rounded up, the kernel skips invocations past the edge */
+  glDispatchCompute(
+      (state.render_width + state.group_width - 1) / state.group_width,
+      (state.render_height + state.group_height - 1) / state.group_height,
+      1
+  );
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
+/* Bind a wavefront kernel and set its bounce or sample_index */
+void use_kernel(u32 kernel, const char *uniform, u32 value) {
+  glUseProgram(state.wavefront_kernels[kernel]);
+  glUniform1ui(glGetUniformLocation(state.wavefront_kernels[kernel], uniform), value);
+}
+/* Same image as dispatch_compute, one kernel per stage with queues between */
+void dispatch_wavefront(void) {
+  const u32 groups = (state.render_width * state.render_height + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE;
+  const u32 seed = (u32)rand();
+  for (u32 i = 0; i < WAVEFRONT_KERNELS; i++) {
+    set_trace_uniforms(state.wavefront_kernels[i], seed);
+  }
+
+  /* Extend, shade and shadow size themselves from the queue counts */
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, state.wavefront_buffer);
+  for (u32 sample = 0; sample < NUM_RAYS; sample++) {
+    /* Shade needs it too, for the sampler and the first sample's features */
+    use_kernel(WAVEFRONT_SHADE, "sample_index", sample);
+    use_kernel(WAVEFRONT_GENERATE, "sample_index", sample);
+    glDispatchCompute(groups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+    for (u32 bounce = 0; bounce < MAX_BOUNCES; bounce++) {
+      use_kernel(WAVEFRONT_EXTEND, "bounce", bounce);
+      glDispatchComputeIndirect(0);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+      use_kernel(WAVEFRONT_SHADE, "bounce", bounce);
+      glDispatchComputeIndirect(0);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+      use_kernel(WAVEFRONT_DISPATCH, "bounce", bounce);
+      glDispatchCompute(1, 1, 1);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+      use_kernel(WAVEFRONT_SHADOW, "bounce", bounce);
+      glDispatchComputeIndirect(WAVEFRONT_SHADOW_ARGS);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+    use_kernel(WAVEFRONT_ACCUMULATE, "sample_index", sample);
+    glDispatchCompute(groups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+  }
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+/* Filter the traced image, returns the texture holding the result */
+u32 dispatch_denoise(void) {
+  const u32 program = state.denoise_program;
+  glUseProgram(program);
+  glUniform2i(glGetUniformLocation(program, "render_size"), state.render_width, state.render_height);
+  u32 input = state.texture;
+  for (u32 i = 0; i < DENOISE_ITERATIONS; i++) {
+    const u32 output = state.denoise_textures[i % 2];
+    glBindImageTexture(3, input, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(4, output, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glUniform1ui(glGetUniformLocation(program, "step_size"), 1u << i);
+    glUniform1ui(glGetUniformLocation(program, "first_iteration"), i == 0);
+    glUniform1ui(glGetUniformLocation(program, "last_iteration"), i + 1 == DENOISE_ITERATIONS);
+    glDispatchCompute(
+        (state.render_width + DENOISE_GROUP_SIZE - 1) / DENOISE_GROUP_SIZE,
+        (state.render_height + DENOISE_GROUP_SIZE - 1) / DENOISE_GROUP_SIZE,
+        1
+    );
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+    input = output;
+  }
+  return input;
+}
+/* Tonemap and encode width x height of input into output, a texture in
+ * the display format, returns it */
+u32 dispatch_resolve_to(u32 input, u32 output, i32 width, i32 height) {
+  const u32 program = state.resolve_program;
+  glUseProgram(program);
+  glUniform2i(glGetUniformLocation(program, "render_size"), width, height);
+  glUniform1ui(glGetUniformLocation(program, "tonemap"), state.tonemap);
+  glUniform1f(glGetUniformLocation(program, "exposure"), powf(2.0f, state.exposure));
+  glBindImageTexture(3, input, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+  glBindImageTexture(5, output, 0, GL_FALSE, 0, GL_WRITE_ONLY, state.display_format);
+  glDispatchCompute(
+      (width + RESOLVE_GROUP_SIZE - 1) / RESOLVE_GROUP_SIZE,
+      (height + RESOLVE_GROUP_SIZE - 1) / RESOLVE_GROUP_SIZE,
+      1
+  );
+  /* Drawn next, or read back */
+  glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT);
+  return output;
+}
+/* Tonemap and encode input into the display image, returns it */
+u32 dispatch_resolve(u32 input) {
+  return dispatch_resolve_to(input, state.display_texture, state.render_width, state.render_height);
+}
+/* Camera and resolution of the frame about to be traced */
+view_t current_view(void) {
+  return (view_t){
+    state.camera,
+    state.angle_x, state.angle_y,
+    state.focal_length,
+    state.render_width, state.render_height,
   };
-  /* Create slider vbo */
-  glGenBuffers(1, &slider_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, slider_vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(f32) * 6 * 5, slider_vertices, GL_STATIC_DRAW);
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(f32), (void *)0);
-  glEnableVertexAttribArray(1);
-  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(f32), (void *)(3 * sizeof(f32)));
-  /* Render slider */
-  glUseProgram(state.solid_shader);
-  if (slider.active) {
-    nh_vec3_t color = (nh_vec3_t){1.0f, 1.0f, 1.0f};
-    glUniform3fv(glGetUniformLocation(state.solid_shader, "color"), 1, (f32 *)&color);
-  } else {
-    nh_vec3_t color = (nh_vec3_t){0.4f, 0.4f, 0.4f};
-    glUniform3fv(glGetUniformLocation(state.solid_shader, "color"), 1, (f32 *)&color);
+}
+bool view_equal(view_t a, view_t b) {
+  return a.camera.x == b.camera.x && a.camera.y == b.camera.y && a.camera.z == b.camera.z
+    && a.angle_x == b.angle_x && a.angle_y == b.angle_y
+    && a.focal_length == b.focal_length
+    && a.render_width == b.render_width && a.render_height == b.render_height;
+}
+/* Move the last frame into the history buffers and reproject it */
+void dispatch_reproject(void) {
+  u32 swap = state.texture;
+  state.texture = state.history_texture;
+  state.history_texture = swap;
+  swap = state.pixel_stats_buffer;
+  state.pixel_stats_buffer = state.history_stats_buffer;
+  state.history_stats_buffer = swap;
+  glBindImageTexture(0, state.texture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+  glBindImageTexture(3, state.history_texture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, state.pixel_stats_buffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, state.history_stats_buffer);
+
+  const u32 program = state.reproject_program;
+  const view_t *prev = &state.history_view;
+  set_trace_uniforms(program, 0);
+  glUniform3fv(glGetUniformLocation(program, "prev_camera"), 1, (f32 *)&prev->camera);
+  glUniform1f(glGetUniformLocation(program, "prev_angle_x"), prev->angle_x);
+  glUniform1f(glGetUniformLocation(program, "prev_angle_y"), prev->angle_y);
+  glUniform1f(glGetUniformLocation(program, "prev_focal_length"), prev->focal_length);
+  glUniform2i(glGetUniformLocation(program, "prev_render_size"), prev->render_width, prev->render_height);
+  glDispatchCompute(
+      (state.render_width + REPROJECT_GROUP_SIZE - 1) / REPROJECT_GROUP_SIZE,
+      (state.render_height + REPROJECT_GROUP_SIZE - 1) / REPROJECT_GROUP_SIZE,
+      1
+  );
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+/*
+ * What this frame's samples add to: the last frame as it is, reprojected
+ * if only the camera or resolution changed, or nothing if the lighting
+ * changed, instances moved or there is no last frame.
+ */
+void prepare_history(void) {
+  const view_t view = current_view();
+  state.reset_history = !state.history_valid || state.test_in != state.history_test_in
+    || state.animation_time != state.history_animation_time;
+  if (!state.reset_history && !view_equal(view, state.history_view)) {
+    if (state.has_reproject) dispatch_reproject();
+    else state.reset_history = true;
   }
-  glBindVertexArray(slider_vao);
-  glDrawArrays(GL_TRIANGLES, 0, 6);
-  glBindVertexArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glDeleteVertexArrays(1, &slider_vao);
-  glDeleteBuffers(1, &slider_vbo);
+  state.history_view = view;
+  state.history_test_in = state.test_in;
+  state.history_animation_time = state.animation_time;
+  state.history_valid = true;
+}
+/* Camera and inputs for the CPU renderer and ray queries */
+cpu_frame_t current_frame(void) {
+  return (cpu_frame_t){
+    (f32)state.width, (f32)state.height,
+    state.focal_length,
+    state.angle_x, state.angle_y,
+    state.test_in,
+    state.roulette_depth,
+    (u32)rand(),
+    state.ticks,
+    state.camera,
+  };
+}
+/* Render one frame on the selected backend, returns rays cast if known */
+u64 render_frame(void) {
+  if (!state.use_cpu) {
+    prepare_history();
+    if (state.use_wavefront) dispatch_wavefront();
+    else dispatch_compute();
+    /* Sample numbers keep counting, so no two frames share a sequence */
+    state.frame_index++;
+    return 0;
+  }
+  /* The CPU renderer keeps its own accumulation */
+  state.history_valid = false;
+  cpu_frame_t frame = current_frame();
+  u64 rays = cpu_renderer_render(&state.cpu, &frame);
+  /* Upload into the texture the fullscreen quad displays */
+  glBindTexture(GL_TEXTURE_2D, state.texture);
+  glTexSubImage2D(
+      GL_TEXTURE_2D, 0, 0, 0, state.render_width, state.render_height,
+      GL_RGBA, GL_FLOAT, state.cpu.image
+  );
+  return rays;
+}
+/* Start building every program a changed file goes into, as one batch */
+void begin_reload(void) {
+  u32 count = 0;
+  for (u32 i = 0; i < state.reload_slot_count; i++) {
+    reload_slot_t *slot = &state.reload_slots[i];
+    if (!slot->dirty) continue;
+    slot->dirty = false;
+    slot->building = true;
+    program_begin(&state.programs, &slot->desc, &slot->build);
+    count++;
+  }
+  state.reload_at = 0;
+  state.reload_start = SDL_GetPerformanceCounter();
+  state.reloading = count > 0;
+  snprintf(state.reload_string, sizeof(state.reload_string), "Reloading %u programs...", count);
+}
+/* Swap the batch in once all of it has linked, the old programs keep
+ * rendering until then. If any failed none are swapped, kernels built
+ * from the same files have to agree on their buffers */
+void finish_reload(void) {
+  for (u32 i = 0; i < state.reload_slot_count; i++) {
+    const reload_slot_t *slot = &state.reload_slots[i];
+    if (slot->building && !program_ready(&state.programs, &slot->build)) return;
+  }
+  u32 programs[RELOAD_SLOTS] = {0};
+  u32 count = 0;
+  const char *error = NH_NULL;
+  for (u32 i = 0; i < state.reload_slot_count; i++) {
+    reload_slot_t *slot = &state.reload_slots[i];
+    if (!slot->building) continue;
+    programs[i] = program_finish(&state.programs, &slot->desc, &slot->build);
+    if (programs[i] == 0 && error == NH_NULL) error = slot->build.error;
+    count++;
+  }
+  bool restart = false;
+  for (u32 i = 0; i < state.reload_slot_count; i++) {
+    reload_slot_t *slot = &state.reload_slots[i];
+    if (!slot->building) continue;
+    slot->building = false;
+    if (error != NH_NULL) {
+      glDeleteProgram(programs[i]);
+      continue;
+    }
+    glDeleteProgram(*slot->program);
+    *slot->program = programs[i];
+    /* The image so far came from the old trace kernels */
+    restart = restart || strcmp(slot->desc.name, "shader.compute") == 0
+      || strcmp(slot->desc.name, "wavefront.compute") == 0;
+  }
+  state.reloading = false;
+  if (error != NH_NULL) {
+    /* The log's first line is what fits on the HUD */
+    NH_ERROR("Failed to reload %s", error);
+    const i32 length = (i32)strcspn(error, "\n");
+    snprintf(state.reload_string, sizeof(state.reload_string), "%.*s", length, error);
+    return;
+  }
+  if (restart) {
+    state.ticks = 0;
+    state.history_valid = false;
+  }
+  snprintf(state.reload_string, sizeof(state.reload_string), "Reloaded %u programs in %.0fms", count,
+      (f64)(SDL_GetPerformanceCounter() - state.reload_start) * 1000.0 / (f64)SDL_GetPerformanceFrequency());
+  NH_INFO("%s", state.reload_string);
+}
+/* Mark programs whose files changed, build them once saving has settled */
+void update_reload(void) {
+  const u64 now = SDL_GetPerformanceCounter();
+  char name[256];
+  while (watch_next(&state.watch, name, sizeof(name))) {
+    for (u32 i = 0; i < state.reload_slot_count; i++) {
+      reload_slot_t *slot = &state.reload_slots[i];
+      if (!program_uses(&slot->desc, name)) continue;
+      slot->dirty = true;
+      state.reload_at = now + SDL_GetPerformanceFrequency() * RELOAD_DELAY_MS / 1000;
+    }
+  }
+  /* One batch at a time, changes meanwhile make the next */
+  if (state.reloading) finish_reload();
+  else if (state.reload_at != 0 && now >= state.reload_at) begin_reload();
+}
+/* Where the tuned workgroup size for this driver is kept, false if nowhere */
+bool trace_group_path(char *path, size_t size) {
+  if (state.programs.cache_dir == NH_NULL) return false;
+  snprintf(path, size, "%s/%016llx-%s.group", state.programs.cache_dir,
+      (unsigned long long)state.programs.driver_hash, state.morton ? "morton" : "rows");
+  return true;
+}
+/* Workgroup size from an earlier tuning, false if there is none */
+bool load_trace_group(void) {
+  char path[512];
+  if (!trace_group_path(path, sizeof(path))) return false;
+  FILE *file = fopen(path, "r");
+  if (file == NH_NULL) return false;
+  u32 width = 0, height = 0;
+  const bool success = fscanf(file, "%u %u", &width, &height) == 2;
+  fclose(file);
+  for (u32 i = 0; i < TUNE_GROUPS && success; i++) {
+    if (tune_groups[i][0] != width || tune_groups[i][1] != height) continue;
+    state.group_width = width;
+    state.group_height = height;
+    return true;
+  }
+  return false;
+}
+/* Time the megakernel with each of tune_groups on the loaded scene and
+ * render target, keep the fastest and write it down for the next run */
+void tune_trace_group(void) {
+  NH_INFO("Timing megakernel workgroup sizes...");
+  const f64 frequency = (f64)SDL_GetPerformanceFrequency();
+  const u32 width = state.group_width, height = state.group_height;
+  const u32 program = state.compute_shader;
+  program_desc_t descs[TUNE_GROUPS];
+  u32 programs[TUNE_GROUPS] = {0};
+  u32 best = TUNE_GROUPS;
+  f64 best_ms = 0.0;
+  /* Every dispatch does a first frame's work, adaptive sampling would
+   * otherwise give later sizes less to do */
+  state.reset_history = true;
+  for (u32 i = 0; i < TUNE_GROUPS; i++) {
+    state.group_width = tune_groups[i][0];
+    state.group_height = tune_groups[i][1];
+    descs[i] = trace_program_desc();
+    /* The one in use already is not built again */
+    if (state.group_width == width && state.group_height == height) programs[i] = program;
+    else programs[i] = program_create(&state.programs, &descs[i]);
+    if (programs[i] == 0) continue;
+    state.compute_shader = programs[i];
+    f64 ms = 0.0;
+    for (u32 j = 0; j < TUNE_WARMUP + TUNE_DISPATCHES; j++) {
+      glFinish();
+      const u64 start = SDL_GetPerformanceCounter();
+      dispatch_compute();
+      glFinish();
+      if (j >= TUNE_WARMUP) ms += (f64)(SDL_GetPerformanceCounter() - start) * 1000.0 / frequency;
+    }
+    ms /= TUNE_DISPATCHES;
+    NH_LOG_ENTRY("%ux%u: %.2fms", state.group_width, state.group_height, ms);
+    if (best == TUNE_GROUPS || ms < best_ms) {
+      best = i;
+      best_ms = ms;
+    }
+  }
+  /* The image and statistics hold tuning dispatches */
+  state.history_valid = false;
+  state.ticks = 0;
+  if (best == TUNE_GROUPS) {
+    state.group_width = width;
+    state.group_height = height;
+    state.compute_shader = program;
+    return;
+  }
+  for (u32 i = 0; i < TUNE_GROUPS; i++) {
+    if (i != best && programs[i] != program) glDeleteProgram(programs[i]);
+  }
+  if (programs[best] != program) glDeleteProgram(program);
+  state.group_width = tune_groups[best][0];
+  state.group_height = tune_groups[best][1];
+  state.compute_shader = programs[best];
+  /* Hot reload builds the winner from now on */
+  for (u32 i = 0; i < state.reload_slot_count; i++) {
+    if (state.reload_slots[i].program == &state.compute_shader) state.reload_slots[i].desc = descs[best];
+  }
+  char path[512];
+  if (trace_group_path(path, sizeof(path))) {
+    FILE *file = fopen(path, "w");
+    if (file == NH_NULL || fprintf(file, "%u %u\n", state.group_width, state.group_height) < 0) {
+      NH_ERROR("Failed to write %s", path);
+    }
+    if (file != NH_NULL) fclose(file);
+  }
+}
+/* Whole number argument in [1, max], false for anything else */
+bool parse_count(const char *text, u32 max, u32 *value) {
+  char *end;
+  /* strtoul takes signs and spaces, a count starts with a digit */
+  if (text[0] < '0' || text[0] > '9') return false;
+  const unsigned long parsed = strtoul(text, &end, 10);
+  if (*end != '\0' || parsed == 0 || parsed > max) return false;
+  *value = (u32)parsed;
+  return true;
+}
+/* --camera over the starting view: x, y, z, yaw, pitch, focal length */
+bool parse_camera(f32 camera[6]) {
+  const f32 start[6] = {0.0f, 1.5f, 0.0f, 0.0f, -0.3f, 1.0f};
+  memcpy(camera, start, sizeof(start));
+  if (state.camera_string != NH_NULL && sscanf(state.camera_string, "%f,%f,%f,%f,%f,%f",
+        &camera[0], &camera[1], &camera[2], &camera[3], &camera[4], &camera[5]) < 5) {
+    NH_ERROR("Bad camera: %s, expected X,Y,Z,YAW,PITCH[,FOCAL]", state.camera_string);
+    return false;
+  }
+  return true;
+}
+/* Look through camera at a width x height image, traced a tile at a time */
+void set_render_view(const f32 camera[6], u32 width, u32 height) {
+  state.camera = (nh_vec3_t){camera[0], camera[1], camera[2]};
+  state.angle_x = camera[3];
+  state.angle_y = camera[4];
+  state.focal_length = camera[5];
+  /* The aspect ratio comes from the window size */
+  state.width = (i32)width;
+  state.height = (i32)height;
+  state.view_width = (i32)width;
+  state.view_height = (i32)height;
+  state.adaptive = false;
+}
+/* Trace dispatches of the tile at left, bottom, columns, rows into
+ * state.texture - sample numbers start at dispatch first, random numbers
+ * come from seed */
+void render_tile(const u32 rect[4], u32 first, u32 dispatches, u32 seed) {
+  /* The first dispatch still blends with what is there, so the tile traced
+   * before this one - in this process or not - must not show through */
+  f32 *zeros = (f32 *)calloc(4 * (size_t)rect[2] * rect[3], sizeof(f32));
+  NH_ASSERT_MSG(zeros != NH_NULL, "Failed to allocate tile");
+  glBindTexture(GL_TEXTURE_2D, state.texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (i32)rect[2], (i32)rect[3], GL_RGBA, GL_FLOAT, zeros);
   glBindTexture(GL_TEXTURE_2D, 0);
+  free(zeros);
+  state.view_x = (i32)rect[0];
+  state.view_y = (i32)rect[1];
+  state.render_width = (i32)rect[2];
+  state.render_height = (i32)rect[3];
+  state.ticks = 0;
+  state.frame_index = first;
+  state.history_valid = false;
+  srand(seed);
+  for (u32 i = 0; i < dispatches; i++) {
+    render_frame();
+    state.ticks++;
+  }
+}
+/* The render target is a tile, it has to be a texture this GPU can make */
+bool tile_fits(u32 tile) {
+  i32 max_size = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+  if (tile > 0 && tile <= (u32)max_size) return true;
+  NH_ERROR("Bad tile size: %u, textures here are at most %d", tile, max_size);
+  return false;
+}
+/*
+ * Offline render into state.output_path, a tile at a time so GPU memory
+ * stays one tile's worth however big the image is. A band (row of tiles)
+ * is written once all its tiles are done, top band first, then the
+ * checkpoint is moved on - --resume starts from the band after it. Tiles
+ * seed the random numbers by their index, so a resumed render comes out
+ * the same as one that never stopped.
+ */
+bool run_render(void) {
+  const u32 width = state.output_width, height = state.output_height, tile = state.tile_size;
+  const u32 tiles_x = (width + tile - 1) / tile, bands = (height + tile - 1) / tile;
+  /* Every dispatch takes NUM_RAYS samples of each pixel */
+  const u32 dispatches = (state.output_samples + NUM_RAYS - 1) / NUM_RAYS;
+  output_checkpoint_t checkpoint = {width, height, tile, dispatches * NUM_RAYS, {0}, 0, 0, 0};
+  if (!parse_camera(checkpoint.camera) || !tile_fits(tile)) return false;
+  if (state.use_cpu) {
+    NH_ERROR("Offline renders need compute shaders");
+    return false;
+  }
+  NH_INFO("Rendering %s (%ux%u, %u samples, %ux%u tiles)...",
+      state.output_path, width, height, checkpoint.samples, tile, tile);
+  char checkpoint_path[512];
+  snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.checkpoint", state.output_path);
+  output_t output;
+  if (state.resume) {
+    output_checkpoint_t saved;
+    if (!output_load_checkpoint(checkpoint_path, &saved)) {
+      NH_ERROR("Failed to read %s", checkpoint_path);
+      return false;
+    }
+    if (!output_checkpoint_matches(&saved, &checkpoint)) {
+      NH_ERROR("%s is for other settings", checkpoint_path);
+      return false;
+    }
+    checkpoint = saved;
+    const u32 rows = checkpoint.bands * tile < height ? checkpoint.bands * tile : height;
+    if (!output_resume(&output, state.output_path, width, height, checkpoint.offset, rows, checkpoint.adler)) {
+      NH_ERROR("Failed to reopen %s", state.output_path);
+      return false;
+    }
+    NH_LOG_ENTRY("Resuming at band %u of %u", checkpoint.bands, bands);
+  } else if (!output_open(&output, state.output_path, width, height)) {
+    NH_ERROR("Failed to create %s", state.output_path);
+    return false;
+  }
+
+  /* The band is kept top row first, tiles read back bottom row first */
+  f32 *band = (f32 *)malloc(sizeof(f32) * 4 * width * tile);
+  f32 *pixels = (f32 *)malloc(sizeof(f32) * 4 * tile * tile);
+  NH_ASSERT_MSG(band != NH_NULL && pixels != NH_NULL, "Failed to allocate readback");
+  set_render_view(checkpoint.camera, width, height);
+  const f64 frequency = (f64)SDL_GetPerformanceFrequency();
+  const u64 start = SDL_GetPerformanceCounter();
+  bool success = true;
+  for (u32 b = checkpoint.bands; b < bands && success; b++) {
+    /* Band b from the top, OpenGL counts rows from the bottom */
+    const u32 top = height - b * tile;
+    const u32 rows = top < tile ? top : tile;
+    for (u32 t = 0; t < tiles_x; t++) {
+      const u32 left = t * tile;
+      const u32 columns = width - left < tile ? width - left : tile;
+      const u32 rect[4] = {left, top - rows, columns, rows};
+      render_tile(rect, 0, dispatches, b * tiles_x + t + 1);
+      /* PNGs are tonemapped like the window, EXRs keep the HDR values */
+      const u32 texture = output.format == OUTPUT_PNG && state.has_resolve
+        ? dispatch_resolve(state.texture)
+        : state.texture;
+      glBindTexture(GL_TEXTURE_2D, texture);
+      glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, pixels);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      for (u32 y = 0; y < rows; y++) {
+        memcpy(&band[4 * ((size_t)(rows - 1 - y) * width + left)], &pixels[4 * (size_t)y * tile],
+            sizeof(f32) * 4 * columns);
+      }
+    }
+    if (!output_write(&output, band, rows)) {
+      NH_ERROR("Failed to write %s", state.output_path);
+      success = false;
+      break;
+    }
+    checkpoint.bands = b + 1;
+    checkpoint.offset = output.offset;
+    checkpoint.adler = output.adler;
+    if (!output_save_checkpoint(checkpoint_path, &checkpoint)) {
+      NH_ERROR("Failed to write %s", checkpoint_path);
+    }
+    NH_LOG_ENTRY("Band %u of %u, %.1fs", b + 1, bands,
+        (f64)(SDL_GetPerformanceCounter() - start) / frequency);
+  }
+  free(band);
+  free(pixels);
+  if (!success) {
+    fclose(output.file);
+    return false;
+  }
+  if (!output_close(&output)) {
+    NH_ERROR("Failed to finish %s", state.output_path);
+    return false;
+  }
+  /* Done, nothing to resume */
+  remove(checkpoint_path);
+  NH_INFO("Rendered %s in %.1fs", state.output_path, (f64)(SDL_GetPerformanceCounter() - start) / frequency);
+  return true;
+}
+/* Which scene this process loaded, workers must have the coordinator's */
+u32 scene_hash(void) {
+  const scene_t *scene = &state.scene;
+  u32 hash = 2166136261u;
+  hash = dist_hash(hash, scene->materials, sizeof(material_t) * scene->material_count);
+  hash = dist_hash(hash, scene->spheres, sizeof(sphere_t) * scene->sphere_count);
+  hash = dist_hash(hash, scene->vertices, sizeof(vertex_t) * scene->vertex_count);
+  hash = dist_hash(hash, scene->triangles, sizeof(triangle_t) * scene->triangle_count);
+  hash = dist_hash(hash, scene->bvh.nodes, sizeof(bvh_node_t) * scene->bvh.node_count);
+  hash = dist_hash(hash, scene->bvh.refs, sizeof(u32) * scene->bvh.ref_count);
+  hash = dist_hash(hash, scene->meshes, sizeof(mesh_t) * scene->mesh_count);
+  hash = dist_hash(hash, scene->instances, sizeof(instance_t) * scene->instance_count);
+  return hash;
+}
+/*
+ * Render units of the coordinator's offline render at state.worker_address
+ * until it says stop, see distribute.h. Size, camera and settings come from
+ * the coordinator, and a unit is traced like one of run_render's tiles.
+ */
+bool run_worker(void) {
+  if (state.use_cpu) {
+    NH_ERROR("Workers need compute shaders");
+    return false;
+  }
+  NH_INFO("Connecting to %s...", state.worker_address);
+  const int fd = dist_connect(state.worker_address);
+  if (fd < 0) {
+    NH_ERROR("Failed to connect to %s", state.worker_address);
+    return false;
+  }
+  const dist_hello_t hello = {DIST_MAGIC, DIST_VERSION, scene_hash(), 0};
+  dist_job_t job;
+  if (!dist_send(fd, &hello, sizeof(hello)) || !dist_receive(fd, &job, sizeof(job))) {
+    NH_ERROR("Turned away by %s, is it the same build and scene?", state.worker_address);
+    close(fd);
+    return false;
+  }
+  if (!tile_fits(job.tile)) {
+    close(fd);
+    return false;
+  }
+  const u32 tiles = ((job.width + job.tile - 1) / job.tile) * ((job.height + job.tile - 1) / job.tile);
+  NH_LOG_ENTRY("Job: %ux%u, %ux%u tiles", job.width, job.height, job.tile, job.tile);
+  state.sampler = job.sampler;
+  state.roulette_depth = job.roulette_depth;
+  state.test_in = job.test_in;
+  set_render_view(job.camera, job.width, job.height);
+  if ((u32)state.image_width != job.tile || (u32)state.image_height != job.tile) {
+    resize_render_target((i32)job.tile, (i32)job.tile);
+  }
+  f32 *pixels = (f32 *)malloc(sizeof(f32) * 4 * job.tile * job.tile);
+  NH_ASSERT_MSG(pixels != NH_NULL, "Failed to allocate readback");
+  const f64 frequency = (f64)SDL_GetPerformanceFrequency();
+  const u64 start = SDL_GetPerformanceCounter();
+  u32 units = 0;
+  bool success = true;
+  for (;;) {
+    dist_unit_t unit;
+    if (!dist_receive(fd, &unit, sizeof(unit)) || (unit.count > 0 && unit.tile >= tiles)) {
+      NH_ERROR("Lost %s", state.worker_address);
+      success = false;
+      break;
+    }
+    if (unit.count == 0) break;
+    u32 rect[4];
+    dist_tile_rect(&job, unit.tile, rect);
+    render_tile(rect, unit.first, unit.count, unit.id + 1);
+    glBindTexture(GL_TEXTURE_2D, state.texture);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, pixels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    /* Target rows are a whole tile wide, the result has the tile's columns */
+    for (u32 y = 1; y < rect[3]; y++) {
+      memmove(&pixels[4 * (size_t)y * rect[2]], &pixels[4 * (size_t)y * job.tile], sizeof(f32) * 4 * rect[2]);
+    }
+    const dist_result_t result = {unit, unit.count * NUM_RAYS, rect[2], rect[3], 0};
+    if (!dist_send(fd, &result, sizeof(result))
+        || !dist_send(fd, pixels, sizeof(f32) * 4 * rect[2] * rect[3])) {
+      NH_ERROR("Lost %s", state.worker_address);
+      success = false;
+      break;
+    }
+    units++;
+  }
+  free(pixels);
+  close(fd);
+  NH_INFO("Rendered %u units in %.1fs", units, (f64)(SDL_GetPerformanceCounter() - start) / frequency);
+  return success;
+}
+/* Close a worker's connection, its unit goes back to be handed out again */
+void drop_worker(dist_worker_t *worker, u8 *unit_states, u32 *next) {
+  close(worker->fd);
+  if (worker->unit >= 0) {
+    unit_states[worker->unit] = 0;
+    if ((u32)worker->unit < *next) *next = (u32)worker->unit;
+  }
+  worker->fd = -1;
+  worker->unit = -1;
+}
+/* Unit index of run_coordinate's order, band-major then chunk then tile */
+dist_unit_t coordinate_unit(u32 index, u32 tiles_x, u32 dispatches, u32 unit_dispatches) {
+  const u32 chunks = (dispatches + unit_dispatches - 1) / unit_dispatches, band_units = tiles_x * chunks;
+  const u32 band = index / band_units, chunk = index % band_units / tiles_x;
+  const u32 first = chunk * unit_dispatches;
+  const u32 count = dispatches - first < unit_dispatches ? dispatches - first : unit_dispatches;
+  return (dist_unit_t){index, band * tiles_x + index % tiles_x, first, count};
+}
+/*
+ * Offline render into state.output_path, traced by workers that connect to
+ * state.coordinate_address - see distribute.h. Each tile's dispatches are
+ * split into units of state.unit_dispatches, handed out a band (row of
+ * tiles) at a time, top band first, and within a band the first
+ * dispatches of every tile first. Per pixel the mean so far and its
+ * sample count are kept, so units merge weighted by how many samples they
+ * took. Like run_render, a band is written as soon as all its units are
+ * in, and only DIST_BANDS of them are held - a unit further down waits
+ * for the top one to be written. With one unit per tile the image is the
+ * same as run_render's. The window shows a preview no bigger than itself,
+ * a pixel of the image every so many.
+ */
+bool run_coordinate(void) {
+  dist_job_t job = {state.output_width, state.output_height, state.tile_size,
+    state.sampler, state.roulette_depth, state.test_in, {0}};
+  if (!parse_camera(job.camera) || !tile_fits(job.tile)) return false;
+  const u32 width = job.width, height = job.height, tile = job.tile;
+  const u32 tiles_x = (width + tile - 1) / tile, bands = (height + tile - 1) / tile;
+  /* Every dispatch takes NUM_RAYS samples of each pixel */
+  const u32 dispatches = (state.output_samples + NUM_RAYS - 1) / NUM_RAYS;
+  const u32 unit_dispatches = state.unit_dispatches < dispatches ? state.unit_dispatches : dispatches;
+  const u32 chunks = (dispatches + unit_dispatches - 1) / unit_dispatches;
+  const u32 band_units = tiles_x * chunks, units = bands * band_units;
+  output_t output;
+  if (!output_open(&output, state.output_path, width, height)) {
+    NH_ERROR("Failed to create %s", state.output_path);
+    return false;
+  }
+  const int listener = dist_listen(state.coordinate_address);
+  if (listener < 0) {
+    NH_ERROR("Failed to listen on %s", state.coordinate_address);
+    fclose(output.file);
+    return false;
+  }
+  NH_INFO("Rendering %s (%ux%u, %u samples, %u units) on workers at %s...",
+      state.output_path, width, height, dispatches * NUM_RAYS, units, state.coordinate_address);
+
+  /* Bands being merged, top row first - mean in rgb, samples in a. Band b
+   * is in slot b % DIST_BANDS */
+  const size_t band_size = 4 * (size_t)width * tile;
+  f32 *band_means = (f32 *)calloc(DIST_BANDS * band_size, sizeof(f32));
+  u32 band_merged[DIST_BANDS] = {0};
+  f32 *pixels = (f32 *)malloc(sizeof(f32) * 4 * tile * tile);
+  /* Per unit: 0 waiting, 1 with a worker, 2 merged */
+  u8 *unit_states = (u8 *)calloc(units, 1);
+  NH_ASSERT_MSG(band_means != NH_NULL && pixels != NH_NULL && unit_states != NH_NULL,
+      "Failed to allocate merge buffers");
+  dist_worker_t workers[DIST_MAX_WORKERS];
+  for (u32 i = 0; i < DIST_MAX_WORKERS; i++) {
+    workers[i] = (dist_worker_t){-1, -1};
+  }
+  struct pollfd fds[1 + DIST_MAX_WORKERS];
+  u32 fd_workers[1 + DIST_MAX_WORKERS];
+  /* Preview, every step-th pixel of the image so it fits the window */
+  const u32 step_x = (width + (u32)state.width - 1) / (u32)state.width;
+  const u32 step_y = (height + (u32)state.height - 1) / (u32)state.height;
+  const u32 step = step_x > step_y ? step_x : step_y;
+  const i32 preview_width = (i32)((width + step - 1) / step), preview_height = (i32)((height + step - 1) / step);
+  const u32 preview = create_texture(GL_RGBA32F, preview_width, preview_height);
+  const u32 preview_display = state.has_resolve
+    ? create_texture(state.display_format, preview_width, preview_height) : 0;
+  f32 *cleared = (f32 *)calloc(4 * (size_t)preview_width * preview_height, sizeof(f32));
+  NH_ASSERT_MSG(cleared != NH_NULL, "Failed to allocate preview");
+  glBindTexture(GL_TEXTURE_2D, preview);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, preview_width, preview_height, GL_RGBA, GL_FLOAT, cleared);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  free(cleared);
+  const f64 frequency = (f64)SDL_GetPerformanceFrequency();
+  const u64 start = SDL_GetPerformanceCounter();
+  u32 merged = 0, written = 0, next = 0, joined = 0;
+  bool success = true, redraw = true;
+  while (written < bands && success) {
+    /* Idle workers get the first waiting unit, if its band has a slot */
+    for (u32 i = 0; i < DIST_MAX_WORKERS; i++) {
+      dist_worker_t *worker = &workers[i];
+      if (worker->fd < 0 || worker->unit >= 0) continue;
+      while (next < units && unit_states[next] != 0) next++;
+      if (next == units || next / band_units >= written + DIST_BANDS) break;
+      const dist_unit_t unit = coordinate_unit(next, tiles_x, dispatches, unit_dispatches);
+      if (!dist_send(worker->fd, &unit, sizeof(unit))) {
+        NH_LOG_ENTRY("Worker %u left", i);
+        drop_worker(worker, unit_states, &next);
+        continue;
+      }
+      unit_states[next] = 1;
+      worker->unit = next;
+    }
+
+    /* New connections, results, or neither for a frame's time */
+    u32 count = 1;
+    fds[0] = (struct pollfd){listener, POLLIN, 0};
+    for (u32 i = 0; i < DIST_MAX_WORKERS; i++) {
+      if (workers[i].fd < 0) continue;
+      fds[count] = (struct pollfd){workers[i].fd, POLLIN, 0};
+      fd_workers[count++] = i;
+    }
+    if (poll(fds, count, 15) < 0 && errno != EINTR) {
+      NH_ERROR("Failed to wait for workers");
+      success = false;
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      const int fd = dist_accept(listener);
+      u32 slot = 0;
+      while (slot < DIST_MAX_WORKERS && workers[slot].fd >= 0) slot++;
+      dist_hello_t hello;
+      if (fd < 0) {
+        NH_ERROR("Failed to accept a worker");
+      } else if (slot == DIST_MAX_WORKERS) {
+        NH_ERROR("Turned a worker away, %u are connected", DIST_MAX_WORKERS);
+        close(fd);
+      } else if (!dist_receive(fd, &hello, sizeof(hello)) || hello.magic != DIST_MAGIC
+          || hello.version != DIST_VERSION || hello.scene != scene_hash()) {
+        NH_ERROR("Turned a worker away, it is another build or scene or said nothing");
+        close(fd);
+      } else if (!dist_send(fd, &job, sizeof(job))) {
+        close(fd);
+      } else {
+        workers[slot] = (dist_worker_t){fd, -1};
+        joined++;
+        NH_LOG_ENTRY("Worker %u joined", slot);
+      }
+    }
+    for (u32 f = 1; f < count; f++) {
+      if (!(fds[f].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      dist_worker_t *worker = &workers[fd_workers[f]];
+      dist_result_t result;
+      dist_unit_t unit = {0};
+      u32 rect[4] = {0};
+      if (worker->unit >= 0) {
+        unit = coordinate_unit((u32)worker->unit, tiles_x, dispatches, unit_dispatches);
+        dist_tile_rect(&job, unit.tile, rect);
+      }
+      /* The header has to be the unit it was given, or the pixels that
+       * follow can't be read or merged */
+      if (!dist_receive(worker->fd, &result, sizeof(result)) || worker->unit < 0
+          || result.unit.id != unit.id || result.unit.tile != unit.tile
+          || result.unit.first != unit.first || result.unit.count != unit.count
+          || result.samples != unit.count * NUM_RAYS || result.columns != rect[2] || result.rows != rect[3]
+          || !dist_receive(worker->fd, pixels, sizeof(f32) * 4 * rect[2] * rect[3])) {
+        NH_LOG_ENTRY("Worker %u left, stalled or sent the wrong unit", fd_workers[f]);
+        drop_worker(worker, unit_states, &next);
+        continue;
+      }
+      /* Weighted by samples, the first unit's mean is kept as it is */
+      const u32 band = (u32)worker->unit / band_units;
+      f32 *means = &band_means[band % DIST_BANDS * band_size];
+      for (u32 y = 0; y < rect[3]; y++) {
+        for (u32 x = 0; x < rect[2]; x++) {
+          f32 *mean = &means[4 * ((size_t)(rect[3] - 1 - y) * width + rect[0] + x)];
+          const f32 *pixel = &pixels[4 * ((size_t)y * rect[2] + x)];
+          const f32 weight = (f32)result.samples / (mean[3] + (f32)result.samples);
+          for (u32 c = 0; c < 3; c++) {
+            mean[c] += (pixel[c] - mean[c]) * weight;
+          }
+          mean[3] += (f32)result.samples;
+        }
+      }
+      /* The preview pixels in the tile, OpenGL rows from the bottom */
+      const u32 preview_x = (rect[0] + step - 1) / step, preview_y = (rect[1] + step - 1) / step;
+      const u32 preview_columns = (rect[0] + rect[2] + step - 1) / step - preview_x;
+      const u32 preview_rows = (rect[1] + rect[3] + step - 1) / step - preview_y;
+      for (u32 y = 0; y < preview_rows; y++) {
+        for (u32 x = 0; x < preview_columns; x++) {
+          const u32 image_x = (preview_x + x) * step, image_y = (preview_y + y) * step;
+          const f32 *mean = &means[4 * ((size_t)(rect[1] + rect[3] - 1 - image_y) * width + image_x)];
+          f32 *pixel = &pixels[4 * ((size_t)y * preview_columns + x)];
+          memcpy(pixel, mean, sizeof(f32) * 3);
+          pixel[3] = 1.0f;
+        }
+      }
+      if (preview_columns > 0 && preview_rows > 0) {
+        glBindTexture(GL_TEXTURE_2D, preview);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (i32)preview_x, (i32)preview_y, (i32)preview_columns, (i32)preview_rows,
+            GL_RGBA, GL_FLOAT, pixels);
+        glBindTexture(GL_TEXTURE_2D, 0);
+      }
+      unit_states[worker->unit] = 2;
+      worker->unit = -1;
+      band_merged[band % DIST_BANDS]++;
+      merged++;
+      redraw = true;
+    }
+
+    /* Write every finished band at the top, freeing its slot */
+    while (success && written < bands && band_merged[written % DIST_BANDS] == band_units) {
+      f32 *means = &band_means[written % DIST_BANDS * band_size];
+      const u32 top = height - written * tile;
+      const u32 rows = top < tile ? top : tile;
+      /* PNGs are tonemapped like the window, a tile at a time through the
+       * render target as run_render does. EXRs keep the HDR values */
+      for (u32 t = 0; t < tiles_x && output.format == OUTPUT_PNG && state.has_resolve; t++) {
+        const u32 left = t * tile;
+        const u32 columns = width - left < tile ? width - left : tile;
+        for (u32 y = 0; y < rows; y++) {
+          memcpy(&pixels[4 * (size_t)y * columns], &means[4 * ((size_t)(rows - 1 - y) * width + left)],
+              sizeof(f32) * 4 * columns);
+        }
+        state.render_width = (i32)columns;
+        state.render_height = (i32)rows;
+        glBindTexture(GL_TEXTURE_2D, state.texture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (i32)columns, (i32)rows, GL_RGBA, GL_FLOAT, pixels);
+        glBindTexture(GL_TEXTURE_2D, dispatch_resolve(state.texture));
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, pixels);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        for (u32 y = 0; y < rows; y++) {
+          memcpy(&means[4 * ((size_t)(rows - 1 - y) * width + left)], &pixels[4 * (size_t)y * tile],
+              sizeof(f32) * 4 * columns);
+        }
+      }
+      if (!output_write(&output, means, rows)) {
+        NH_ERROR("Failed to write %s", state.output_path);
+        success = false;
+        break;
+      }
+      memset(means, 0, sizeof(f32) * band_size);
+      band_merged[written % DIST_BANDS] = 0;
+      written++;
+      NH_LOG_ENTRY("Band %u of %u, %.1fs", written, bands,
+          (f64)(SDL_GetPerformanceCounter() - start) / frequency);
+    }
+
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+      if (event.type == SDL_QUIT) {
+        NH_ERROR("Render cancelled");
+        success = false;
+      } else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+        glViewport(0, 0, event.window.data1, event.window.data2);
+        redraw = true;
+      }
+    }
+    if (!redraw) continue;
+    redraw = false;
+    /* Tonemapped like the main loop, the quad stretches it to the window */
+    glClear(GL_COLOR_BUFFER_BIT);
+    const u32 texture = state.has_resolve
+      ? dispatch_resolve_to(preview, preview_display, preview_width, preview_height)
+      : preview;
+    glUseProgram(state.shader_program);
+    glBindVertexArray(state.vao);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    const f32 uv_scale[] = {1.0f, 1.0f};
+    glUniform2fv(glGetUniformLocation(state.shader_program, "uv_scale"), 1, uv_scale);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindVertexArray(0);
+    u32 connected = 0;
+    for (u32 i = 0; i < DIST_MAX_WORKERS; i++) {
+      connected += workers[i].fd >= 0;
+    }
+    char progress[64];
+    snprintf(progress, sizeof(progress), "Units: %u of %u, workers: %u", merged, units, connected);
+    ui_begin(&state.ui);
+    render_string(progress, (nh_vec2_t){-0.925f, 0.925f}, 0.025f);
+    ui_end(&state.ui, state.font_texture);
+    SDL_GL_SwapWindow(state.window);
+  }
+
+  /* Finished or not, the workers are done */
+  const dist_unit_t stop = {0, 0, 0, 0};
+  for (u32 i = 0; i < DIST_MAX_WORKERS; i++) {
+    if (workers[i].fd < 0) continue;
+    dist_send(workers[i].fd, &stop, sizeof(stop));
+    close(workers[i].fd);
+  }
+  dist_close_listener(listener, state.coordinate_address);
+  if (!success) {
+    fclose(output.file);
+  } else if (!output_close(&output)) {
+    NH_ERROR("Failed to finish %s", state.output_path);
+    success = false;
+  }
+  glDeleteTextures(1, &preview);
+  if (state.has_resolve) glDeleteTextures(1, &preview_display);
+  free(band_means);
+  free(pixels);
+  free(unit_states);
+  if (success) {
+    NH_INFO("Rendered %s in %.1fs, %u workers took part", state.output_path,
+        (f64)(SDL_GetPerformanceCounter() - start) / frequency, joined);
+  }
+  return success;
+}
+/* Start writing the displayed image to the video, at the window's size */
+void start_recording(void) {
+  const u32 width = (u32)state.width, height = (u32)state.height;
+  if (!capture_start_video(&state.capture, state.record_path, width, height, state.record_fps)) {
+    NH_ERROR("Failed to open %s", state.record_path);
+    return;
+  }
+  NH_INFO("Recording %s, %ux%u at %u fps", state.record_path, width, height, state.record_fps);
+  if (state.record_path[0] != '|') {
+    NH_LOG_ENTRY("Encode with: ffmpeg -f rawvideo -pix_fmt rgb24 -s %ux%u -r %u -i %s out.mp4",
+        width, height, state.record_fps, state.record_path);
+  }
+}
+void stop_recording(void) {
+  const u64 frames = state.capture.frames, dropped = state.capture.dropped;
+  if (!capture_stop_video(&state.capture)) NH_ERROR("Failed to write %s", state.record_path);
+  NH_INFO("Recorded %llu frames to %s, %llu dropped", (unsigned long long)frames,
+      state.record_path, (unsigned long long)dropped);
+  state.capture_string[0] = '\0';
+}
+/* Save the next displayed frame as a PNG, numbered and timestamped */
+void take_screenshot(void) {
+  char path[CAPTURE_PATH_SIZE], date[32];
+  const time_t now = time(NH_NULL);
+  strftime(date, sizeof(date), "%Y%m%d-%H%M%S", localtime(&now));
+  snprintf(path, sizeof(path), "screenshot-%s-%u.png", date, state.screenshots++);
+  capture_screenshot(&state.capture, path);
+}
+/* Cast a ray through a window position and report what it hits */
+void pick(i32 x, i32 y) {
+  cpu_frame_t frame = current_frame();
+  f32 target_x = (f32)x / (f32)state.width * 2.0f - 1.0f;
+  f32 target_y = (1.0f - (f32)y / (f32)state.height) * 2.0f - 1.0f;
+  target_y /= frame.width / frame.height;
+  f32 distance;
+  i32 instance;
+  i32 primitive = rq_intersect_one(
+      state.camera, cpu_camera_direction(&frame, target_x, target_y), &distance, &instance);
+  if (primitive == RQ_MISS) {
+    sprintf(state.pick_string, "Picked: nothing");
+  } else if (primitive < RQ_TRIANGLE(0)) {
+    sprintf(state.pick_string, "Picked: sphere %d/%d (%.2f)", primitive, instance, distance);
+  } else {
+    sprintf(state.pick_string, "Picked: triangle %d/%d (%.2f)", primitive - RQ_TRIANGLE(0), instance, distance);
+  }
+  NH_INFO("%s", state.pick_string);
+}
+void run_bench(void) {
+  NH_INFO("Running benchmark (%u dispatches)...", state.bench_frames);
+  const f64 frequency = (f64)SDL_GetPerformanceFrequency();
+  f64 total_ms = 0.0, min_ms = 0.0, max_ms = 0.0;
+  u64 total_rays = 0;
+  u64 path_counts[COUNTERS] = {0};
+  if (!state.use_cpu) glBindBuffer(GL_SHADER_STORAGE_BUFFER, state.ray_counter);
+  for (u32 i = 0; i < BENCH_WARMUP + state.bench_frames; i++) {
+    /* Reset ray and path counters */
+    u32 counters[COUNTERS] = {0};
+    if (!state.use_cpu) {
+      glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+    }
+    /* Time one frame, waiting for it to complete */
+    u64 start = SDL_GetPerformanceCounter();
+    u64 rays = render_frame();
+    glFinish();
+    u64 end = SDL_GetPerformanceCounter();
+    state.ticks++;
+    if (i < BENCH_WARMUP) continue;
+    /* Read back ray and path counters */
+    if (!state.use_cpu) {
+      glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+      glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+      rays = counters[COUNTER_RAYS];
+      for (u32 j = COUNTER_PATH_LENGTHS; j < COUNTERS; j++) path_counts[j] += counters[j];
+    }
+    total_rays += rays;
+    /* Frame time */
+    f64 ms = (f64)(end - start) * 1000.0 / frequency;
+    if (i == BENCH_WARMUP || ms < min_ms) min_ms = ms;
+    if (i == BENCH_WARMUP || ms > max_ms) max_ms = ms;
+    total_ms += ms;
+  }
+  if (!state.use_cpu) glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  /* Samples are camera paths, rays are every scene intersection query */
+  const f64 seconds = total_ms / 1000.0;
+  const f64 samples = (f64)state.render_width * state.render_height * NUM_RAYS * state.bench_frames;
+  printf(
+      "{\"backend\": \"%s\", \"pipeline\": \"%s\", \"renderer\": \"%s\", \"width\": %d, \"height\": %d, "
+      "\"sampler\": \"%s\", \"workgroup\": \"%ux%u\", \"morton\": %s, "
+      "\"frames\": %u, \"samples_per_pixel\": %d, "
+      "\"ms_per_frame\": %.4f, \"ms_min\": %.4f, \"ms_max\": %.4f, "
+      "\"samples_per_sec\": %.0f, \"rays_per_sec\": %.0f}\n",
+      state.use_cpu ? "cpu" : "gpu", state.use_cpu || !state.use_wavefront ? "megakernel" : "wavefront",
+      (const char *)glGetString(GL_RENDERER), state.render_width, state.render_height,
+      state.use_cpu ? sampler_options[SAMPLER_PCG] : sampler_options[state.sampler],
+      state.group_width, state.group_height, state.morton ? "true" : "false",
+      state.bench_frames, NUM_RAYS,
+      total_ms / state.bench_frames, min_ms, max_ms,
+      samples / seconds, (f64)total_rays / seconds
+  );
+  /* Where the rays went - every camera path once, GPU only */
+  if (!state.use_cpu) {
+    u64 paths = 0, bounces = 0;
+    for (u32 j = 0; j <= MAX_BOUNCES; j++) {
+      paths += path_counts[COUNTER_PATH_LENGTHS + j];
+      bounces += path_counts[COUNTER_PATH_LENGTHS + j] * j;
+    }
+    printf("{\"roulette_depth\": %u, \"max_bounces\": %d, \"mean_path_length\": %.4f, \"path_lengths\": [",
+        state.roulette_depth, MAX_BOUNCES, paths > 0 ? (f64)bounces / paths : 0.0);
+    for (u32 j = 0; j <= MAX_BOUNCES; j++) {
+      printf("%s%llu", j > 0 ? ", " : "", (unsigned long long)path_counts[COUNTER_PATH_LENGTHS + j]);
+    }
+    printf("], \"path_ends\": {");
+    for (u32 j = 0; j < PATH_ENDS; j++) {
+      printf("%s\"%s\": %llu", j > 0 ? ", " : "", path_end_names[j],
+          (unsigned long long)path_counts[COUNTER_PATH_ENDS + j]);
+    }
+    printf("}}\n");
+  }
+  fflush(stdout);
+}
+
+/* Scene name in convergence reports - file name without extension */
+void scene_name(char *name, size_t size) {
+  if (state.scene_path == NH_NULL) {
+    snprintf(name, size, "builtin");
+    return;
+  }
+  const char *base = strrchr(state.scene_path, '/');
+  snprintf(name, size, "%s", base != NH_NULL ? base + 1 : state.scene_path);
+  char *extension = strrchr(name, '.');
+  if (extension != NH_NULL && extension != name) *extension = '\0';
+}
+/* Mean samples per pixel since the pixels last reset */
+f64 mean_samples(f32 *stats, u32 frames) {
+  const u32 pixels = state.render_width * state.render_height;
+  if (state.use_cpu) return (f64)frames * NUM_RAYS;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, state.pixel_stats_buffer);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(f32) * 4 * pixels, stats);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  f64 total = 0.0;
+  for (u32 i = 0; i < pixels; i++) total += stats[4 * i];
+  return total / pixels;
+}
+/* Convergence benchmark, see converge.h - false on a regression or error */
+bool run_converge(void) {
+  const u32 pixels = state.render_width * state.render_height;
+  const u32 frames = state.render_references ? state.reference_frames : state.converge_frames;
+  const f64 frequency = (f64)SDL_GetPerformanceFrequency();
+  NH_INFO("Running convergence benchmark (%u poses, %u frames)...", (u32)CONVERGE_POSES, frames);
+  char scene[128], path[512];
+  scene_name(scene, sizeof(scene));
+  f32 *image = (f32 *)malloc(sizeof(f32) * 4 * pixels);
+  f32 *stats = (f32 *)malloc(sizeof(f32) * 4 * pixels);
+  NH_ASSERT_MSG(image != NH_NULL && stats != NH_NULL, "Failed to allocate readback");
+  FILE *report = NH_NULL, *baseline = NH_NULL;
+  bool success = true;
+  if (state.report_path != NH_NULL && !state.render_references) {
+    report = fopen(state.report_path, "w");
+    if (report == NH_NULL) NH_ERROR("Failed to open %s", state.report_path);
+    else converge_write_header(report);
+  }
+  if (state.baseline_path != NH_NULL && !state.render_references) {
+    baseline = fopen(state.baseline_path, "r");
+    if (baseline == NH_NULL) NH_ERROR("Failed to open %s", state.baseline_path);
+  }
+
+  for (u32 pose = 0; pose < CONVERGE_POSES; pose++) {
+    /* Same camera and random numbers every run */
+    state.camera = converge_pose_camera(&converge_poses[pose], &state.scene.tlas.nodes[0]);
+    state.angle_x = converge_poses[pose].angle_x;
+    state.angle_y = converge_poses[pose].angle_y;
+    state.focal_length = converge_poses[pose].focal_length;
+    state.ticks = 0;
+    state.frame_index = 0;
+    state.history_valid = false;
+    srand(pose + 1);
+    snprintf(path, sizeof(path), "%s/%s-%u.pfm", state.converge_dir, scene, pose);
+    f32 *reference = NH_NULL;
+    if (!state.render_references) {
+      reference = converge_read_pfm(path, state.render_width, state.render_height);
+      if (reference == NH_NULL) {
+        NH_ERROR("No %dx%d reference %s, render one with --reference", state.render_width, state.render_height, path);
+        success = false;
+        continue;
+      }
+    }
+
+    /* Accumulate, checkpoints at powers of two and the last frame */
+    converge_point_t points[CONVERGE_MAX_POINTS];
+    u32 count = 0;
+    f64 ms = 0.0;
+    for (u32 frame = 1; frame <= frames; frame++) {
+      u64 start = SDL_GetPerformanceCounter();
+      render_frame();
+      glFinish();
+      ms += (f64)(SDL_GetPerformanceCounter() - start) * 1000.0 / frequency;
+      state.ticks++;
+      const bool checkpoint = !state.render_references && (frame & (frame - 1)) == 0;
+      if (!checkpoint && frame != frames) continue;
+      /* The image as it would be shown, denoising counts towards the time */
+      u32 texture = state.texture;
+      f64 point_ms = ms;
+      if (state.denoise && !state.use_cpu) {
+        start = SDL_GetPerformanceCounter();
+        texture = dispatch_denoise();
+        glFinish();
+        point_ms += (f64)(SDL_GetPerformanceCounter() - start) * 1000.0 / frequency;
+      }
+      glBindTexture(GL_TEXTURE_2D, texture);
+      glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, image);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      if (state.render_references) {
+        if (!converge_write_pfm(path, image, state.render_width, state.render_height)) {
+          NH_ERROR("Failed to write %s", path);
+          success = false;
+        } else {
+          NH_LOG_ENTRY("Reference %s: %u frames in %.1fs", path, frames, ms / 1000.0);
+        }
+        break;
+      }
+      converge_point_t *point = &points[count++];
+      point->frame = frame;
+      point->samples_per_pixel = mean_samples(stats, frame);
+      point->ms = point_ms;
+      converge_error(image, reference, pixels, &point->rmse, &point->relmse);
+      if (report != NH_NULL) converge_write_point(report, scene, pose, point);
+      NH_LOG_ENTRY("Pose %u, frame %u: %.1f spp, %.1fms, relMSE %.4g",
+          pose, frame, point->samples_per_pixel, point->ms, point->relmse);
+    }
+    free(reference);
+    if (state.render_references) continue;
+
+    /* Time to threshold, against the baseline's */
+    f64 threshold_ms = -1.0, threshold_spp = -1.0;
+    const bool converged = converge_time_to_threshold(points, count, CONVERGE_THRESHOLD, &threshold_ms, &threshold_spp);
+    f64 baseline_ms = -1.0, baseline_spp = -1.0;
+    bool regression = false;
+    if (baseline != NH_NULL) {
+      converge_point_t baseline_points[CONVERGE_MAX_POINTS];
+      const u32 baseline_count = converge_read_points(baseline, scene, pose, baseline_points);
+      if (converge_time_to_threshold(baseline_points, baseline_count, CONVERGE_THRESHOLD, &baseline_ms, &baseline_spp)) {
+        regression = !converged || threshold_ms > baseline_ms * (1.0 + CONVERGE_TOLERANCE);
+      }
+    }
+    if (regression && converged) {
+      NH_ERROR("Regression: %s pose %u reaches relMSE %g in %.1fms, baseline %.1fms",
+          scene, pose, CONVERGE_THRESHOLD, threshold_ms, baseline_ms);
+    } else if (regression) {
+      NH_ERROR("Regression: %s pose %u never reaches relMSE %g, baseline %.1fms",
+          scene, pose, CONVERGE_THRESHOLD, baseline_ms);
+    }
+    if (regression) success = false;
+    printf(
+        "{\"scene\": \"%s\", \"pose\": %u, \"backend\": \"%s\", \"pipeline\": \"%s\", \"sampler\": \"%s\", "
+        "\"adaptive\": %s, \"denoise\": %s, \"width\": %d, \"height\": %d, \"frames\": %u, "
+        "\"final_relmse\": %.6g, \"threshold\": %g, \"ms_to_threshold\": %.1f, \"spp_to_threshold\": %.1f, "
+        "\"baseline_ms_to_threshold\": %.1f, \"regression\": %s}\n",
+        scene, pose, state.use_cpu ? "cpu" : "gpu", state.use_cpu || !state.use_wavefront ? "megakernel" : "wavefront",
+        state.use_cpu ? sampler_options[SAMPLER_PCG] : sampler_options[state.sampler],
+        state.adaptive ? "true" : "false", state.denoise && !state.use_cpu ? "true" : "false",
+        state.render_width, state.render_height, frames,
+        count > 0 ? points[count - 1].relmse : -1.0, CONVERGE_THRESHOLD, threshold_ms, threshold_spp,
+        baseline_ms, regression ? "true" : "false"
+    );
+    fflush(stdout);
+  }
+
+  if (report != NH_NULL) fclose(report);
+  if (baseline != NH_NULL) fclose(baseline);
+  free(image);
+  free(stats);
+  return success;
 }
 
 /* Entry point */
-int main(void) {
+int main(int argc, char **argv) {
+  /* Parse arguments */
+  for (i32 i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--bench") == 0) {
+      state.bench = true;
+      state.bench_frames = BENCH_FRAMES;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        state.bench_frames = (u32)atoi(argv[++i]);
+        /* Per-frame times divide by it */
+        if (state.bench_frames == 0) {
+          NH_ERROR("Bad benchmark frames: %s", argv[i]);
+          return 1;
+        }
+      }
+    } else if (strcmp(argv[i], "--converge") == 0 && i + 1 < argc) {
+      state.converge_dir = argv[++i];
+      state.converge_frames = CONVERGE_FRAMES;
+      if (i + 1 < argc && argv[i + 1][0] != '-'
+          && !parse_count(argv[++i], CONVERGE_MAX_FRAMES, &state.converge_frames)) {
+        NH_ERROR("Bad convergence frames: %s, expected 1 to %u", argv[i], CONVERGE_MAX_FRAMES);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--reference") == 0) {
+      state.render_references = true;
+      state.reference_frames = CONVERGE_REFERENCE_FRAMES;
+      if (i + 1 < argc && argv[i + 1][0] != '-'
+          && !parse_count(argv[++i], CONVERGE_MAX_FRAMES, &state.reference_frames)) {
+        NH_ERROR("Bad reference frames: %s, expected 1 to %u", argv[i], CONVERGE_MAX_FRAMES);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+      state.report_path = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      state.baseline_path = argv[++i];
+    } else if (strcmp(argv[i], "--cpu") == 0) {
+      state.use_cpu = true;
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      state.profile_path = argv[++i];
+    } else if (strcmp(argv[i], "--target-ms") == 0 && i + 1 < argc) {
+      state.target_ms = (f32)atof(argv[++i]);
+    } else if (strcmp(argv[i], "--adaptive") == 0) {
+      state.adaptive = true;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        state.adaptive_threshold = (f32)atof(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--roulette") == 0 && i + 1 < argc) {
+      state.roulette_depth = (u32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--denoise") == 0) {
+      state.denoise = true;
+    } else if (strcmp(argv[i], "--wavefront") == 0) {
+      state.use_wavefront = true;
+    } else if (strcmp(argv[i], "--group") == 0 && i + 1 < argc) {
+      i++;
+      if (sscanf(argv[i], "%ux%u", &state.group_width, &state.group_height) != 2
+          || state.group_width == 0 || state.group_height == 0
+          || state.group_width * state.group_height > 1024) {
+        NH_ERROR("Bad workgroup size: %s", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--morton") == 0) {
+      state.morton = true;
+    } else if (strcmp(argv[i], "--tune") == 0) {
+      state.tune = true;
+    } else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+      i++;
+      state.sampler = SAMPLERS;
+      for (u32 j = 0; j < SAMPLERS; j++) {
+        if (strcmp(argv[i], sampler_options[j]) == 0) state.sampler = j;
+      }
+      if (state.sampler == SAMPLERS) {
+        NH_ERROR("Unknown sampler: %s", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--tonemap") == 0 && i + 1 < argc) {
+      i++;
+      state.tonemap = TONEMAPS;
+      for (u32 j = 0; j < TONEMAPS; j++) {
+        if (strcmp(argv[i], tonemap_options[j]) == 0) state.tonemap = j;
+      }
+      if (state.tonemap == TONEMAPS) {
+        NH_ERROR("Unknown tonemap: %s", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--exposure") == 0 && i + 1 < argc) {
+      state.exposure = (f32)atof(argv[++i]);
+    } else if (strcmp(argv[i], "--display-format") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "rgba8") == 0) state.display_format = GL_RGBA8;
+      else if (strcmp(argv[i], "r11g11b10") == 0) state.display_format = GL_R11F_G11F_B10F;
+      else {
+        NH_ERROR("Unknown display format: %s", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--program-cache") == 0 && i + 1 < argc) {
+      state.program_cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "--no-program-cache") == 0) {
+      state.program_cache_dir = "";
+    } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+      state.output_path = argv[++i];
+    } else if (strcmp(argv[i], "--resolution") == 0 && i + 1 < argc) {
+      i++;
+      if (sscanf(argv[i], "%ux%u", &state.output_width, &state.output_height) != 2
+          || state.output_width == 0 || state.output_height == 0) {
+        NH_ERROR("Bad resolution: %s", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+      if (!parse_count(argv[++i], RENDER_MAX_SAMPLES, &state.output_samples)) {
+        NH_ERROR("Bad sample count: %s, expected 1 to %u", argv[i], RENDER_MAX_SAMPLES);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+      if (!parse_count(argv[++i], RENDER_MAX_TILE, &state.tile_size)) {
+        NH_ERROR("Bad tile size: %s, expected 1 to %u", argv[i], RENDER_MAX_TILE);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--camera") == 0 && i + 1 < argc) {
+      state.camera_string = argv[++i];
+    } else if (strcmp(argv[i], "--resume") == 0) {
+      state.resume = true;
+    } else if (strcmp(argv[i], "--coordinate") == 0 && i + 1 < argc) {
+      state.coordinate_address = argv[++i];
+    } else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+      state.worker_address = argv[++i];
+    } else if (strcmp(argv[i], "--unit") == 0 && i + 1 < argc) {
+      if (!parse_count(argv[++i], RENDER_MAX_SAMPLES, &state.unit_dispatches)) {
+        NH_ERROR("Bad unit size: %s, expected 1 to %u", argv[i], RENDER_MAX_SAMPLES);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      state.record_path = argv[++i];
+      state.record = true;
+    } else if (strcmp(argv[i], "--record-fps") == 0 && i + 1 < argc) {
+      if (!parse_count(argv[++i], RECORD_MAX_FPS, &state.record_fps)) {
+        NH_ERROR("Bad frame rate: %s, expected 1 to %u", argv[i], RECORD_MAX_FPS);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+      state.scene_path = argv[++i];
+    } else if (strcmp(argv[i], "--animate") == 0) {
+      state.animate = true;
+    } else {
+      NH_ERROR("Unknown argument: %s", argv[i]);
+      return 1;
+    }
+  }
+
+  /* Morton order shares the index bits out between the sides */
+  if (state.morton && ((state.group_width & (state.group_width - 1)) != 0
+        || (state.group_height & (state.group_height - 1)) != 0)) {
+    NH_ERROR("--morton needs power of two workgroup sides");
+    return 1;
+  }
+
+  /* The coordinator writes the file, and units can't be picked up again */
+  if (state.coordinate_address != NH_NULL && (state.output_path == NH_NULL || state.resume)) {
+    NH_ERROR("--coordinate needs --render, and can't --resume");
+    return 1;
+  }
+
+  /* No window for either benchmark, an offline render or a worker - the
+   * coordinator shows the image as it comes in */
+  const bool headless = state.bench || state.converge_dir != NH_NULL || state.worker_address != NH_NULL
+    || (state.output_path != NH_NULL && state.coordinate_address == NH_NULL);
+  i32 exit_code = 0;
+
   /* Init SDL */
   NH_INFO("Initializing SDL...");
   NH_ASSERT_MSG(SDL_Init(SDL_INIT_VIDEO) == 0, "Failed to initialize SDL");
@@ -215,7 +2037,7 @@ int main(void) {
     SDL_WINDOWPOS_UNDEFINED,
     640,
     480,
-    SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE
+    SDL_WINDOW_OPENGL | (headless ? SDL_WINDOW_HIDDEN : SDL_WINDOW_RESIZABLE)
   );
   NH_ASSERT_MSG(state.window != NH_NULL, "Failed to create window");
   state.width = 640;
@@ -231,6 +2053,14 @@ int main(void) {
   /* Create OpenGL context */
   NH_INFO("Creating OpenGL context...");
   state.context = SDL_GL_CreateContext(state.window);
+  if (state.context == NH_NULL) {
+    /* No OpenGL 4.3, 3.3 is enough for the CPU renderer */
+    NH_INFO("OpenGL 4.3 unavailable, retrying with 3.3...");
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+    state.context = SDL_GL_CreateContext(state.window);
+  }
   NH_ASSERT_MSG(state.context != NH_NULL, "Failed to create OpenGL context");
   NH_LOG_ENTRY("Version: %s", glGetString(GL_VERSION));
   NH_LOG_ENTRY("Vendor: %s", glGetString(GL_VENDOR));
@@ -251,6 +2081,11 @@ int main(void) {
   /* Load OpenGL functions */
   NH_INFO("Loading OpenGL functions...");
   NH_ASSERT_MSG(loadGL(), "Failed to load OpenGL functions");
+  state.has_compute = hasComputeGL();
+  /* Program binaries, unless turned off with an empty directory */
+  if (state.program_cache_dir == NH_NULL) state.program_cache_dir = PROGRAM_CACHE_DIR;
+  programs_init(&state.programs, state.program_cache_dir[0] != '\0' ? state.program_cache_dir : NH_NULL);
+  NH_LOG_ENTRY("Program cache: %s", state.programs.cache_dir != NH_NULL ? state.programs.cache_dir : "off");
 
   /* Create vertex array object */
   NH_INFO("Creating vertex array object...");
@@ -277,130 +2112,93 @@ int main(void) {
   /* Unbind vertex array object */
   glBindVertexArray(0);
 
-  /* Create shader program */
+  /* Create shader program, from shader.vertex and shader.fragment */
   NH_INFO("Creating shader program...");
-  int success;
-  char info_log[512];
-  /* Create vertex shader */
-  NH_LOG_ENTRY("Creating vertex shader...");
-  u32 vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-  /* Read from shader.vertex */
-  char *vert_shader_source = get_file_contents("shader.vertex");
-  glShaderSource(vertex_shader, 1, (const char**)&vert_shader_source, NULL);
-  free(vert_shader_source);
-  glCompileShader(vertex_shader);
-  glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(vertex_shader, 512, NULL, info_log);
-    NH_ERROR("Failed to compile vertex shader: %s", info_log);
-  }
-  /* Create fragment shader */
-  NH_LOG_ENTRY("Creating fragment shader...");
-  u32 fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  /* Read from shader.fragment */
-  char *frag_shader_source = get_file_contents("shader.fragment");
-  glShaderSource(fragment_shader, 1, (const char**)&frag_shader_source, NULL);
-  free(frag_shader_source);
-  glCompileShader(fragment_shader);
-  glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(fragment_shader, 512, NULL, info_log);
-    NH_ERROR("Failed to compile fragment shader: %s", info_log);
-  }
-
-  /* Create shader program */
-  NH_LOG_ENTRY("Creating shader program...");
-  state.shader_program = glCreateProgram();
-  glAttachShader(state.shader_program, vertex_shader);
-  glAttachShader(state.shader_program, fragment_shader);
-  glLinkProgram(state.shader_program);
-  glGetProgramiv(state.shader_program, GL_LINK_STATUS, &success);
-  if (!success) {
-    glGetProgramInfoLog(state.shader_program, 512, NULL, info_log);
-    NH_ERROR("Failed to link shader program: %s", info_log);
-  }
-  /* Cleanup */
-  NH_LOG_ENTRY("Cleaning up...");
-  glDeleteShader(vertex_shader);
-  glDeleteShader(fragment_shader);
-  glUseProgram(0);
+  create_draw_program(&state.shader_program, "shader.vertex", "shader.fragment");
+  NH_ASSERT_MSG(state.shader_program != 0, "Failed to create shader program");
 
   /* Create compute shader */
-  NH_INFO("Creating compute shader...");
-  NH_LOG_ENTRY("Creating compute shader...");
-  u32 compute_shader = glCreateShader(GL_COMPUTE_SHADER);
-
-  /* Read from shader.compute */
-  char *compute_shader_source = get_file_contents("shader.compute");
-  glShaderSource(compute_shader, 1, (const char**)&compute_shader_source, NULL);
-  free(compute_shader_source);
-
-  glCompileShader(compute_shader);
-  glGetShaderiv(compute_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(compute_shader, 512, NULL, info_log);
-    NH_ERROR("Failed to compile compute shader: %s", info_log);
-  }
-  /* Create compute program */
-  NH_LOG_ENTRY("Creating compute program...");
-  state.compute_shader = glCreateProgram();
-  glAttachShader(state.compute_shader, compute_shader);
-  glLinkProgram(state.compute_shader);
-  glGetProgramiv(state.compute_shader, GL_LINK_STATUS, &success);
-  if (!success) {
-    glGetProgramInfoLog(state.compute_shader, 512, NULL, info_log);
-    NH_ERROR("Failed to link compute program: %s", info_log);
-  }
-  /* Cleanup */
-  NH_LOG_ENTRY("Cleaning up...");
-  glDeleteShader(state.compute_shader);
-  glUseProgram(0);
-
-  /* Create shader program */
-  NH_INFO("Creating solid shader program...");
-  /* Create vertex shader */
-  NH_LOG_ENTRY("Creating vertex shader...");
-  u32 solid_vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-  /* Read from shader.vertex */
-  char *solid_vert_shader_source = get_file_contents("shader.vertex");
-  glShaderSource(solid_vertex_shader, 1, (const char**)&solid_vert_shader_source, NULL);
-  free(solid_vert_shader_source);
-  glCompileShader(solid_vertex_shader);
-  glGetShaderiv(solid_vertex_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(solid_vertex_shader, 512, NULL, info_log);
-    NH_ERROR("Failed to compile vertex shader: %s", info_log);
-  }
-  /* Create fragment shader */
-  NH_LOG_ENTRY("Creating fragment shader...");
-  u32 solid_fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  /* Read from solid.fragment */
-  char *solid_frag_shader_source = get_file_contents("solid.fragment");
-  glShaderSource(solid_fragment_shader, 1, (const char**)&solid_frag_shader_source, NULL);
-  free(solid_frag_shader_source);
-  glCompileShader(solid_fragment_shader);
-  glGetShaderiv(solid_fragment_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(solid_fragment_shader, 512, NULL, info_log);
-    NH_ERROR("Failed to compile fragment shader: %s", info_log);
+  if (state.has_compute) {
+    NH_INFO("Creating compute shader...");
+    /* Megakernel, from shader.compute */
+    NH_LOG_ENTRY("Creating compute program...");
+    /* Workgroup size: --group, else last run's tuning, else tune it below */
+    if (state.group_width != 0) state.tune = false;
+    else if (state.tune || !load_trace_group()) state.tune = true;
+    if (state.group_width == 0) {
+      state.group_width = TRACE_GROUP_WIDTH;
+      state.group_height = TRACE_GROUP_HEIGHT;
+    }
+    const program_desc_t trace_desc = trace_program_desc();
+    create_program(&state.compute_shader, &trace_desc);
+    if (state.compute_shader == 0) state.has_compute = false;
+    /* Wavefront kernels, from wavefront.compute */
+    NH_LOG_ENTRY("Creating wavefront kernels...");
+    state.has_wavefront = state.has_compute;
+    char defines[256];
+    for (u32 i = 0; i < WAVEFRONT_KERNELS && state.has_wavefront; i++) {
+      snprintf(defines, sizeof(defines), "#define GROUP_SIZE %d\n%s", WAVEFRONT_GROUP_SIZE, wavefront_defines[i]);
+      if (create_compute_program(&state.wavefront_kernels[i], "wavefront.compute", defines) == 0) state.has_wavefront = false;
+    }
+    if (!state.has_wavefront && state.use_wavefront) {
+      NH_INFO("Wavefront kernels unavailable, using megakernel...");
+      state.use_wavefront = false;
+    }
+    /* Denoiser, from denoise.compute */
+    NH_LOG_ENTRY("Creating denoise kernel...");
+    state.has_denoise = state.has_compute && create_compute_program(&state.denoise_program, "denoise.compute", "") != 0;
+    if (!state.has_denoise) state.denoise = false;
+    /* Resolve, from resolve.compute - without it the quad shows the HDR image clamped */
+    NH_LOG_ENTRY("Creating resolve kernel...");
+    if (state.display_format == 0) state.display_format = GL_RGBA8;
+    const bool r11g11b10 = state.display_format == GL_R11F_G11F_B10F;
+    state.has_resolve = state.has_compute && create_compute_program(&state.resolve_program, "resolve.compute",
+        r11g11b10 ? "#define DISPLAY_R11G11B10\n" : "") != 0;
+    NH_LOG_ENTRY("Display image: %s, %s tonemap", r11g11b10 ? "R11G11B10F" : "RGBA8", tonemap_names[state.tonemap]);
+    /* Reprojection, from reproject.compute - without it moving starts over */
+    NH_LOG_ENTRY("Creating reprojection kernel...");
+    state.has_reproject = state.has_compute && create_compute_program(&state.reproject_program, "reproject.compute", "") != 0;
+    glUseProgram(0);
+    /* Blue-noise mask for SAMPLER_BLUE_NOISE */
+    NH_LOG_ENTRY("Generating blue-noise mask...");
+    u64 noise_start = SDL_GetPerformanceCounter();
+    f32 *mask = (f32 *)malloc(sizeof(f32) * BLUE_NOISE_TEXELS);
+    NH_ASSERT_MSG(mask != NH_NULL && blue_noise_generate(mask), "Failed to generate blue-noise mask");
+    state.blue_noise_buffer = create_storage_buffer(15, sizeof(f32) * BLUE_NOISE_TEXELS, mask);
+    free(mask);
+    NH_LOG_ENTRY("Blue-noise mask: %dx%d in %.1fms", BLUE_NOISE_SIZE, BLUE_NOISE_SIZE,
+        (f64)(SDL_GetPerformanceCounter() - noise_start) * 1000.0 / (f64)SDL_GetPerformanceFrequency());
+  } else {
+    NH_INFO("Compute shaders unavailable, using CPU renderer...");
   }
 
-  /* Create shader program */
-  NH_LOG_ENTRY("Creating shader program...");
-  state.solid_shader = glCreateProgram();
-  glAttachShader(state.solid_shader, solid_vertex_shader);
-  glAttachShader(state.solid_shader, solid_fragment_shader);
-  glLinkProgram(state.solid_shader);
-  glGetProgramiv(state.solid_shader, GL_LINK_STATUS, &success);
-  if (!success) {
-    glGetProgramInfoLog(state.solid_shader, 512, NULL, info_log);
-    NH_ERROR("Failed to link shader program: %s", info_log);
+  /* Create UI shader program, from ui.vertex and ui.fragment */
+  NH_INFO("Creating UI shader program...");
+  u32 ui_program = create_draw_program(&state.ui.program, "ui.vertex", "ui.fragment");
+  NH_ASSERT_MSG(ui_program != 0, "Failed to create UI shader program");
+  NH_LOG_ENTRY("Programs: %u from cache, %u compiled, %.1fms",
+      state.programs.cached, state.programs.compiled, state.programs.ms);
+  /* Hot reload of the shader sources, not for headless runs */
+  state.watch.fd = -1;
+  if (!headless && !watch_init(&state.watch, ".")) NH_ERROR("Failed to watch shader sources");
+  NH_LOG_ENTRY("Hot reload: %s, parallel compile: %s", state.watch.fd >= 0 ? "on" : "off",
+      state.programs.parallel ? "yes" : "no");
+  /* Create HUD batcher, unknown characters get the last font cell */
+  NH_ASSERT_MSG(
+      ui_init(&state.ui, ui_program, font_chars, FONT_COLS, FONT_ROWS, FONT_COLS * FONT_ROWS - 1),
+      "Failed to create HUD batcher"
+  );
+  /* Create GPU timer queries */
+  NH_INFO("Creating GPU timer queries...");
+  if (!profiler_init(&state.profiler, state.profile_path)) {
+    NH_ERROR("Failed to open %s", state.profile_path);
+  }
+  NH_LOG_ENTRY("Pipeline statistics: %s", state.profiler.has_statistics ? "yes" : "no");
+  /* Screenshots and video, only from the window */
+  if (!headless) {
+    state.has_capture = capture_init(&state.capture);
+    if (!state.has_capture) NH_ERROR("Failed to start capture writer");
   }
-  /* Cleanup */
-  NH_LOG_ENTRY("Cleaning up...");
-  glDeleteShader(solid_vertex_shader);
-  glDeleteShader(solid_fragment_shader);
-  glUseProgram(0);
 
 
   /* Create texture */
@@ -413,19 +2211,50 @@ int main(void) {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   /*glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);*/
   /*glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);*/
-  glTexImage2D(
-      GL_TEXTURE_2D,
-      0,
-      GL_RGBA32F,
-      COMPUTE_WIDTH, /* Width */
-      COMPUTE_HEIGHT, /* Height */
-      0,
-      GL_RGBA,
-      GL_UNSIGNED_BYTE,
-      NULL
-  );
-  glBindImageTexture(0, state.texture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
   glBindTexture(GL_TEXTURE_2D, 0);
+  if (state.has_compute) {
+    /* Create ray counter */
+    NH_INFO("Creating ray counter...");
+    u32 zero[COUNTERS] = {0};
+    glGenBuffers(1, &state.ray_counter);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, state.ray_counter);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(zero), zero, GL_DYNAMIC_READ);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, state.ray_counter);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+  /* Create scene */
+  NH_INFO("Loading scene...");
+  NH_ASSERT_MSG(load_scene(), "Failed to load scene");
+  if (state.has_compute) {
+    upload_scene();
+  }
+  /* Create CPU renderer */
+  NH_INFO("Creating CPU renderer...");
+  cpu_renderer_init(&state.cpu, 1, 1, &state.scene, &state.lights);
+  NH_LOG_ENTRY("Worker threads: %u", state.cpu.num_threads);
+  if (!state.has_compute) {
+    state.use_cpu = true;
+    state.denoise = false;
+  }
+  /* Size the render target - the window's, fixed for the benchmark */
+  NH_INFO("Creating render target...");
+  if (state.target_ms <= 0.0f) state.target_ms = TARGET_FRAME_MS;
+  if (state.adaptive_threshold <= 0.0f) state.adaptive_threshold = ADAPTIVE_THRESHOLD;
+  if (state.roulette_depth == 0) state.roulette_depth = ROULETTE_DEPTH;
+  if (state.output_width == 0) state.output_width = RENDER_WIDTH;
+  if (state.output_height == 0) state.output_height = RENDER_HEIGHT;
+  if (state.output_samples == 0) state.output_samples = RENDER_SAMPLES;
+  if (state.tile_size == 0) state.tile_size = RENDER_TILE;
+  if (state.unit_dispatches == 0) state.unit_dispatches = UNIT_DISPATCHES;
+  if (state.record_path == NH_NULL) state.record_path = RECORD_PATH;
+  if (state.record_fps == 0) state.record_fps = RECORD_FPS;
+  state.render_scale = 1;
+  if (state.bench) resize_render_target(BENCH_WIDTH, BENCH_HEIGHT);
+  else if (state.converge_dir != NH_NULL) resize_render_target(CONVERGE_WIDTH, CONVERGE_HEIGHT);
+  else if (state.output_path != NH_NULL || state.worker_address != NH_NULL) resize_render_target(state.tile_size, state.tile_size);
+  else resize_render_target(state.width, state.height);
+  /* Prepare ray queries */
+  NH_ASSERT_MSG(rq_init(&state.scene), "Failed to prepare ray queries");
   /* Create font texture */
   NH_INFO("Creating font texture...");
   glGenTextures(1, &state.font_texture);
@@ -459,6 +2288,38 @@ int main(void) {
   state.keys = SDL_GetKeyboardState(NULL);
   state.active_slider = 0;
   sliders[0].active = true;
+  /* Megakernel workgroup size, timed from the starting camera if it renders first */
+  if (state.has_compute && state.tune && !state.use_cpu && !state.use_wavefront) tune_trace_group();
+  if (state.has_compute) {
+    NH_LOG_ENTRY("Megakernel workgroup: %ux%u, %s order", state.group_width, state.group_height,
+        state.morton ? "Morton" : "row");
+  }
+  /* Benchmark: fixed camera, lit scene, no window */
+  if (state.bench) {
+    state.test_in = 5.0f;
+    /* Every pixel takes NUM_RAYS samples, so samples_per_sec holds */
+    state.adaptive = false;
+    run_bench();
+    state.running = false;
+  }
+  /* Convergence benchmark: fixed poses, lit scene, no window */
+  if (state.converge_dir != NH_NULL) {
+    state.test_in = 5.0f;
+    if (!run_converge()) exit_code = 1;
+    state.running = false;
+  }
+  /* Offline render: given camera, lit scene, no window unless workers trace it */
+  if (state.output_path != NH_NULL) {
+    state.test_in = 5.0f;
+    if (!(state.coordinate_address != NH_NULL ? run_coordinate() : run_render())) exit_code = 1;
+    state.running = false;
+  }
+  /* Worker: another process's offline render, a unit at a time */
+  if (state.worker_address != NH_NULL) {
+    if (!run_worker()) exit_code = 1;
+    state.running = false;
+  }
+  if (state.record && state.has_capture) start_recording();
   while (state.running) {
     /* Delta time - 1 */
     u64 start = SDL_GetPerformanceCounter();
@@ -483,8 +2344,68 @@ int main(void) {
             /* Update state */
             state.width = event.window.data1;
             state.height = event.window.data2;
-            /* Reset ticks */
-            state.ticks = 0;
+            /* Follow the window, resets ticks */
+            resize_render_target(state.width, state.height);
+          }
+        } break;
+        case (SDL_MOUSEBUTTONDOWN): {
+          /* Left click = pick */
+          if (event.button.button == SDL_BUTTON_LEFT) {
+            pick(event.button.x, event.button.y);
+          }
+        } break;
+        case (SDL_KEYDOWN): {
+          /* C = toggle CPU/GPU renderer */
+          if (event.key.keysym.scancode == SDL_SCANCODE_C && !event.key.repeat) {
+            if (state.has_compute) {
+              state.use_cpu = !state.use_cpu;
+              NH_INFO("Using %s renderer", state.use_cpu ? "CPU" : "GPU");
+              state.ticks = 0;
+            }
+          }
+          /* P = toggle megakernel/wavefront pipeline */
+          if (event.key.keysym.scancode == SDL_SCANCODE_P && !event.key.repeat) {
+            if (state.has_wavefront) {
+              state.use_wavefront = !state.use_wavefront;
+              NH_INFO("Using %s pipeline", state.use_wavefront ? "wavefront" : "megakernel");
+              state.ticks = 0;
+            }
+          }
+          /* N = toggle denoiser, accumulation carries on */
+          if (event.key.keysym.scancode == SDL_SCANCODE_N && !event.key.repeat) {
+            if (state.has_denoise) {
+              state.denoise = !state.denoise;
+              NH_INFO("Denoiser %s", state.denoise ? "on" : "off");
+            }
+          }
+          /* V = toggle adaptive sampling, the statistics carry on */
+          if (event.key.keysym.scancode == SDL_SCANCODE_V && !event.key.repeat) {
+            state.adaptive = !state.adaptive;
+            NH_INFO("Adaptive sampling %s", state.adaptive ? "on" : "off");
+          }
+          /* G = next sampler, the image converges to the same thing */
+          if (event.key.keysym.scancode == SDL_SCANCODE_G && !event.key.repeat) {
+            state.sampler = (state.sampler + 1) % SAMPLERS;
+            NH_INFO("Using %s sampler", sampler_names[state.sampler]);
+          }
+          /* X = next tonemap operator, only the display changes */
+          if (event.key.keysym.scancode == SDL_SCANCODE_X && !event.key.repeat && state.has_resolve) {
+            state.tonemap = (state.tonemap + 1) % TONEMAPS;
+            NH_INFO("Using %s tonemap", tonemap_names[state.tonemap]);
+          }
+          /* Y = spin instances about their y axis, or stop them where they are */
+          if (event.key.keysym.scancode == SDL_SCANCODE_Y && !event.key.repeat) {
+            state.animate = !state.animate;
+            NH_INFO("Animation %s", state.animate ? "on" : "off");
+          }
+          /* F9 = start/stop recording video */
+          if (event.key.keysym.scancode == SDL_SCANCODE_F9 && !event.key.repeat && state.has_capture) {
+            if (capture_recording(&state.capture)) stop_recording();
+            else start_recording();
+          }
+          /* F10 = screenshot */
+          if (event.key.keysym.scancode == SDL_SCANCODE_F10 && !event.key.repeat && state.has_capture) {
+            take_screenshot();
           }
         } break;
       }
@@ -605,6 +2526,18 @@ int main(void) {
       }
     }
 
+    /* Rebuild changed shaders, swap in ones that are done */
+    update_reload();
+
+    /* Move animated instances */
+    update_instances();
+
+    /* Resolution for this frame */
+    update_render_scale();
+
+    /* GPU timings from a few frames ago */
+    profiler_begin_frame(&state.profiler);
+
     /* Clear screen */
     glClear(GL_COLOR_BUFFER_BIT);
 
@@ -612,39 +2545,78 @@ int main(void) {
     glUseProgram(state.shader_program);
     glBindVertexArray(state.vao);
 
+    /* Path trace */
+    profiler_begin(&state.profiler, PROFILE_TRACE);
+    render_frame();
+    profiler_end(&state.profiler, PROFILE_TRACE);
+
+    /* Denoise, the features come from the GPU kernels only */
+    u32 display_texture = state.texture;
+    if (state.denoise && !state.use_cpu) {
+      profiler_begin(&state.profiler, PROFILE_DENOISE);
+      display_texture = dispatch_denoise();
+      profiler_end(&state.profiler, PROFILE_DENOISE);
+    }
+
+    /* Tonemap into the display image, the quad then reads 4 bytes a texel */
+    if (state.has_resolve) {
+      profiler_begin(&state.profiler, PROFILE_RESOLVE);
+      display_texture = dispatch_resolve(display_texture);
+      profiler_end(&state.profiler, PROFILE_RESOLVE);
+    }
+
     /* Bind texture */
-    glBindTexture(GL_TEXTURE_2D, state.texture);
+    glBindTexture(GL_TEXTURE_2D, display_texture);
     glActiveTexture(GL_TEXTURE0);
 
-    /* Set uniforms */
-    glUseProgram(state.compute_shader);
-    glUniform1f(glGetUniformLocation(state.compute_shader, "width"), (f32)state.width);
-    glUniform1f(glGetUniformLocation(state.compute_shader, "height"), (f32)state.height);
-    glUniform1f(glGetUniformLocation(state.compute_shader, "focal_length"), state.focal_length);
-    glUniform1f(glGetUniformLocation(state.compute_shader, "angle_x"), state.angle_x);
-    glUniform1f(glGetUniformLocation(state.compute_shader, "angle_y"), state.angle_y);
-    glUniform1f(glGetUniformLocation(state.compute_shader, "test_in"), (f32)state.test_in);
-    glUniform1ui(glGetUniformLocation(state.compute_shader, "random_seed"), rand());
-    glUniform1ui(glGetUniformLocation(state.compute_shader, "ticks"), state.ticks);
-    glUniform3fv(glGetUniformLocation(state.compute_shader, "camera"), 1, (f32 *)&state.camera);
-
-    /* Dispatch compute shader */
-    glDispatchCompute(COMPUTE_WIDTH / 32, COMPUTE_HEIGHT / 32, 1);
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-
-    /* Draw */
+    /* Draw, scaling up the traced part of the target */
     glUseProgram(state.shader_program);
+    const f32 uv_scale[] = {
+      (f32)state.render_width / (f32)state.image_width,
+      (f32)state.render_height / (f32)state.image_height,
+    };
+    glUniform2fv(glGetUniformLocation(state.shader_program, "uv_scale"), 1, uv_scale);
+    profiler_begin(&state.profiler, PROFILE_BLIT);
     glDrawArrays(GL_TRIANGLES, 0, 6);
+    profiler_end(&state.profiler, PROFILE_BLIT);
 
     /* Unbind */
     glBindTexture(GL_TEXTURE_2D, 0);
     glBindVertexArray(0);
 
-    /* Render hints */
+    /* Read back what was drawn for screenshots and video, the HUD isn't in it */
+    if (state.has_capture) {
+      capture_frame(&state.capture, display_texture, (u32)state.image_width, (u32)state.image_height,
+          (u32)state.render_width, (u32)state.render_height);
+      if (capture_recording(&state.capture)) {
+        if (capture_failed(&state.capture)) stop_recording();
+        else sprintf(state.capture_string, "REC %llu frames, %llu dropped",
+            (unsigned long long)state.capture.frames, (unsigned long long)state.capture.dropped);
+      }
+    }
+
+    /* Render hints, the HUD is drawn in one batch */
+    profiler_begin(&state.profiler, PROFILE_HUD);
+    ui_begin(&state.ui);
     render_string("[M]+[W]      = wireframe", (nh_vec2_t){-0.925f, -0.925f}, 0.025f);
     render_string("[M]+[R]      = regular", (nh_vec2_t){-0.925f, -0.875f}, 0.025f);
     render_string("[W][A][S][D] = move", (nh_vec2_t){-0.925f, -0.825f}, 0.025f);
     render_string("<ARROW-KEYS> = look", (nh_vec2_t){-0.925f, -0.775f}, 0.025f);
+    render_string(state.use_cpu ? "[C]          = renderer: CPU" : "[C]          = renderer: GPU",
+        (nh_vec2_t){-0.925f, -0.725f}, 0.025f);
+    render_string(state.use_wavefront ? "[P]          = pipeline: wavefront" : "[P]          = pipeline: megakernel",
+        (nh_vec2_t){-0.925f, -0.675f}, 0.025f);
+    render_string(state.adaptive ? "[V]          = adaptive: on" : "[V]          = adaptive: off",
+        (nh_vec2_t){-0.925f, -0.625f}, 0.025f);
+    render_string(state.denoise ? "[N]          = denoise: on" : "[N]          = denoise: off",
+        (nh_vec2_t){-0.925f, -0.575f}, 0.025f);
+    render_string(sampler_hints[state.sampler], (nh_vec2_t){-0.925f, -0.525f}, 0.025f);
+    render_string(tonemap_hints[state.tonemap], (nh_vec2_t){-0.925f, -0.475f}, 0.025f);
+    render_string(capture_recording(&state.capture) ? "[F9]         = record: on" : "[F9]         = record: off",
+        (nh_vec2_t){-0.925f, -0.425f}, 0.025f);
+    render_string("[F10]        = screenshot", (nh_vec2_t){-0.925f, -0.375f}, 0.025f);
+    render_string(state.animate ? "[Y]          = animate: on" : "[Y]          = animate: off",
+        (nh_vec2_t){-0.925f, -0.325f}, 0.025f);
     /* Render sliders */
     for (u32 i = 0; i < sizeof(sliders) / sizeof(sliders[0]); i++) {
       render_slider(sliders[i]);
@@ -652,6 +2624,17 @@ int main(void) {
     /* Draw delta time and FPS to the screen */
     render_string(state.delta_string, (nh_vec2_t){0.5f, 0.925f}, 0.025f);
     render_string(state.fps_string, (nh_vec2_t){0.5f, 0.875f}, 0.025f);
+    render_string(state.pick_string, (nh_vec2_t){0.5f, 0.825f}, 0.025f);
+    render_string(state.capture_string, (nh_vec2_t){0.5f, 0.775f}, 0.025f);
+    /* Resolution and GPU timings under the sliders */
+    render_string(state.resolution_string, (nh_vec2_t){-0.925f, 0.775f}, 0.025f);
+    render_string(state.gpu_string, (nh_vec2_t){-0.925f, 0.725f}, 0.025f);
+    render_string(state.stages_string, (nh_vec2_t){-0.925f, 0.675f}, 0.025f);
+    render_string(state.invocations_string, (nh_vec2_t){-0.925f, 0.625f}, 0.025f);
+    render_string(state.reload_string, (nh_vec2_t){-0.925f, 0.575f}, 0.025f);
+    ui_end(&state.ui, state.font_texture);
+    profiler_end(&state.profiler, PROFILE_HUD);
+    profiler_end_frame(&state.profiler);
 
     /* Swap buffers */
     SDL_GL_SwapWindow(state.window);
@@ -668,20 +2651,68 @@ int main(void) {
       /*NH_INFO("Delta time: %.2fms, FPS: %f", delta * 1000.0, state.fps);*/
       sprintf(state.fps_string, "FPS: %f", state.fps);
       sprintf(state.delta_string, "Delta time: %.2fms", delta * 1000.0);
+      const profiler_t *profiler = &state.profiler;
+      sprintf(state.gpu_string, "GPU: %.2fms, trace %.2fms",
+          profiler->frame_ms, profiler->stage_ms[PROFILE_TRACE]);
+      sprintf(state.stages_string, "Denoise %.3fms, resolve %.3fms, blit %.3fms, HUD %.3fms",
+          profiler->stage_ms[PROFILE_DENOISE], profiler->stage_ms[PROFILE_RESOLVE],
+          profiler->stage_ms[PROFILE_BLIT], profiler->stage_ms[PROFILE_HUD]);
+      if (profiler->has_statistics) {
+        sprintf(state.invocations_string, "Invocations: %llu", (unsigned long long)profiler->invocations);
+      }
     }
   }
 
   /* Clean up */
   NH_INFO("Cleaning up...");
+  /* Frames still in flight are written first */
+  if (state.has_capture) {
+    if (capture_recording(&state.capture)) stop_recording();
+    capture_destroy(&state.capture);
+  }
   glDeleteTextures(1, &state.font_texture);
   glDeleteTextures(1, &state.texture);
+  glDeleteTextures(1, &state.history_texture);
+  glDeleteTextures(1, &state.normal_depth_texture);
+  glDeleteTextures(1, &state.albedo_texture);
+  glDeleteTextures(2, state.denoise_textures);
+  glDeleteTextures(1, &state.display_texture);
+  glDeleteBuffers(1, &state.ray_counter);
+  glDeleteBuffers(1, &state.sphere_buffer);
+  glDeleteBuffers(3, state.triangle_buffers);
+  glDeleteBuffers(1, &state.bvh_node_buffer);
+  glDeleteBuffers(1, &state.bvh_ref_buffer);
+  glDeleteBuffers(1, &state.material_buffer);
+  glDeleteBuffers(1, &state.light_buffer);
+  glDeleteBuffers(1, &state.tlas_buffer);
+  glDeleteBuffers(1, &state.path_buffer);
+  glDeleteBuffers(1, &state.ray_queue_buffer);
+  glDeleteBuffers(1, &state.shadow_queue_buffer);
+  glDeleteBuffers(1, &state.wavefront_buffer);
+  glDeleteBuffers(1, &state.accumulation_buffer);
+  glDeleteBuffers(1, &state.pixel_stats_buffer);
+  glDeleteBuffers(1, &state.history_stats_buffer);
+  glDeleteBuffers(1, &state.blue_noise_buffer);
+  rq_destroy();
+  lights_destroy(&state.lights);
+  scene_destroy(&state.scene);
+  cpu_renderer_destroy(&state.cpu);
   glDeleteProgram(state.compute_shader);
+  glDeleteProgram(state.denoise_program);
+  glDeleteProgram(state.reproject_program);
+  glDeleteProgram(state.resolve_program);
+  for (u32 i = 0; i < WAVEFRONT_KERNELS; i++) {
+    glDeleteProgram(state.wavefront_kernels[i]);
+  }
   glDeleteProgram(state.shader_program);
+  ui_destroy(&state.ui);
+  watch_destroy(&state.watch);
+  profiler_destroy(&state.profiler);
   glDeleteBuffers(1, &state.vbo);
   glDeleteVertexArrays(1, &state.vao);
   SDL_GL_DeleteContext(state.context);
   SDL_DestroyWindow(state.window);
   IMG_Quit();
   SDL_Quit();
-  return 0;
+  return exit_code;
 }
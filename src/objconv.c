@@ -0,0 +1,286 @@
+/* OBJ/MTL to scene file converter */
+#define _POSIX_C_SOURCE 200809L
+
+/* Neushoorn includes */
+#include <nh_base.h>
+
+/* stdlib includes */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Project headers */
+#include "scene.h"
+
+/*
+ * Usage: objconv input.obj output.scn
+ *
+ * Reads positions (v), faces (f, fan-triangulated) and materials (mtllib,
+ * usemtl), builds the BVH and writes everything as a scene file, one mesh
+ * placed by one identity instance. Normals and texture coordinates are
+ * ignored. MTL mapping:
+ *
+ *   Kd -> albedo        Ks -> specular_color, specular_probability = max(Ks)
+ *   Ke -> emission      Ns -> roughness = 1 - sqrt(Ns / 1000)
+ *   d  -> opacity       Tr -> opacity = 1 - Tr
+ *   Ni -> ior
+ */
+
+/* Consts */
+#define MAX_NAME            128
+#define MAX_FACE            64  /* Vertices per face */
+
+/* Structs */
+typedef struct {
+  void *data;
+  u32 count, capacity;
+  size_t element_size;
+} array_t;
+typedef struct {
+  char name[MAX_NAME];
+} material_name_t;
+
+/* Utils */
+f64 now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec * 1000.0 + (f64)ts.tv_nsec / 1000000.0;
+}
+void *array_push(array_t *array) {
+  if (array->count == array->capacity) {
+    array->capacity = array->capacity ? array->capacity * 2 : 1024;
+    array->data = realloc(array->data, array->capacity * array->element_size);
+    if (array->data == NH_NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  return (u8 *)array->data + array->element_size * array->count++;
+}
+/* Whole file, NUL terminated */
+char *read_file(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (file == NH_NULL) return NH_NULL;
+  fseek(file, 0, SEEK_END);
+  *size = (size_t)ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *contents = (char *)malloc(*size + 1);
+  if (contents == NH_NULL || fread(contents, 1, *size, file) != *size) {
+    free(contents);
+    fclose(file);
+    return NH_NULL;
+  }
+  fclose(file);
+  contents[*size] = '\0';
+  return contents;
+}
+/* Tokenizing */
+static inline char *skip_space(char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+  return p;
+}
+static inline char *next_line(char *p) {
+  while (*p != '\0' && *p != '\n') p++;
+  return *p == '\n' ? p + 1 : p;
+}
+static inline bool keyword(char **p, const char *word) {
+  size_t length = strlen(word);
+  if (strncmp(*p, word, length) != 0) return false;
+  char c = (*p)[length];
+  if (c != ' ' && c != '\t') return false;
+  *p = skip_space(*p + length);
+  return true;
+}
+/* Rest of the line, trimmed, as a name */
+static void read_name(char *p, char *name) {
+  u32 length = 0;
+  while (*p != '\0' && *p != '\n' && *p != '\r' && length < MAX_NAME - 1) {
+    name[length++] = *p++;
+  }
+  while (length > 0 && (name[length - 1] == ' ' || name[length - 1] == '\t')) length--;
+  name[length] = '\0';
+}
+static nh_vec3_t read_vec3(char *p) {
+  nh_vec3_t v;
+  v.x = strtof(p, &p);
+  v.y = strtof(p, &p);
+  v.z = strtof(p, &p);
+  return v;
+}
+static f32 max3(nh_vec3_t v) {
+  return fmaxf(v.x, fmaxf(v.y, v.z));
+}
+
+/* Materials */
+material_t default_material(void) {
+  return (material_t){
+    {0.8f, 0.8f, 0.8f}, 1.0f, {0.0f, 0.0f, 0.0f}, 0.0f,
+    {0.0f, 0.0f, 0.0f}, 0.0f, 1.0f, 1.0f, {0.0f, 0.0f}
+  };
+}
+/* Append the materials of an MTL file */
+bool parse_mtl(const char *path, array_t *materials, array_t *names) {
+  size_t size;
+  char *contents = read_file(path, &size);
+  if (contents == NH_NULL) return false;
+  material_t *material = NH_NULL;
+  for (char *p = contents; *p != '\0'; p = next_line(p)) {
+    p = skip_space(p);
+    if (keyword(&p, "newmtl")) {
+      material = (material_t *)array_push(materials);
+      *material = default_material();
+      read_name(p, ((material_name_t *)array_push(names))->name);
+    } else if (material == NH_NULL) {
+      continue;
+    } else if (keyword(&p, "Kd")) {
+      material->albedo = read_vec3(p);
+    } else if (keyword(&p, "Ks")) {
+      material->specular_color = read_vec3(p);
+      material->specular_probability = fminf(max3(material->specular_color), 1.0f);
+    } else if (keyword(&p, "Ke")) {
+      nh_vec3_t emission = read_vec3(p);
+      f32 strength = max3(emission);
+      if (strength > 0.0f) {
+        material->emission_color = (nh_vec3_t){
+          emission.x / strength, emission.y / strength, emission.z / strength
+        };
+        material->emission_strength = strength;
+      }
+    } else if (keyword(&p, "Ns")) {
+      f32 shininess = fminf(fmaxf(strtof(p, NH_NULL), 0.0f), 1000.0f);
+      material->roughness = 1.0f - sqrtf(shininess / 1000.0f);
+    } else if (keyword(&p, "d")) {
+      material->opacity = strtof(p, NH_NULL);
+    } else if (keyword(&p, "Tr")) {
+      material->opacity = 1.0f - strtof(p, NH_NULL);
+    } else if (keyword(&p, "Ni")) {
+      material->ior = strtof(p, NH_NULL);
+    }
+  }
+  free(contents);
+  return true;
+}
+u32 find_material(const array_t *names, const char *name) {
+  const material_name_t *list = (const material_name_t *)names->data;
+  for (u32 i = 0; i < names->count; i++) {
+    if (strcmp(list[i].name, name) == 0) return i;
+  }
+  return 0;
+}
+
+/* Entry point */
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s input.obj output.scn\n", argv[0]);
+    return 1;
+  }
+  const char *input = argv[1], *output = argv[2];
+
+  /* Read */
+  f64 start = now_ms();
+  size_t size;
+  char *contents = read_file(input, &size);
+  if (contents == NH_NULL) {
+    fprintf(stderr, "Failed to read %s\n", input);
+    return 1;
+  }
+  f64 read_end = now_ms();
+
+  /* Parse */
+  array_t vertices = {NH_NULL, 0, 0, sizeof(vertex_t)};
+  array_t triangles = {NH_NULL, 0, 0, sizeof(triangle_t)};
+  array_t materials = {NH_NULL, 0, 0, sizeof(material_t)};
+  array_t names = {NH_NULL, 0, 0, sizeof(material_name_t)};
+  /* Material 0 is used until the first usemtl */
+  *(material_t *)array_push(&materials) = default_material();
+  strcpy(((material_name_t *)array_push(&names))->name, "");
+  u32 material = 0, skipped = 0;
+  for (char *p = contents; *p != '\0'; p = next_line(p)) {
+    p = skip_space(p);
+    if (keyword(&p, "v")) {
+      vertex_t *vertex = (vertex_t *)array_push(&vertices);
+      vertex->position = read_vec3(p);
+      vertex->padding = 0.0f;
+    } else if (keyword(&p, "f")) {
+      /* Fan-triangulate, indices may be v, v/vt, v//vn or v/vt/vn */
+      u32 face[MAX_FACE], count = 0;
+      bool valid = true;
+      while (count < MAX_FACE) {
+        char *end;
+        long index = strtol(p, &end, 10);
+        if (end == p) break;
+        index = index < 0 ? (long)vertices.count + index : index - 1;
+        if (index < 0 || index >= (long)vertices.count) valid = false;
+        face[count++] = (u32)index;
+        p = end;
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        p = skip_space(p);
+      }
+      if (!valid || count < 3) {
+        skipped++;
+        continue;
+      }
+      for (u32 i = 1; i + 1 < count; i++) {
+        *(triangle_t *)array_push(&triangles) = (triangle_t){face[0], face[i], face[i + 1], material};
+      }
+    } else if (keyword(&p, "usemtl")) {
+      char name[MAX_NAME];
+      read_name(p, name);
+      material = find_material(&names, name);
+    } else if (keyword(&p, "mtllib")) {
+      /* Relative to the OBJ file */
+      char name[MAX_NAME], path[4096];
+      read_name(p, name);
+      const char *slash = strrchr(input, '/');
+      int directory = slash != NH_NULL ? (int)(slash - input + 1) : 0;
+      snprintf(path, sizeof(path), "%.*s%s", directory, input, name);
+      if (!parse_mtl(path, &materials, &names)) {
+        fprintf(stderr, "Warning: failed to read %s\n", path);
+      }
+    }
+  }
+  free(contents);
+  f64 parse_end = now_ms();
+  if (skipped > 0) {
+    fprintf(stderr, "Warning: skipped %u invalid faces\n", skipped);
+  }
+
+  /* Build and write */
+  scene_t scene = {0};
+  scene.materials = (const material_t *)materials.data;
+  scene.material_count = materials.count;
+  scene.vertices = (const vertex_t *)vertices.data;
+  scene.vertex_count = vertices.count;
+  scene.triangles = (const triangle_t *)triangles.data;
+  scene.triangle_count = triangles.count;
+  /* Everything is one mesh, placed as is */
+  mesh_t mesh = {0, triangles.count, 0, 0};
+  const instance_t instance = {SCENE_IDENTITY, 0, 0.0f, {0, 0}};
+  scene.meshes = &mesh;
+  scene.mesh_count = 1;
+  scene.instances = &instance;
+  scene.instance_count = 1;
+  if (!scene_build_bvh(&scene)) {
+    fprintf(stderr, "Failed to build BVH: %s\n", scene_error);
+    return 1;
+  }
+  f64 build_end = now_ms();
+  if (!scene_write(&scene, output)) {
+    fprintf(stderr, "Failed to write %s: %s\n", output, scene_error);
+    return 1;
+  }
+  f64 write_end = now_ms();
+  printf("%u vertices, %u triangles, %u materials, %u BVH nodes\n",
+      scene.vertex_count, scene.triangle_count, scene.material_count, scene.bvh.node_count);
+  printf("read %.1fms, parse %.1fms, BVH %.1fms, write %.1fms\n",
+      read_end - start, parse_end - read_end, build_end - parse_end, write_end - build_end);
+
+  bvh_destroy(&scene.bvh);
+  free(vertices.data);
+  free(triangles.data);
+  free(materials.data);
+  free(names.data);
+  return 0;
+}
@@ -0,0 +1,309 @@
+/* Include guard */
+#if !defined(OUTPUT_H)
+#define OUTPUT_H
+
+/* Includes */
+#include <nh_base.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Images written a band of rows at a time, top row first, so an offline
+ * render never holds more than one band. The format comes from the
+ * extension, and both are laid out so nothing already written has to
+ * change:
+ *
+ *   .png  8-bit RGB, clamped to [0, 1] - tonemapping is up to the caller. The
+ *         zlib stream is stored (uncompressed) blocks, one IDAT chunk per
+ *         band, with the Adler-32 of the rows so far carried in adler
+ *   .exr  32-bit float RGB scanlines, no compression, so the line offset
+ *         table is written up front
+ *
+ * Writing can stop after any band and carry on from the offset, rows and
+ * adler it had reached, which is what checkpoints keep. A checkpoint is a
+ * line of text, renamed into place once the band it counts is written:
+ *
+ *   width height tile samples x y z yaw pitch focal bands offset adler
+ *
+ * and is only resumed from with the same settings.
+ */
+
+/* Consts */
+#define OUTPUT_PNG          0
+#define OUTPUT_EXR          1
+#define OUTPUT_STORED_MAX   65535 /* Bytes in a stored deflate block */
+#define OUTPUT_EXR_HEADER   512   /* Room for the EXR header */
+
+/* Structs */
+typedef struct {
+  FILE *file;
+  u32 format;                   /* OUTPUT_* */
+  u32 width, height;
+  u32 rows;                     /* Written so far, from the top */
+  u32 adler;                    /* PNG: Adler-32 of the scanlines so far */
+  u64 offset;                   /* Bytes of file that are done */
+} output_t;
+typedef struct {
+  u32 width, height;            /* Settings, must match to resume */
+  u32 tile;
+  u32 samples;
+  f32 camera[6];                /* x, y, z, yaw, pitch, focal length */
+  u32 bands;                    /* Bands of tiles written */
+  u64 offset;                   /* Then output_t's state after them */
+  u32 adler;
+} output_checkpoint_t;
+
+/* Globals */
+u32 output_crc_table[256];
+
+/* Byte order - PNG is big endian, EXR little */
+static void output_put_be32(u8 *bytes, u32 value) {
+  bytes[0] = (u8)(value >> 24);
+  bytes[1] = (u8)(value >> 16);
+  bytes[2] = (u8)(value >> 8);
+  bytes[3] = (u8)value;
+}
+static void output_put_le32(u8 *bytes, u32 value) {
+  bytes[0] = (u8)value;
+  bytes[1] = (u8)(value >> 8);
+  bytes[2] = (u8)(value >> 16);
+  bytes[3] = (u8)(value >> 24);
+}
+static void output_put_le64(u8 *bytes, u64 value) {
+  output_put_le32(bytes, (u32)value);
+  output_put_le32(bytes + 4, (u32)(value >> 32));
+}
+static u32 output_crc(u32 crc, const u8 *bytes, size_t size) {
+  if (output_crc_table[1] == 0) {
+    for (u32 i = 0; i < 256; i++) {
+      u32 c = i;
+      for (u32 k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      output_crc_table[i] = c;
+    }
+  }
+  for (size_t i = 0; i < size; i++) crc = output_crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+static u32 output_adler(u32 adler, const u8 *bytes, size_t size) {
+  u32 a = adler & 0xffff, b = adler >> 16;
+  for (size_t i = 0; i < size; i++) {
+    a = (a + bytes[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+static bool output_write_bytes(output_t *output, const void *bytes, size_t size) {
+  if (fwrite(bytes, 1, size, output->file) != size) return false;
+  output->offset += size;
+  return true;
+}
+/* PNG chunk: length, type, data, CRC of type and data */
+static bool output_png_chunk(output_t *output, const char *type, const u8 *data, u32 size) {
+  u8 length[4], crc[4];
+  output_put_be32(length, size);
+  output_put_be32(crc, output_crc(output_crc(0xffffffffu, (const u8 *)type, 4), data, size) ^ 0xffffffffu);
+  return output_write_bytes(output, length, 4)
+    && output_write_bytes(output, type, 4)
+    && (size == 0 || output_write_bytes(output, data, size))
+    && output_write_bytes(output, crc, 4);
+}
+/* EXR attribute: name, type, size, value */
+static u32 output_exr_attribute(u8 *header, u32 at, const char *name, const char *type, const void *value, u32 size) {
+  memcpy(header + at, name, strlen(name) + 1);
+  at += (u32)strlen(name) + 1;
+  memcpy(header + at, type, strlen(type) + 1);
+  at += (u32)strlen(type) + 1;
+  output_put_le32(header + at, size);
+  memcpy(header + at + 4, value, size);
+  return at + 4 + size;
+}
+/* Bytes before the first scanline */
+static u32 output_exr_header(u8 *header, u32 width, u32 height) {
+  static const u8 magic[8] = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+  memcpy(header, magic, sizeof(magic));
+  u32 at = sizeof(magic);
+  /* Channels in name order: name, FLOAT, linear, reserved, x and y sampling */
+  u8 channels[3 * 18 + 1] = {0};
+  for (u32 i = 0; i < 3; i++) {
+    u8 *channel = channels + 18 * i;
+    channel[0] = (u8)"BGR"[i];
+    output_put_le32(channel + 2, 2);
+    output_put_le32(channel + 10, 1);
+    output_put_le32(channel + 14, 1);
+  }
+  at = output_exr_attribute(header, at, "channels", "chlist", channels, sizeof(channels));
+  const u8 none = 0;
+  at = output_exr_attribute(header, at, "compression", "compression", &none, 1);
+  u8 window[16] = {0};
+  output_put_le32(window + 8, width - 1);
+  output_put_le32(window + 12, height - 1);
+  at = output_exr_attribute(header, at, "dataWindow", "box2i", window, sizeof(window));
+  at = output_exr_attribute(header, at, "displayWindow", "box2i", window, sizeof(window));
+  at = output_exr_attribute(header, at, "lineOrder", "lineOrder", &none, 1);
+  u8 one[4], center[8] = {0};
+  const f32 value = 1.0f;
+  memcpy(one, &value, sizeof(one));
+  at = output_exr_attribute(header, at, "pixelAspectRatio", "float", one, sizeof(one));
+  at = output_exr_attribute(header, at, "screenWindowCenter", "v2f", center, sizeof(center));
+  at = output_exr_attribute(header, at, "screenWindowWidth", "float", one, sizeof(one));
+  header[at++] = 0;
+  return at;
+}
+static u32 output_format(const char *path) {
+  const char *extension = strrchr(path, '.');
+  return extension != NH_NULL && strcmp(extension, ".exr") == 0 ? OUTPUT_EXR : OUTPUT_PNG;
+}
+
+/* Create the file and write everything before the first row */
+bool output_open(output_t *output, const char *path, u32 width, u32 height) {
+  *output = (output_t){NH_NULL, output_format(path), width, height, 0, 1, 0};
+  output->file = fopen(path, "wb");
+  if (output->file == NH_NULL) return false;
+  if (output->format == OUTPUT_EXR) {
+    u8 header[OUTPUT_EXR_HEADER];
+    const u32 size = output_exr_header(header, width, height);
+    bool success = output_write_bytes(output, header, size);
+    /* One scanline per chunk: y, size, then B, G and R */
+    const u64 line = 8 + 12 * (u64)width;
+    for (u32 y = 0; y < height && success; y++) {
+      u8 offset[8];
+      output_put_le64(offset, size + 8 * (u64)height + line * y);
+      success = output_write_bytes(output, offset, sizeof(offset));
+    }
+    return success;
+  }
+  static const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  u8 ihdr[13] = {0};
+  output_put_be32(ihdr, width);
+  output_put_be32(ihdr + 4, height);
+  ihdr[8] = 8;                  /* Bits per channel */
+  ihdr[9] = 2;                  /* RGB */
+  const u8 zlib[2] = {0x78, 0x01};
+  return output_write_bytes(output, signature, sizeof(signature))
+    && output_png_chunk(output, "IHDR", ihdr, sizeof(ihdr))
+    && output_png_chunk(output, "IDAT", zlib, sizeof(zlib));
+}
+/* Open a file written up to offset, rows and adler to carry on with it */
+bool output_resume(output_t *output, const char *path, u32 width, u32 height, u64 offset, u32 rows, u32 adler) {
+  *output = (output_t){NH_NULL, output_format(path), width, height, rows, adler, offset};
+  output->file = fopen(path, "r+b");
+  if (output->file == NH_NULL) return false;
+  return fseeko(output->file, (off_t)offset, SEEK_SET) == 0;
+}
+/* Rows of RGBA floats, top first, width apart */
+bool output_write(output_t *output, const f32 *rgba, u32 rows) {
+  if (output->rows + rows > output->height) return false;
+  const u32 width = output->width;
+  bool success = true;
+  if (output->format == OUTPUT_EXR) {
+    const u32 size = 12 * width;
+    u8 *line = (u8 *)malloc(8 + (size_t)size);
+    if (line == NH_NULL) return false;
+    for (u32 y = 0; y < rows && success; y++) {
+      output_put_le32(line, output->rows + y);
+      output_put_le32(line + 4, size);
+      for (u32 c = 0; c < 3; c++) {
+        for (u32 x = 0; x < width; x++) {
+          /* B, G, R */
+          u32 bits;
+          memcpy(&bits, &rgba[4 * ((size_t)y * width + x) + 2 - c], sizeof(bits));
+          output_put_le32(line + 8 + 4 * (c * width + x), bits);
+        }
+      }
+      success = output_write_bytes(output, line, 8 + (size_t)size);
+    }
+    free(line);
+  } else {
+    /* Filter byte then RGB, in stored blocks of at most OUTPUT_STORED_MAX */
+    const size_t scanline = 1 + 3 * (size_t)width;
+    const size_t blocks = (scanline + OUTPUT_STORED_MAX - 1) / OUTPUT_STORED_MAX;
+    const size_t size = rows * (scanline + 5 * blocks);
+    u8 *data = (u8 *)malloc(size);
+    u8 *line = (u8 *)malloc(scanline);
+    if (data == NH_NULL || line == NH_NULL) {
+      free(data);
+      free(line);
+      return false;
+    }
+    u8 *at = data;
+    for (u32 y = 0; y < rows; y++) {
+      line[0] = 0;
+      for (u32 x = 0; x < 3 * width; x++) {
+        const f32 value = rgba[4 * ((size_t)y * width + x / 3) + x % 3];
+        line[1 + x] = (u8)(value <= 0.0f ? 0.0f : value >= 1.0f ? 255.0f : value * 255.0f + 0.5f);
+      }
+      output->adler = output_adler(output->adler, line, scanline);
+      for (size_t start = 0; start < scanline; start += OUTPUT_STORED_MAX) {
+        const u32 length = (u32)(scanline - start < OUTPUT_STORED_MAX ? scanline - start : OUTPUT_STORED_MAX);
+        at[0] = 0;              /* Not final, stored */
+        at[1] = (u8)length;
+        at[2] = (u8)(length >> 8);
+        at[3] = (u8)~length;
+        at[4] = (u8)(~length >> 8);
+        memcpy(at + 5, line + start, length);
+        at += 5 + length;
+      }
+    }
+    success = output_png_chunk(output, "IDAT", data, (u32)size);
+    free(data);
+    free(line);
+  }
+  output->rows += rows;
+  /* On disk before a checkpoint says so */
+  return success && fflush(output->file) == 0;
+}
+/* Finish and close the file, anything after the end from an earlier run is cut */
+bool output_close(output_t *output) {
+  bool success = output->rows == output->height;
+  if (success && output->format == OUTPUT_PNG) {
+    /* An empty final stored block, then the checksum */
+    u8 end[9] = {1, 0, 0, 0xff, 0xff};
+    output_put_be32(end + 5, output->adler);
+    success = output_png_chunk(output, "IDAT", end, sizeof(end))
+      && output_png_chunk(output, "IEND", NH_NULL, 0);
+  }
+  success = fflush(output->file) == 0 && success;
+  success = ftruncate(fileno(output->file), (off_t)output->offset) == 0 && success;
+  success = fclose(output->file) == 0 && success;
+  output->file = NH_NULL;
+  return success;
+}
+
+/* Written to a temporary and renamed, so there is always a whole one */
+bool output_save_checkpoint(const char *path, const output_checkpoint_t *checkpoint) {
+  char temporary[512];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  FILE *file = fopen(temporary, "w");
+  if (file == NH_NULL) return false;
+  const f32 *camera = checkpoint->camera;
+  bool success = fprintf(file, "%u %u %u %u %.9g %.9g %.9g %.9g %.9g %.9g %u %llu %u\n",
+      checkpoint->width, checkpoint->height, checkpoint->tile, checkpoint->samples,
+      camera[0], camera[1], camera[2], camera[3], camera[4], camera[5],
+      checkpoint->bands, (unsigned long long)checkpoint->offset, checkpoint->adler) > 0;
+  success = fclose(file) == 0 && success;
+  if (success) success = rename(temporary, path) == 0;
+  if (!success) remove(temporary);
+  return success;
+}
+/* Same settings, progress aside? */
+bool output_checkpoint_matches(const output_checkpoint_t *a, const output_checkpoint_t *b) {
+  return a->width == b->width && a->height == b->height && a->tile == b->tile
+    && a->samples == b->samples && memcmp(a->camera, b->camera, sizeof(a->camera)) == 0;
+}
+bool output_load_checkpoint(const char *path, output_checkpoint_t *checkpoint) {
+  FILE *file = fopen(path, "r");
+  if (file == NH_NULL) return false;
+  f32 *camera = checkpoint->camera;
+  unsigned long long offset = 0;
+  const bool success = fscanf(file, "%u %u %u %u %f %f %f %f %f %f %u %llu %u",
+      &checkpoint->width, &checkpoint->height, &checkpoint->tile, &checkpoint->samples,
+      &camera[0], &camera[1], &camera[2], &camera[3], &camera[4], &camera[5],
+      &checkpoint->bands, &offset, &checkpoint->adler) == 13;
+  checkpoint->offset = offset;
+  fclose(file);
+  return success;
+}
+
+#endif /* OUTPUT_H */
@@ -0,0 +1,156 @@
+/* Include guard */
+#if !defined(PROFILER_H)
+#define PROFILER_H
+
+/* Includes */
+#include <nh_base.h>
+#include <stdio.h>
+
+/* Project headers */
+#include "loadgl.h"
+
+/*
+ * GPU timings per frame stage. Every frame gets a slot of query objects
+ * from a ring of PROFILE_FRAMES: a GL_TIME_ELAPSED query per stage,
+ * GL_TIMESTAMPs at the start and end of the frame, and a compute shader
+ * invocation count if pipeline statistics are supported. A slot is read
+ * when it comes round again, PROFILE_FRAMES - 1 frames later. If its
+ * results are not in yet they are dropped, so reading never stalls.
+ */
+
+/* Consts */
+#define PROFILE_TRACE       0   /* Path tracing, or the CPU image upload */
+#define PROFILE_DENOISE     1   /* Edge-aware filter, when enabled */
+#define PROFILE_RESOLVE     2   /* Tonemap into the display image */
+#define PROFILE_BLIT        3   /* Fullscreen quad */
+#define PROFILE_HUD         4   /* Text and sliders */
+#define PROFILE_STAGES      5
+#define PROFILE_FRAMES      4   /* Slots in the ring */
+#if !defined(GL_COMPUTE_SHADER_INVOCATIONS)
+#define GL_COMPUTE_SHADER_INVOCATIONS 0x82F5
+#endif
+
+/* Structs */
+typedef struct {
+  u32 elapsed[PROFILE_STAGES];  /* GL_TIME_ELAPSED per stage */
+  u32 timestamps[2];            /* GL_TIMESTAMP at frame start and end */
+  u32 invocations;              /* GL_COMPUTE_SHADER_INVOCATIONS */
+  u32 stages;                   /* Bit per stage that ran */
+  u64 frame;                    /* Frame the queries belong to */
+  bool pending;                 /* Queries issued, results not read */
+} profile_slot_t;
+typedef struct {
+  profile_slot_t slots[PROFILE_FRAMES];
+  u32 current;                  /* Slot of the frame being recorded */
+  u64 frame;                    /* Frames begun */
+  bool has_statistics;          /* Compute invocations counted? */
+  FILE *csv;                    /* Results as they arrive, or NH_NULL */
+  /* Latest results */
+  u64 result_frame;             /* Frame they belong to, 0 if none yet */
+  f64 stage_ms[PROFILE_STAGES];
+  f64 frame_ms;                 /* First timestamp to last */
+  u64 invocations;
+  u32 dropped;                  /* Slots reused before their results came */
+} profiler_t;
+
+/* Globals */
+const char *profile_stage_names[PROFILE_STAGES] = {"trace", "denoise", "resolve", "blit", "hud"};
+
+/* Create the query ring, csv_path may be NH_NULL */
+bool profiler_init(profiler_t *profiler, const char *csv_path) {
+  *profiler = (profiler_t){0};
+  profiler->has_statistics = SDL_GL_ExtensionSupported("GL_ARB_pipeline_statistics_query");
+  for (u32 i = 0; i < PROFILE_FRAMES; i++) {
+    profile_slot_t *slot = &profiler->slots[i];
+    glGenQueries(PROFILE_STAGES, slot->elapsed);
+    glGenQueries(2, slot->timestamps);
+    if (profiler->has_statistics) glGenQueries(1, &slot->invocations);
+  }
+  if (csv_path != NH_NULL) {
+    profiler->csv = fopen(csv_path, "w");
+    if (profiler->csv == NH_NULL) return false;
+    fprintf(profiler->csv, "frame");
+    for (u32 i = 0; i < PROFILE_STAGES; i++) fprintf(profiler->csv, ",%s_ms", profile_stage_names[i]);
+    fprintf(profiler->csv, ",gpu_frame_ms,compute_invocations\n");
+  }
+  return true;
+}
+static bool profiler_available(u32 query) {
+  i32 available = 0;
+  glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+  return available != 0;
+}
+static u64 profiler_result(u32 query) {
+  u64 result = 0;
+  glGetQueryObjectui64v(query, GL_QUERY_RESULT, &result);
+  return result;
+}
+/* Read a slot if its queries are done, true if they were */
+static bool profiler_collect(profiler_t *profiler, profile_slot_t *slot) {
+  if (!profiler_available(slot->timestamps[1])) return false;
+  for (u32 i = 0; i < PROFILE_STAGES; i++) {
+    if ((slot->stages & (1u << i)) && !profiler_available(slot->elapsed[i])) return false;
+  }
+  if (profiler->has_statistics && (slot->stages & (1u << PROFILE_TRACE))
+      && !profiler_available(slot->invocations)) {
+    return false;
+  }
+  profiler->result_frame = slot->frame;
+  for (u32 i = 0; i < PROFILE_STAGES; i++) {
+    profiler->stage_ms[i] = (slot->stages & (1u << i))
+      ? (f64)profiler_result(slot->elapsed[i]) / 1000000.0
+      : 0.0;
+  }
+  profiler->frame_ms = (f64)(profiler_result(slot->timestamps[1]) - profiler_result(slot->timestamps[0])) / 1000000.0;
+  profiler->invocations = profiler->has_statistics && (slot->stages & (1u << PROFILE_TRACE))
+    ? profiler_result(slot->invocations)
+    : 0;
+  if (profiler->csv != NH_NULL) {
+    fprintf(profiler->csv, "%llu", (unsigned long long)slot->frame);
+    for (u32 i = 0; i < PROFILE_STAGES; i++) fprintf(profiler->csv, ",%.4f", profiler->stage_ms[i]);
+    fprintf(profiler->csv, ",%.4f,%llu\n", profiler->frame_ms, (unsigned long long)profiler->invocations);
+  }
+  return true;
+}
+/* Take the next slot, reading what it held from PROFILE_FRAMES frames ago */
+void profiler_begin_frame(profiler_t *profiler) {
+  profiler->current = (profiler->current + 1) % PROFILE_FRAMES;
+  profile_slot_t *slot = &profiler->slots[profiler->current];
+  if (slot->pending && !profiler_collect(profiler, slot)) profiler->dropped++;
+  slot->pending = false;
+  slot->stages = 0;
+  slot->frame = ++profiler->frame;
+  glQueryCounter(slot->timestamps[0], GL_TIMESTAMP);
+}
+/* Stages must not overlap */
+void profiler_begin(profiler_t *profiler, u32 stage) {
+  profile_slot_t *slot = &profiler->slots[profiler->current];
+  slot->stages |= 1u << stage;
+  glBeginQuery(GL_TIME_ELAPSED, slot->elapsed[stage]);
+  if (stage == PROFILE_TRACE && profiler->has_statistics) {
+    glBeginQuery(GL_COMPUTE_SHADER_INVOCATIONS, slot->invocations);
+  }
+}
+void profiler_end(profiler_t *profiler, u32 stage) {
+  if (stage == PROFILE_TRACE && profiler->has_statistics) {
+    glEndQuery(GL_COMPUTE_SHADER_INVOCATIONS);
+  }
+  glEndQuery(GL_TIME_ELAPSED);
+}
+void profiler_end_frame(profiler_t *profiler) {
+  profile_slot_t *slot = &profiler->slots[profiler->current];
+  glQueryCounter(slot->timestamps[1], GL_TIMESTAMP);
+  slot->pending = true;
+}
+void profiler_destroy(profiler_t *profiler) {
+  for (u32 i = 0; i < PROFILE_FRAMES; i++) {
+    profile_slot_t *slot = &profiler->slots[i];
+    glDeleteQueries(PROFILE_STAGES, slot->elapsed);
+    glDeleteQueries(2, slot->timestamps);
+    if (profiler->has_statistics) glDeleteQueries(1, &slot->invocations);
+  }
+  if (profiler->csv != NH_NULL) fclose(profiler->csv);
+  *profiler = (profiler_t){0};
+}
+
+#endif /* PROFILER_H */
@@ -0,0 +1,336 @@
+/* Include guard */
+#if !defined(PROGRAMS_H)
+#define PROGRAMS_H
+
+/* Includes */
+#include <nh_base.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Project headers */
+#include "loadgl.h"
+
+/*
+ * Shader programs. Every stage is its files concatenated, with a block of
+ * #define lines put after the first file's #version line, so one source
+ * gives specialised variants (wavefront kernels, bounce and sample counts,
+ * workgroup sizes). Linked programs are cached on disk with
+ * glGetProgramBinary, keyed by a hash of the driver strings and the full
+ * source of every stage:
+ *
+ *   <cache_dir>/<key>.bin    PROGRAM_CACHE_MAGIC, binary format, binary
+ *
+ * Any change to a file, the defines or the driver is a new key. A binary
+ * the driver rejects anyway is compiled from source and written again, so
+ * the cache is never needed for correctness. Old keys are not cleaned up.
+ *
+ * Building is split so hot reload can keep rendering meanwhile:
+ * program_begin compiles and links without asking how it went, and with
+ * KHR_parallel_shader_compile the driver does that on its own threads,
+ * program_ready polls GL_COMPLETION_STATUS_KHR and program_finish collects
+ * the result. Without the extension the first status query just blocks.
+ */
+
+/* Consts */
+#define PROGRAM_MAX_STAGES  2   /* Vertex and fragment */
+#define PROGRAM_MAX_FILES   2   /* Per stage: common.compute, then the kernel */
+#define PROGRAM_CACHE_MAGIC 0x31425043u /* "CPB1" */
+#define PROGRAM_LOG_SIZE    512
+#define PROGRAM_DEFINES_SIZE 1024
+#if !defined(GL_PROGRAM_BINARY_RETRIEVABLE_HINT)
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#if !defined(GL_PROGRAM_BINARY_LENGTH)
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#if !defined(GL_NUM_PROGRAM_BINARY_FORMATS)
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+#if !defined(GL_COMPLETION_STATUS_KHR)
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+/* Structs */
+/* One stage, its files in order - unused ones NH_NULL */
+typedef struct {
+  u32 type;                     /* GL_*_SHADER */
+  const char *files[PROGRAM_MAX_FILES];
+} program_stage_t;
+/* What a program is built from, kept so it can be built again */
+typedef struct {
+  const char *name;             /* For logs, the file it is named after */
+  program_stage_t stages[PROGRAM_MAX_STAGES];
+  u32 stage_count;
+  char defines[PROGRAM_DEFINES_SIZE]; /* Put after the #version line */
+} program_desc_t;
+/* A program on its way, from program_begin to program_finish */
+typedef struct {
+  u32 program;                  /* Linking or linked, 0 if it failed early */
+  u32 shaders[PROGRAM_MAX_STAGES]; /* Kept for their logs until finished */
+  u64 key;                      /* Cache key */
+  bool cached;                  /* Loaded from a binary, nothing to wait for */
+  char error[PROGRAM_LOG_SIZE]; /* Why it failed, set by program_finish */
+} program_build_t;
+typedef struct {
+  const char *cache_dir;        /* Binaries, NH_NULL to always compile */
+  bool parallel;                /* KHR_parallel_shader_compile, see program_ready */
+  u64 driver_hash;              /* Vendor, renderer and version */
+  u32 cached, compiled;         /* Programs created, by where they came from */
+  f64 ms;                       /* Time spent creating them */
+} program_cache_t;
+/* Cache file header, the binary follows */
+typedef struct {
+  u32 magic;                    /* PROGRAM_CACHE_MAGIC */
+  u32 format;                   /* From glGetProgramBinary */
+  u32 size;                     /* Bytes of binary */
+  u32 padding;
+} program_header_t;
+
+/* FNV-1a, 64 bit */
+static u64 program_hash(u64 hash, const void *data, size_t size) {
+  const u8 *bytes = (const u8 *)data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+static char *program_read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NH_NULL) return NH_NULL;
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *contents = size >= 0 ? (char *)malloc((size_t)size + 1) : NH_NULL;
+  if (contents != NH_NULL && fread(contents, 1, (size_t)size, file) != (size_t)size) {
+    free(contents);
+    contents = NH_NULL;
+  }
+  fclose(file);
+  if (contents != NH_NULL) contents[size] = '\0';
+  return contents;
+}
+/* Files of a stage with defines after the #version line, NH_NULL on failure */
+static char *program_stage_source(const program_stage_t *stage, const char *defines) {
+  char *contents[PROGRAM_MAX_FILES] = {0};
+  size_t size = strlen(defines) + 1;
+  bool success = true;
+  for (u32 i = 0; i < PROGRAM_MAX_FILES && stage->files[i] != NH_NULL && success; i++) {
+    contents[i] = program_read_file(stage->files[i]);
+    if (contents[i] == NH_NULL) {
+      NH_ERROR("Failed to read %s", stage->files[i]);
+      success = false;
+    } else {
+      size += strlen(contents[i]) + 1;
+    }
+  }
+  char *source = success ? (char *)malloc(size) : NH_NULL;
+  if (source != NH_NULL) {
+    /* First line, defines, the rest */
+    const char *rest = strchr(contents[0], '\n');
+    rest = rest != NH_NULL ? rest + 1 : contents[0] + strlen(contents[0]);
+    size_t length = (size_t)(rest - contents[0]);
+    memcpy(source, contents[0], length);
+    if (length > 0 && source[length - 1] != '\n') source[length++] = '\n';
+    strcpy(source + length, defines);
+    strcat(source, rest);
+    for (u32 i = 1; i < PROGRAM_MAX_FILES && contents[i] != NH_NULL; i++) {
+      strcat(source, contents[i]);
+    }
+  }
+  for (u32 i = 0; i < PROGRAM_MAX_FILES; i++) free(contents[i]);
+  return source;
+}
+
+/* Binary from an earlier run, 0 if there is none or the driver rejects it */
+static u32 program_load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NH_NULL) return 0;
+  program_header_t header;
+  void *binary = NH_NULL;
+  if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == PROGRAM_CACHE_MAGIC) {
+    binary = malloc(header.size);
+    if (binary != NH_NULL && fread(binary, 1, header.size, file) != header.size) {
+      free(binary);
+      binary = NH_NULL;
+    }
+  }
+  fclose(file);
+  if (binary == NH_NULL) return 0;
+  u32 program = glCreateProgram();
+  glProgramBinary(program, header.format, binary, (GLsizei)header.size);
+  free(binary);
+  i32 success;
+  glGetProgramiv(program, GL_LINK_STATUS, &success);
+  if (!success) {
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+/* Written to a temporary and renamed, so a crash leaves no half file */
+static void program_save(const char *path, u32 program) {
+  i32 size = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+  if (size <= 0) return;
+  void *binary = malloc((size_t)size);
+  if (binary == NH_NULL) return;
+  u32 format;
+  glGetProgramBinary(program, size, NH_NULL, &format, binary);
+  program_header_t header = {PROGRAM_CACHE_MAGIC, format, (u32)size, 0};
+  char temporary[512];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  FILE *file = fopen(temporary, "wb");
+  bool success = file != NH_NULL
+    && fwrite(&header, sizeof(header), 1, file) == 1
+    && fwrite(binary, 1, (size_t)size, file) == (size_t)size;
+  if (file != NH_NULL) success = fclose(file) == 0 && success;
+  if (success) success = rename(temporary, path) == 0;
+  if (!success) {
+    remove(temporary);
+    NH_ERROR("Failed to write %s", path);
+  }
+  free(binary);
+}
+/* Compile and link from source without waiting on either */
+static void program_compile(program_build_t *build, const program_desc_t *desc, char **sources, bool retrievable) {
+  build->program = glCreateProgram();
+  for (u32 i = 0; i < desc->stage_count; i++) {
+    build->shaders[i] = glCreateShader(desc->stages[i].type);
+    glShaderSource(build->shaders[i], 1, (const char **)&sources[i], NH_NULL);
+    glCompileShader(build->shaders[i]);
+    glAttachShader(build->program, build->shaders[i]);
+  }
+  if (retrievable) glProgramParameteri(build->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  /* Fails if a stage did, program_finish works out which */
+  glLinkProgram(build->program);
+}
+
+/* Set up the cache, cache_dir may be NH_NULL - call with a context current */
+void programs_init(program_cache_t *cache, const char *cache_dir) {
+  *cache = (program_cache_t){0};
+  i32 formats = 0;
+  if (glGetProgramBinary != NH_NULL && glProgramBinary != NH_NULL && glProgramParameteri != NH_NULL) {
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  }
+  if (cache_dir != NH_NULL && formats > 0) {
+    /* Fine if it is already there, failing to write a binary is logged */
+    mkdir(cache_dir, 0755);
+    cache->cache_dir = cache_dir;
+  }
+  /* As many compiler threads as the driver likes */
+  cache->parallel = glMaxShaderCompilerThreadsKHR != NH_NULL
+    && (hasExtensionGL("GL_KHR_parallel_shader_compile") || hasExtensionGL("GL_ARB_parallel_shader_compile"));
+  if (cache->parallel) glMaxShaderCompilerThreadsKHR(0xffffffffu);
+  const u32 names[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+  cache->driver_hash = 0xcbf29ce484222325ull;
+  for (u32 i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const char *string = (const char *)glGetString(names[i]);
+    if (string != NH_NULL) cache->driver_hash = program_hash(cache->driver_hash, string, strlen(string) + 1);
+  }
+}
+/* Does the program read file? */
+bool program_uses(const program_desc_t *desc, const char *file) {
+  for (u32 i = 0; i < desc->stage_count; i++) {
+    for (u32 j = 0; j < PROGRAM_MAX_FILES && desc->stages[i].files[j] != NH_NULL; j++) {
+      if (strcmp(desc->stages[i].files[j], file) == 0) return true;
+    }
+  }
+  return false;
+}
+/* Start building, from the cache if it has the program */
+void program_begin(program_cache_t *cache, const program_desc_t *desc, program_build_t *build) {
+  const u64 start = SDL_GetPerformanceCounter();
+  *build = (program_build_t){0};
+  char *sources[PROGRAM_MAX_STAGES] = {0};
+  u64 key = cache->driver_hash;
+  bool success = desc->stage_count <= PROGRAM_MAX_STAGES;
+  for (u32 i = 0; i < desc->stage_count && success; i++) {
+    sources[i] = program_stage_source(&desc->stages[i], desc->defines);
+    success = sources[i] != NH_NULL;
+    if (success) {
+      key = program_hash(key, &desc->stages[i].type, sizeof(desc->stages[i].type));
+      key = program_hash(key, sources[i], strlen(sources[i]) + 1);
+    }
+  }
+  build->key = key;
+  if (!success) {
+    snprintf(build->error, sizeof(build->error), "%s: failed to read its files", desc->name);
+  } else {
+    if (cache->cache_dir != NH_NULL) {
+      char path[512];
+      snprintf(path, sizeof(path), "%s/%016llx.bin", cache->cache_dir, (unsigned long long)key);
+      build->program = program_load(path);
+      build->cached = build->program != 0;
+    }
+    if (!build->cached) program_compile(build, desc, sources, cache->cache_dir != NH_NULL);
+  }
+  for (u32 i = 0; i < desc->stage_count && i < PROGRAM_MAX_STAGES; i++) free(sources[i]);
+  cache->ms += (f64)(SDL_GetPerformanceCounter() - start) * 1000.0 / (f64)SDL_GetPerformanceFrequency();
+}
+/* Can program_finish go ahead without blocking? */
+bool program_ready(const program_cache_t *cache, const program_build_t *build) {
+  if (build->program == 0 || build->cached || !cache->parallel) return true;
+  i32 done = GL_TRUE;
+  glGetProgramiv(build->program, GL_COMPLETION_STATUS_KHR, &done);
+  return done != GL_FALSE;
+}
+/* The linked program, or 0 with the reason in build->error */
+u32 program_finish(program_cache_t *cache, const program_desc_t *desc, program_build_t *build) {
+  const u64 start = SDL_GetPerformanceCounter();
+  u32 program = build->program;
+  if (program != 0 && !build->cached) {
+    i32 success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+      /* The first stage that failed, or the link itself */
+      char info_log[PROGRAM_LOG_SIZE];
+      const char *file = desc->name;
+      glGetProgramInfoLog(program, PROGRAM_LOG_SIZE, NH_NULL, info_log);
+      for (u32 i = 0; i < desc->stage_count; i++) {
+        glGetShaderiv(build->shaders[i], GL_COMPILE_STATUS, &success);
+        if (success) continue;
+        /* The last file is the one the stage is named after */
+        u32 last = 0;
+        while (last + 1 < PROGRAM_MAX_FILES && desc->stages[i].files[last + 1] != NH_NULL) last++;
+        file = desc->stages[i].files[last];
+        glGetShaderInfoLog(build->shaders[i], PROGRAM_LOG_SIZE, NH_NULL, info_log);
+        break;
+      }
+      /* As much of the log as fits after the file name */
+      const size_t name_length = strlen(file);
+      const int room = name_length + 3 < sizeof(build->error) ? (int)(sizeof(build->error) - name_length - 3) : 0;
+      snprintf(build->error, sizeof(build->error), "%s: %.*s", file, room, info_log);
+      glDeleteProgram(program);
+      program = 0;
+    } else {
+      cache->compiled++;
+      if (cache->cache_dir != NH_NULL) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%016llx.bin", cache->cache_dir, (unsigned long long)build->key);
+        program_save(path, program);
+      }
+    }
+  } else if (program != 0) {
+    cache->cached++;
+  }
+  for (u32 i = 0; i < desc->stage_count && i < PROGRAM_MAX_STAGES; i++) {
+    if (build->shaders[i] != 0) glDeleteShader(build->shaders[i]);
+    build->shaders[i] = 0;
+  }
+  build->program = 0;
+  cache->ms += (f64)(SDL_GetPerformanceCounter() - start) * 1000.0 / (f64)SDL_GetPerformanceFrequency();
+  return program;
+}
+/* Create a program right away, 0 on failure */
+u32 program_create(program_cache_t *cache, const program_desc_t *desc) {
+  program_build_t build;
+  program_begin(cache, desc, &build);
+  const u32 program = program_finish(cache, desc, &build);
+  if (program == 0) NH_ERROR("Failed to create %s", build.error);
+  return program;
+}
+
+#endif /* PROGRAMS_H */
@@ -0,0 +1,601 @@
+/* Include guard */
+#if !defined(RAYQUERY_H)
+#define RAYQUERY_H
+
+/* Includes */
+#include <nh_base.h>
+#include <math.h>
+#include <stdlib.h>
+
+/* Project headers */
+#include "scene.h"
+
+/* SIMD - SSE2 is part of x86-64, AVX2 is picked at runtime */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RQ_X86 1
+#endif
+
+/*
+ * Batched ray queries against the scene for host code (picking,
+ * visibility). Rays go in as structure-of-arrays; each SIMD lane holds one
+ * ray and every primitive is broadcast across the lanes. The tests are the
+ * same as distance_sphere and distance_triangle in common.compute,
+ * including triangle backface culling.
+ *
+ * Queries see the scene the renderers do: a batch walks the top level,
+ * is moved into each instance's mesh space by its world_to_mesh and walks
+ * that mesh's range of BVH nodes. A node is entered if any ray in the
+ * batch enters it. Distances are along the world space rays, and the top
+ * level is read as it stands, so place instances before querying.
+ */
+
+/* Consts */
+#define RQ_MISS             (-1)
+#define RQ_SPHERE(i)        ((i32)(i))
+#define RQ_TRIANGLE(i)      ((i32)(rq_scene.sphere_count + (i)))
+#define RQ_REF_MASK         ((1 << SCENE_REF_BITS) - 1)
+
+/* Structs */
+/* Batch of rays, directions need not be normalized */
+typedef struct {
+  u32 count;
+  const f32 *origin_x, *origin_y, *origin_z;
+  const f32 *direction_x, *direction_y, *direction_z;
+} rq_rays_t;
+/* Nearest hits, one per ray */
+typedef struct {
+  f32 *distance;                /* INFINITY on a miss */
+  i32 *primitive;               /* RQ_SPHERE(i), RQ_TRIANGLE(i) or RQ_MISS */
+  i32 *instance;                /* Scene instance hit, RQ_MISS on a miss */
+} rq_hits_t;
+/* Scene geometry in structure-of-arrays form, in mesh space */
+typedef struct {
+  const scene_t *scene;         /* For the top level and BVH */
+  u32 sphere_count, triangle_count;
+  f32 *sphere_x, *sphere_y, *sphere_z;
+  f32 *sphere_r2;
+  f32 *v0_x, *v0_y, *v0_z;
+  f32 *e1_x, *e1_y, *e1_z;
+  f32 *e2_x, *e2_y, *e2_z;
+  f32 *n_x, *n_y, *n_z;
+} rq_scene_t;
+
+/* Globals */
+rq_scene_t rq_scene;
+
+/* Build the structure-of-arrays scene, call before querying. The scene is
+ * kept, not copied */
+bool rq_init(const scene_t *scene) {
+  const u32 ns = scene->sphere_count, nt = scene->triangle_count;
+  f32 *data = (f32 *)malloc(sizeof(f32) * (4 * ns + 12 * nt + 1));
+  if (data == NH_NULL) return false;
+  rq_scene.scene = scene;
+  rq_scene.sphere_count = ns;
+  rq_scene.triangle_count = nt;
+  f32 **arrays[] = {
+    &rq_scene.sphere_x, &rq_scene.sphere_y, &rq_scene.sphere_z, &rq_scene.sphere_r2,
+    &rq_scene.v0_x, &rq_scene.v0_y, &rq_scene.v0_z,
+    &rq_scene.e1_x, &rq_scene.e1_y, &rq_scene.e1_z,
+    &rq_scene.e2_x, &rq_scene.e2_y, &rq_scene.e2_z,
+    &rq_scene.n_x, &rq_scene.n_y, &rq_scene.n_z,
+  };
+  for (u32 i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+    *arrays[i] = data;
+    data += i < 4 ? ns : nt;
+  }
+  for (u32 i = 0; i < ns; i++) {
+    rq_scene.sphere_x[i] = scene->spheres[i].center.x;
+    rq_scene.sphere_y[i] = scene->spheres[i].center.y;
+    rq_scene.sphere_z[i] = scene->spheres[i].center.z;
+    rq_scene.sphere_r2[i] = scene->spheres[i].radius * scene->spheres[i].radius;
+  }
+  for (u32 i = 0; i < nt; i++) {
+    const triangle_t *tri = &scene->triangles[i];
+    const nh_vec3_t v0 = scene->vertices[tri->v0].position;
+    const nh_vec3_t v1 = scene->vertices[tri->v1].position;
+    const nh_vec3_t v2 = scene->vertices[tri->v2].position;
+    f32 e1x = v1.x - v0.x, e1y = v1.y - v0.y, e1z = v1.z - v0.z;
+    f32 e2x = v2.x - v0.x, e2y = v2.y - v0.y, e2z = v2.z - v0.z;
+    rq_scene.v0_x[i] = v0.x;
+    rq_scene.v0_y[i] = v0.y;
+    rq_scene.v0_z[i] = v0.z;
+    rq_scene.e1_x[i] = e1x;
+    rq_scene.e1_y[i] = e1y;
+    rq_scene.e1_z[i] = e1z;
+    rq_scene.e2_x[i] = e2x;
+    rq_scene.e2_y[i] = e2y;
+    rq_scene.e2_z[i] = e2z;
+    /* Only the sign of dot(n, d) is used, no need to normalize */
+    rq_scene.n_x[i] = e1y * e2z - e1z * e2y;
+    rq_scene.n_y[i] = e1z * e2x - e1x * e2z;
+    rq_scene.n_z[i] = e1x * e2y - e1y * e2x;
+  }
+  return true;
+}
+void rq_destroy(void) {
+  free(rq_scene.sphere_x);
+  rq_scene = (rq_scene_t){0};
+}
+
+/* Hits are tracked as slot << SCENE_REF_BITS | ref, like the shaders */
+static inline void rq_store_hit(rq_hits_t *hits, u32 r, i32 hit) {
+  hits->primitive[r] = hit == RQ_MISS ? RQ_MISS : (hit & RQ_REF_MASK);
+  hits->instance[r] = hit == RQ_MISS ? RQ_MISS : (i32)rq_scene.scene->tlas_instances[(u32)hit >> SCENE_REF_BITS];
+}
+
+/* Scalar */
+typedef struct {
+  f32 ox, oy, oz;
+  f32 dx, dy, dz;
+  f32 ix, iy, iz;               /* 1 / direction */
+} rq_ray_t;
+static inline rq_ray_t rq_ray_scalar(f32 ox, f32 oy, f32 oz, f32 dx, f32 dy, f32 dz) {
+  return (rq_ray_t){ox, oy, oz, dx, dy, dz, 1.0f / dx, 1.0f / dy, 1.0f / dz};
+}
+/* The ray in an instance's mesh space, distances along it unchanged */
+static inline rq_ray_t rq_transform_scalar(const rq_ray_t *ray, const f32 m[3][4]) {
+  return rq_ray_scalar(
+      m[0][0] * ray->ox + m[0][1] * ray->oy + m[0][2] * ray->oz + m[0][3],
+      m[1][0] * ray->ox + m[1][1] * ray->oy + m[1][2] * ray->oz + m[1][3],
+      m[2][0] * ray->ox + m[2][1] * ray->oy + m[2][2] * ray->oz + m[2][3],
+      m[0][0] * ray->dx + m[0][1] * ray->dy + m[0][2] * ray->dz,
+      m[1][0] * ray->dx + m[1][1] * ray->dy + m[1][2] * ray->dz,
+      m[2][0] * ray->dx + m[2][1] * ray->dy + m[2][2] * ray->dz);
+}
+static inline bool rq_aabb_scalar(const rq_ray_t *ray, const bvh_node_t *node, f32 best) {
+  f32 tx0 = (node->min.x - ray->ox) * ray->ix, tx1 = (node->max.x - ray->ox) * ray->ix;
+  f32 ty0 = (node->min.y - ray->oy) * ray->iy, ty1 = (node->max.y - ray->oy) * ray->iy;
+  f32 tz0 = (node->min.z - ray->oz) * ray->iz, tz1 = (node->max.z - ray->oz) * ray->iz;
+  f32 enter = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), fmaxf(fminf(tz0, tz1), 0.0f));
+  f32 exit = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), fminf(fmaxf(tz0, tz1), best));
+  return enter <= exit;
+}
+/* Distance to sphere i, INFINITY on a miss */
+static inline f32 rq_sphere_scalar(const rq_ray_t *ray, u32 i) {
+  const rq_scene_t *s = &rq_scene;
+  const f32 a = ray->dx * ray->dx + ray->dy * ray->dy + ray->dz * ray->dz;
+  f32 ocx = ray->ox - s->sphere_x[i], ocy = ray->oy - s->sphere_y[i], ocz = ray->oz - s->sphere_z[i];
+  f32 b = 2.0f * (ocx * ray->dx + ocy * ray->dy + ocz * ray->dz);
+  f32 c = ocx * ocx + ocy * ocy + ocz * ocz - s->sphere_r2[i];
+  f32 discriminant = b * b - 4.0f * a * c;
+  if (!(discriminant >= 0.0f)) return INFINITY;
+  f32 t = (-b - sqrtf(discriminant)) / (2.0f * a);
+  return t > 0.0f ? t : INFINITY;
+}
+/* Distance to triangle i, INFINITY on a miss - Moller-Trumbore */
+static inline f32 rq_triangle_scalar(const rq_ray_t *ray, u32 i) {
+  const rq_scene_t *s = &rq_scene;
+  const f32 dx = ray->dx, dy = ray->dy, dz = ray->dz;
+  if (s->n_x[i] * dx + s->n_y[i] * dy + s->n_z[i] * dz > 0.0f) return INFINITY;
+  f32 px = dy * s->e2_z[i] - dz * s->e2_y[i];
+  f32 py = dz * s->e2_x[i] - dx * s->e2_z[i];
+  f32 pz = dx * s->e2_y[i] - dy * s->e2_x[i];
+  f32 det = s->e1_x[i] * px + s->e1_y[i] * py + s->e1_z[i] * pz;
+  if (det == 0.0f) return INFINITY;
+  f32 inv_det = 1.0f / det;
+  f32 tx = ray->ox - s->v0_x[i], ty = ray->oy - s->v0_y[i], tz = ray->oz - s->v0_z[i];
+  f32 u = (tx * px + ty * py + tz * pz) * inv_det;
+  if (!(u >= 0.0f && u <= 1.0f)) return INFINITY;
+  f32 qx = ty * s->e1_z[i] - tz * s->e1_y[i];
+  f32 qy = tz * s->e1_x[i] - tx * s->e1_z[i];
+  f32 qz = tx * s->e1_y[i] - ty * s->e1_x[i];
+  f32 v = (dx * qx + dy * qy + dz * qz) * inv_det;
+  if (!(v >= 0.0f && u + v <= 1.0f)) return INFINITY;
+  f32 t = (s->e2_x[i] * qx + s->e2_y[i] * qy + s->e2_z[i] * qz) * inv_det;
+  return t >= 0.0f ? t : INFINITY;
+}
+/* Nearest primitive of the instance in slot closer than best */
+static void rq_mesh_scalar(const rq_ray_t *world, u32 slot, f32 *best, i32 *hit) {
+  const bvh_t *bvh = &rq_scene.scene->bvh;
+  const tlas_instance_t *instance = &rq_scene.scene->tlas.instances[slot];
+  const rq_ray_t ray = rq_transform_scalar(world, instance->world_to_mesh);
+  u32 node = instance->root;
+  while (node < instance->end) {
+    const bvh_node_t *bvh_node = &bvh->nodes[node];
+    if (!rq_aabb_scalar(&ray, bvh_node, *best)) {
+      node = bvh_node->miss;
+      continue;
+    }
+    u32 count = bvh_node->prims & BVH_COUNT_MASK;
+    if (count == 0) {
+      node++;
+      continue;
+    }
+    u32 first = bvh_node->prims >> BVH_COUNT_BITS;
+    for (u32 i = first; i < first + count; i++) {
+      const u32 ref = bvh->refs[i];
+      f32 t = ref < rq_scene.sphere_count
+        ? rq_sphere_scalar(&ray, ref) : rq_triangle_scalar(&ray, ref - rq_scene.sphere_count);
+      if (t < *best) {
+        *best = t;
+        *hit = (i32)(slot << SCENE_REF_BITS | ref);
+      }
+    }
+    node = bvh_node->miss;
+  }
+}
+static void rq_intersect_scalar_range(const rq_rays_t *rays, rq_hits_t *hits, u32 first, u32 last) {
+  const tlas_t *tlas = &rq_scene.scene->tlas;
+  for (u32 r = first; r < last; r++) {
+    const rq_ray_t ray = rq_ray_scalar(
+        rays->origin_x[r], rays->origin_y[r], rays->origin_z[r],
+        rays->direction_x[r], rays->direction_y[r], rays->direction_z[r]);
+    f32 best = INFINITY;
+    i32 hit = RQ_MISS;
+    u32 node = 0;
+    while (node < tlas->nodes[0].miss) {
+      const bvh_node_t *tlas_node = &tlas->nodes[node];
+      if (!rq_aabb_scalar(&ray, tlas_node, best)) {
+        node = tlas_node->miss;
+        continue;
+      }
+      u32 count = tlas_node->prims & BVH_COUNT_MASK;
+      if (count == 0) {
+        node++;
+        continue;
+      }
+      u32 slot = tlas_node->prims >> BVH_COUNT_BITS;
+      for (u32 i = 0; i < count; i++) rq_mesh_scalar(&ray, slot + i, &best, &hit);
+      node = tlas_node->miss;
+    }
+    hits->distance[r] = best;
+    rq_store_hit(hits, r, hit);
+  }
+}
+void rq_intersect_scalar(const rq_rays_t *rays, rq_hits_t *hits) {
+  rq_intersect_scalar_range(rays, hits, 0, rays->count);
+}
+
+#if defined(RQ_X86)
+/* SSE - 4 rays at a time */
+typedef struct {
+  __m128 ox, oy, oz;
+  __m128 dx, dy, dz;
+  __m128 ix, iy, iz;            /* 1 / direction */
+  __m128 a;                     /* dot(d, d), for spheres */
+} rq_ray_sse_t;
+static inline __m128 rq_blend_sse(__m128 a, __m128 b, __m128 mask) {
+  return _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b));
+}
+static inline rq_ray_sse_t rq_ray_sse(__m128 ox, __m128 oy, __m128 oz, __m128 dx, __m128 dy, __m128 dz) {
+  const __m128 one = _mm_set1_ps(1.0f);
+  return (rq_ray_sse_t){
+    ox, oy, oz, dx, dy, dz,
+    _mm_div_ps(one, dx), _mm_div_ps(one, dy), _mm_div_ps(one, dz),
+    _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)),
+  };
+}
+/* Row of a transform times (x, y, z) */
+static inline __m128 rq_row_sse(const f32 row[4], __m128 x, __m128 y, __m128 z) {
+  return _mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(row[0]), x), _mm_mul_ps(_mm_set1_ps(row[1]), y)),
+        _mm_mul_ps(_mm_set1_ps(row[2]), z));
+}
+static inline rq_ray_sse_t rq_transform_sse(const rq_ray_sse_t *ray, const f32 m[3][4]) {
+  return rq_ray_sse(
+      _mm_add_ps(rq_row_sse(m[0], ray->ox, ray->oy, ray->oz), _mm_set1_ps(m[0][3])),
+      _mm_add_ps(rq_row_sse(m[1], ray->ox, ray->oy, ray->oz), _mm_set1_ps(m[1][3])),
+      _mm_add_ps(rq_row_sse(m[2], ray->ox, ray->oy, ray->oz), _mm_set1_ps(m[2][3])),
+      rq_row_sse(m[0], ray->dx, ray->dy, ray->dz),
+      rq_row_sse(m[1], ray->dx, ray->dy, ray->dz),
+      rq_row_sse(m[2], ray->dx, ray->dy, ray->dz));
+}
+/* Does any ray enter the node before best? */
+static inline bool rq_aabb_sse(const rq_ray_sse_t *ray, const bvh_node_t *node, __m128 best) {
+  __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min.x), ray->ox), ray->ix);
+  __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max.x), ray->ox), ray->ix);
+  __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min.y), ray->oy), ray->iy);
+  __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max.y), ray->oy), ray->iy);
+  __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min.z), ray->oz), ray->iz);
+  __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max.z), ray->oz), ray->iz);
+  __m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+      _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+  __m128 exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+      _mm_min_ps(_mm_max_ps(tz0, tz1), best));
+  return _mm_movemask_ps(_mm_cmple_ps(enter, exit)) != 0;
+}
+/* Sphere i, moves best up in the lanes it is nearer in and returns them */
+static inline __m128 rq_sphere_sse(const rq_ray_sse_t *ray, u32 i, __m128 *best) {
+  const rq_scene_t *s = &rq_scene;
+  const __m128 zero = _mm_setzero_ps(), two = _mm_set1_ps(2.0f), four = _mm_set1_ps(4.0f);
+  __m128 ocx = _mm_sub_ps(ray->ox, _mm_set1_ps(s->sphere_x[i]));
+  __m128 ocy = _mm_sub_ps(ray->oy, _mm_set1_ps(s->sphere_y[i]));
+  __m128 ocz = _mm_sub_ps(ray->oz, _mm_set1_ps(s->sphere_z[i]));
+  __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ray->dx), _mm_mul_ps(ocy, ray->dy)), _mm_mul_ps(ocz, ray->dz)));
+  __m128 c = _mm_sub_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+      _mm_set1_ps(s->sphere_r2[i]));
+  __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(four, _mm_mul_ps(ray->a, c)));
+  __m128 mask = _mm_cmpge_ps(discriminant, zero);
+  if (_mm_movemask_ps(mask) == 0) return mask;
+  __m128 t = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(zero, b), _mm_sqrt_ps(_mm_max_ps(discriminant, zero))),
+      _mm_mul_ps(two, ray->a));
+  mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, *best)));
+  *best = rq_blend_sse(*best, t, mask);
+  return mask;
+}
+/* Triangle i, as rq_sphere_sse - Moller-Trumbore */
+static inline __m128 rq_triangle_sse(const rq_ray_sse_t *ray, u32 i, __m128 *best) {
+  const rq_scene_t *s = &rq_scene;
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  const __m128 dx = ray->dx, dy = ray->dy, dz = ray->dz;
+  const __m128 e1x = _mm_set1_ps(s->e1_x[i]), e1y = _mm_set1_ps(s->e1_y[i]), e1z = _mm_set1_ps(s->e1_z[i]);
+  const __m128 e2x = _mm_set1_ps(s->e2_x[i]), e2y = _mm_set1_ps(s->e2_y[i]), e2z = _mm_set1_ps(s->e2_z[i]);
+  __m128 facing = _mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(s->n_x[i]), dx), _mm_mul_ps(_mm_set1_ps(s->n_y[i]), dy)),
+        _mm_mul_ps(_mm_set1_ps(s->n_z[i]), dz));
+  __m128 mask = _mm_cmple_ps(facing, zero);
+  if (_mm_movemask_ps(mask) == 0) return mask;
+  __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  mask = _mm_and_ps(mask, _mm_cmpneq_ps(det, zero));
+  __m128 inv_det = _mm_div_ps(one, det);
+  __m128 tx = _mm_sub_ps(ray->ox, _mm_set1_ps(s->v0_x[i]));
+  __m128 ty = _mm_sub_ps(ray->oy, _mm_set1_ps(s->v0_y[i]));
+  __m128 tz = _mm_sub_ps(ray->oz, _mm_set1_ps(s->v0_z[i]));
+  __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+  mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+  if (_mm_movemask_ps(mask) == 0) return mask;
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+  __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+  mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+  __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+  mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, *best)));
+  *best = rq_blend_sse(*best, t, mask);
+  return mask;
+}
+static void rq_mesh_sse(const rq_ray_sse_t *world, u32 slot, __m128 *best, __m128 *hit) {
+  const bvh_t *bvh = &rq_scene.scene->bvh;
+  const tlas_instance_t *instance = &rq_scene.scene->tlas.instances[slot];
+  const rq_ray_sse_t ray = rq_transform_sse(world, instance->world_to_mesh);
+  u32 node = instance->root;
+  while (node < instance->end) {
+    const bvh_node_t *bvh_node = &bvh->nodes[node];
+    if (!rq_aabb_sse(&ray, bvh_node, *best)) {
+      node = bvh_node->miss;
+      continue;
+    }
+    u32 count = bvh_node->prims & BVH_COUNT_MASK;
+    if (count == 0) {
+      node++;
+      continue;
+    }
+    u32 first = bvh_node->prims >> BVH_COUNT_BITS;
+    for (u32 i = first; i < first + count; i++) {
+      const u32 ref = bvh->refs[i];
+      __m128 mask = ref < rq_scene.sphere_count
+        ? rq_sphere_sse(&ray, ref, best) : rq_triangle_sse(&ray, ref - rq_scene.sphere_count, best);
+      *hit = rq_blend_sse(*hit, _mm_castsi128_ps(_mm_set1_epi32((i32)(slot << SCENE_REF_BITS | ref))), mask);
+    }
+    node = bvh_node->miss;
+  }
+}
+void rq_intersect_sse(const rq_rays_t *rays, rq_hits_t *hits) {
+  const tlas_t *tlas = &rq_scene.scene->tlas;
+  const u32 count = rays->count & ~3u;
+  for (u32 r = 0; r < count; r += 4) {
+    const rq_ray_sse_t ray = rq_ray_sse(
+        _mm_loadu_ps(rays->origin_x + r), _mm_loadu_ps(rays->origin_y + r), _mm_loadu_ps(rays->origin_z + r),
+        _mm_loadu_ps(rays->direction_x + r), _mm_loadu_ps(rays->direction_y + r), _mm_loadu_ps(rays->direction_z + r));
+    __m128 best = _mm_set1_ps(INFINITY);
+    __m128 hit = _mm_castsi128_ps(_mm_set1_epi32(RQ_MISS));
+    u32 node = 0;
+    while (node < tlas->nodes[0].miss) {
+      const bvh_node_t *tlas_node = &tlas->nodes[node];
+      if (!rq_aabb_sse(&ray, tlas_node, best)) {
+        node = tlas_node->miss;
+        continue;
+      }
+      u32 leaf_count = tlas_node->prims & BVH_COUNT_MASK;
+      if (leaf_count == 0) {
+        node++;
+        continue;
+      }
+      u32 slot = tlas_node->prims >> BVH_COUNT_BITS;
+      for (u32 i = 0; i < leaf_count; i++) rq_mesh_sse(&ray, slot + i, &best, &hit);
+      node = tlas_node->miss;
+    }
+    i32 lanes[4];
+    _mm_storeu_ps(hits->distance + r, best);
+    _mm_storeu_si128((__m128i *)lanes, _mm_castps_si128(hit));
+    for (u32 i = 0; i < 4; i++) rq_store_hit(hits, r + i, lanes[i]);
+  }
+  rq_intersect_scalar_range(rays, hits, count, rays->count);
+}
+
+/* AVX2 - 8 rays at a time */
+typedef struct {
+  __m256 ox, oy, oz;
+  __m256 dx, dy, dz;
+  __m256 ix, iy, iz;            /* 1 / direction */
+  __m256 a;                     /* dot(d, d), for spheres */
+} rq_ray_avx2_t;
+__attribute__((target("avx2,fma")))
+static inline rq_ray_avx2_t rq_ray_avx2(__m256 ox, __m256 oy, __m256 oz, __m256 dx, __m256 dy, __m256 dz) {
+  const __m256 one = _mm256_set1_ps(1.0f);
+  return (rq_ray_avx2_t){
+    ox, oy, oz, dx, dy, dz,
+    _mm256_div_ps(one, dx), _mm256_div_ps(one, dy), _mm256_div_ps(one, dz),
+    _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx))),
+  };
+}
+__attribute__((target("avx2,fma")))
+static inline __m256 rq_row_avx2(const f32 row[4], __m256 x, __m256 y, __m256 z) {
+  return _mm256_fmadd_ps(_mm256_set1_ps(row[2]), z,
+      _mm256_fmadd_ps(_mm256_set1_ps(row[1]), y, _mm256_mul_ps(_mm256_set1_ps(row[0]), x)));
+}
+__attribute__((target("avx2,fma")))
+static inline rq_ray_avx2_t rq_transform_avx2(const rq_ray_avx2_t *ray, const f32 m[3][4]) {
+  return rq_ray_avx2(
+      _mm256_add_ps(rq_row_avx2(m[0], ray->ox, ray->oy, ray->oz), _mm256_set1_ps(m[0][3])),
+      _mm256_add_ps(rq_row_avx2(m[1], ray->ox, ray->oy, ray->oz), _mm256_set1_ps(m[1][3])),
+      _mm256_add_ps(rq_row_avx2(m[2], ray->ox, ray->oy, ray->oz), _mm256_set1_ps(m[2][3])),
+      rq_row_avx2(m[0], ray->dx, ray->dy, ray->dz),
+      rq_row_avx2(m[1], ray->dx, ray->dy, ray->dz),
+      rq_row_avx2(m[2], ray->dx, ray->dy, ray->dz));
+}
+__attribute__((target("avx2,fma")))
+static inline bool rq_aabb_avx2(const rq_ray_avx2_t *ray, const bvh_node_t *node, __m256 best) {
+  __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->min.x), ray->ox), ray->ix);
+  __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->max.x), ray->ox), ray->ix);
+  __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->min.y), ray->oy), ray->iy);
+  __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->max.y), ray->oy), ray->iy);
+  __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->min.z), ray->oz), ray->iz);
+  __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->max.z), ray->oz), ray->iz);
+  __m256 enter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+      _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+  __m256 exit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+      _mm256_min_ps(_mm256_max_ps(tz0, tz1), best));
+  return _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ)) != 0;
+}
+__attribute__((target("avx2,fma")))
+static inline __m256 rq_sphere_avx2(const rq_ray_avx2_t *ray, u32 i, __m256 *best) {
+  const rq_scene_t *s = &rq_scene;
+  const __m256 zero = _mm256_setzero_ps(), two = _mm256_set1_ps(2.0f), four = _mm256_set1_ps(4.0f);
+  __m256 ocx = _mm256_sub_ps(ray->ox, _mm256_set1_ps(s->sphere_x[i]));
+  __m256 ocy = _mm256_sub_ps(ray->oy, _mm256_set1_ps(s->sphere_y[i]));
+  __m256 ocz = _mm256_sub_ps(ray->oz, _mm256_set1_ps(s->sphere_z[i]));
+  __m256 b = _mm256_mul_ps(two, _mm256_fmadd_ps(ocz, ray->dz, _mm256_fmadd_ps(ocy, ray->dy, _mm256_mul_ps(ocx, ray->dx))));
+  __m256 c = _mm256_sub_ps(
+      _mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx))),
+      _mm256_set1_ps(s->sphere_r2[i]));
+  __m256 discriminant = _mm256_fmsub_ps(b, b, _mm256_mul_ps(four, _mm256_mul_ps(ray->a, c)));
+  __m256 mask = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+  if (_mm256_movemask_ps(mask) == 0) return mask;
+  __m256 t = _mm256_div_ps(
+      _mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero))),
+      _mm256_mul_ps(two, ray->a));
+  mask = _mm256_and_ps(mask, _mm256_and_ps(
+        _mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, *best, _CMP_LT_OQ)));
+  *best = _mm256_blendv_ps(*best, t, mask);
+  return mask;
+}
+__attribute__((target("avx2,fma")))
+static inline __m256 rq_triangle_avx2(const rq_ray_avx2_t *ray, u32 i, __m256 *best) {
+  const rq_scene_t *s = &rq_scene;
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 dx = ray->dx, dy = ray->dy, dz = ray->dz;
+  const __m256 e1x = _mm256_set1_ps(s->e1_x[i]), e1y = _mm256_set1_ps(s->e1_y[i]), e1z = _mm256_set1_ps(s->e1_z[i]);
+  const __m256 e2x = _mm256_set1_ps(s->e2_x[i]), e2y = _mm256_set1_ps(s->e2_y[i]), e2z = _mm256_set1_ps(s->e2_z[i]);
+  __m256 facing = _mm256_fmadd_ps(_mm256_set1_ps(s->n_z[i]), dz,
+      _mm256_fmadd_ps(_mm256_set1_ps(s->n_y[i]), dy, _mm256_mul_ps(_mm256_set1_ps(s->n_x[i]), dx)));
+  __m256 mask = _mm256_cmp_ps(facing, zero, _CMP_LE_OQ);
+  if (_mm256_movemask_ps(mask) == 0) return mask;
+  __m256 px = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+  __m256 py = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+  __m256 pz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+  __m256 det = _mm256_fmadd_ps(e1z, pz, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1x, px)));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+  __m256 inv_det = _mm256_div_ps(one, det);
+  __m256 tx = _mm256_sub_ps(ray->ox, _mm256_set1_ps(s->v0_x[i]));
+  __m256 ty = _mm256_sub_ps(ray->oy, _mm256_set1_ps(s->v0_y[i]));
+  __m256 tz = _mm256_sub_ps(ray->oz, _mm256_set1_ps(s->v0_z[i]));
+  __m256 u = _mm256_mul_ps(_mm256_fmadd_ps(tz, pz, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tx, px))), inv_det);
+  mask = _mm256_and_ps(mask, _mm256_and_ps(
+        _mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+  if (_mm256_movemask_ps(mask) == 0) return mask;
+  __m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+  __m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+  __m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+  __m256 v = _mm256_mul_ps(_mm256_fmadd_ps(dz, qz, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dx, qx))), inv_det);
+  mask = _mm256_and_ps(mask, _mm256_and_ps(
+        _mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+  __m256 t = _mm256_mul_ps(_mm256_fmadd_ps(e2z, qz, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2x, qx))), inv_det);
+  mask = _mm256_and_ps(mask, _mm256_and_ps(
+        _mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, *best, _CMP_LT_OQ)));
+  *best = _mm256_blendv_ps(*best, t, mask);
+  return mask;
+}
+__attribute__((target("avx2,fma")))
+static void rq_mesh_avx2(const rq_ray_avx2_t *world, u32 slot, __m256 *best, __m256i *hit) {
+  const bvh_t *bvh = &rq_scene.scene->bvh;
+  const tlas_instance_t *instance = &rq_scene.scene->tlas.instances[slot];
+  const rq_ray_avx2_t ray = rq_transform_avx2(world, instance->world_to_mesh);
+  u32 node = instance->root;
+  while (node < instance->end) {
+    const bvh_node_t *bvh_node = &bvh->nodes[node];
+    if (!rq_aabb_avx2(&ray, bvh_node, *best)) {
+      node = bvh_node->miss;
+      continue;
+    }
+    u32 count = bvh_node->prims & BVH_COUNT_MASK;
+    if (count == 0) {
+      node++;
+      continue;
+    }
+    u32 first = bvh_node->prims >> BVH_COUNT_BITS;
+    for (u32 i = first; i < first + count; i++) {
+      const u32 ref = bvh->refs[i];
+      __m256 mask = ref < rq_scene.sphere_count
+        ? rq_sphere_avx2(&ray, ref, best) : rq_triangle_avx2(&ray, ref - rq_scene.sphere_count, best);
+      *hit = _mm256_blendv_epi8(*hit, _mm256_set1_epi32((i32)(slot << SCENE_REF_BITS | ref)), _mm256_castps_si256(mask));
+    }
+    node = bvh_node->miss;
+  }
+}
+__attribute__((target("avx2,fma")))
+void rq_intersect_avx2(const rq_rays_t *rays, rq_hits_t *hits) {
+  const tlas_t *tlas = &rq_scene.scene->tlas;
+  const u32 count = rays->count & ~7u;
+  for (u32 r = 0; r < count; r += 8) {
+    const rq_ray_avx2_t ray = rq_ray_avx2(
+        _mm256_loadu_ps(rays->origin_x + r), _mm256_loadu_ps(rays->origin_y + r), _mm256_loadu_ps(rays->origin_z + r),
+        _mm256_loadu_ps(rays->direction_x + r), _mm256_loadu_ps(rays->direction_y + r), _mm256_loadu_ps(rays->direction_z + r));
+    __m256 best = _mm256_set1_ps(INFINITY);
+    __m256i hit = _mm256_set1_epi32(RQ_MISS);
+    u32 node = 0;
+    while (node < tlas->nodes[0].miss) {
+      const bvh_node_t *tlas_node = &tlas->nodes[node];
+      if (!rq_aabb_avx2(&ray, tlas_node, best)) {
+        node = tlas_node->miss;
+        continue;
+      }
+      u32 leaf_count = tlas_node->prims & BVH_COUNT_MASK;
+      if (leaf_count == 0) {
+        node++;
+        continue;
+      }
+      u32 slot = tlas_node->prims >> BVH_COUNT_BITS;
+      for (u32 i = 0; i < leaf_count; i++) rq_mesh_avx2(&ray, slot + i, &best, &hit);
+      node = tlas_node->miss;
+    }
+    i32 lanes[8];
+    _mm256_storeu_ps(hits->distance + r, best);
+    _mm256_storeu_si256((__m256i *)lanes, hit);
+    for (u32 i = 0; i < 8; i++) rq_store_hit(hits, r + i, lanes[i]);
+  }
+  rq_intersect_scalar_range(rays, hits, count, rays->count);
+}
+#endif /* RQ_X86 */
+
+/* Nearest hit for every ray, using the widest SIMD the CPU supports */
+void rq_intersect(const rq_rays_t *rays, rq_hits_t *hits) {
+#if defined(RQ_X86)
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    rq_intersect_avx2(rays, hits);
+  } else {
+    rq_intersect_sse(rays, hits);
+  }
+#else
+  rq_intersect_scalar(rays, hits);
+#endif
+}
+/* Single ray convenience wrapper, the instance hit goes in instance */
+i32 rq_intersect_one(nh_vec3_t origin, nh_vec3_t direction, f32 *distance, i32 *instance) {
+  rq_rays_t rays = {
+    1,
+    &origin.x, &origin.y, &origin.z,
+    &direction.x, &direction.y, &direction.z,
+  };
+  i32 primitive;
+  rq_hits_t hits = {distance, &primitive, instance};
+  rq_intersect_scalar(&rays, &hits);
+  return primitive;
+}
+
+#endif /* RAYQUERY_H */
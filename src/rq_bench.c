@@ -0,0 +1,105 @@
+/* Ray query microbenchmark - scalar vs SIMD */
+#define _POSIX_C_SOURCE 200809L
+
+/* Neushoorn includes */
+#include <nh_base.h>
+
+/* stdlib includes */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Project headers */
+#include "rayquery.h"
+
+/* Consts */
+#define NUM_QUERIES         (1 << 20)
+#define REPEATS             8
+
+/* Utils */
+f64 now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec * 1000.0 + (f64)ts.tv_nsec / 1000000.0;
+}
+f32 random_float(f32 min, f32 max) {
+  return min + (max - min) * ((f32)rand() / (f32)RAND_MAX);
+}
+/* Time one implementation, returns millions of rays per second */
+f64 time_queries(void (*intersect)(const rq_rays_t *, rq_hits_t *), const rq_rays_t *rays, rq_hits_t *hits) {
+  f64 best = INFINITY;
+  for (u32 i = 0; i < REPEATS; i++) {
+    f64 start = now_ms();
+    intersect(rays, hits);
+    f64 ms = now_ms() - start;
+    if (ms < best) best = ms;
+  }
+  return (f64)rays->count / (best * 1000.0);
+}
+/* Count rays whose nearest primitive or instance differs from the reference */
+u32 count_mismatches(const rq_hits_t *a, const rq_hits_t *b, u32 count) {
+  u32 mismatches = 0;
+  for (u32 i = 0; i < count; i++) {
+    if (a->primitive[i] != b->primitive[i] || a->instance[i] != b->instance[i]) mismatches++;
+  }
+  return mismatches;
+}
+
+/* Entry point */
+int main(void) {
+  scene_t scene;
+  /* A second into their spin, so instances turn as well as move */
+  if (!scene_builtin(&scene) || !scene_place_instances(&scene, 1.0f) || !rq_init(&scene)) {
+    fprintf(stderr, "Failed to build scene\n");
+    return 1;
+  }
+  /* Random rays from inside the Cornell box, like secondary bounces */
+  f32 *data = (f32 *)malloc(sizeof(f32) * NUM_QUERIES * 6);
+  rq_rays_t rays = {
+    NUM_QUERIES,
+    data + 0 * NUM_QUERIES, data + 1 * NUM_QUERIES, data + 2 * NUM_QUERIES,
+    data + 3 * NUM_QUERIES, data + 4 * NUM_QUERIES, data + 5 * NUM_QUERIES,
+  };
+  srand(1234);
+  for (u32 i = 0; i < NUM_QUERIES; i++) {
+    data[0 * NUM_QUERIES + i] = random_float(-4.9f, 4.9f);
+    data[1 * NUM_QUERIES + i] = random_float(-0.9f, 3.4f);
+    data[2 * NUM_QUERIES + i] = random_float(3.1f, 6.9f);
+    data[3 * NUM_QUERIES + i] = random_float(-1.0f, 1.0f);
+    data[4 * NUM_QUERIES + i] = random_float(-1.0f, 1.0f);
+    data[5 * NUM_QUERIES + i] = random_float(-1.0f, 1.0f);
+  }
+  f32 *distances = (f32 *)malloc(sizeof(f32) * NUM_QUERIES * 2);
+  i32 *primitives = (i32 *)malloc(sizeof(i32) * NUM_QUERIES * 4);
+  i32 *instances = primitives + NUM_QUERIES * 2;
+  rq_hits_t reference = {distances, primitives, instances};
+  rq_hits_t hits = {distances + NUM_QUERIES, primitives + NUM_QUERIES, instances + NUM_QUERIES};
+
+  /* Scalar reference */
+  printf("%u rays, %u spheres, %u triangles, %u instances\n",
+      NUM_QUERIES, scene.sphere_count, scene.triangle_count, scene.instance_count);
+  f64 scalar = time_queries(rq_intersect_scalar, &rays, &reference);
+  printf("scalar: %8.2f Mrays/s\n", scalar);
+#if defined(RQ_X86)
+  /* SSE */
+  f64 sse = time_queries(rq_intersect_sse, &rays, &hits);
+  printf("sse:    %8.2f Mrays/s (%.2fx, %u mismatches)\n",
+      sse, sse / scalar, count_mismatches(&reference, &hits, NUM_QUERIES));
+  /* AVX2 */
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    f64 avx2 = time_queries(rq_intersect_avx2, &rays, &hits);
+    printf("avx2:   %8.2f Mrays/s (%.2fx, %u mismatches)\n",
+        avx2, avx2 / scalar, count_mismatches(&reference, &hits, NUM_QUERIES));
+  } else {
+    printf("avx2:   not supported\n");
+  }
+#endif
+
+  free(primitives);
+  free(distances);
+  free(data);
+  rq_destroy();
+  scene_destroy(&scene);
+  return 0;
+}
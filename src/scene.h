@@ -0,0 +1,572 @@
+/* Include guard */
+#if !defined(SCENE_H)
+#define SCENE_H
+
+/* Includes */
+#include <nh_base.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* POSIX includes */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Project headers */
+#include "bvh.h"
+
+/*
+ * Scene file (.scn) - a header followed by sections that are laid out
+ * exactly as the storage buffers in common.compute, so loading is an mmap
+ * and one glBufferData per section:
+ *
+ *   header     magic, version, then offset + count of every section
+ *   materials  material_t[]
+ *   spheres    sphere_t[]
+ *   vertices   vertex_t[]
+ *   triangles  triangle_t[]   vertex indices + material index
+ *   bvh nodes  bvh_node_t[]   one hierarchy per mesh, back to back
+ *   bvh refs   u32[]          indices into spheres, then triangles
+ *   meshes     mesh_t[]       primitive range + the nodes of its hierarchy
+ *   instances  instance_t[]   a mesh placed in the world
+ *
+ * Every section starts on a SCENE_ALIGNMENT boundary. Files are written by
+ * objconv (or scene_write), but every index in one is range checked at
+ * load: the host reads vertices and materials through them, so a corrupt
+ * file has to fail there rather than read out of bounds later.
+ *
+ * Geometry is instanced in two levels. A mesh is a range of the primitive
+ * list with its own BVH, built once; an instance places a mesh with an
+ * affine transform, so copies share primitives and nodes. The top level is
+ * a BVH over instance bounds, rebuilt by scene_place_instances whenever
+ * instances move - that costs the number of instances, not triangles.
+ * Rays are moved into mesh space rather than geometry into the world.
+ * Instances with a spin turn about their own y axis when animated. Light
+ * sampling (src/lights.h) keeps its own copy of emissive triangles as the
+ * instances place them.
+ */
+
+/* Structs - std430, mirror those in common.compute */
+typedef struct {
+  nh_vec3_t albedo;
+  f32 roughness;
+  nh_vec3_t emission_color;
+  f32 emission_strength;        /* Scaled by the test input */
+  nh_vec3_t specular_color;
+  f32 specular_probability;
+  f32 opacity;
+  f32 ior;
+  f32 padding[2];
+} material_t;
+typedef struct {
+  nh_vec3_t center;
+  f32 radius;
+  u32 material;
+  u32 padding[3];
+} sphere_t;
+typedef struct {
+  nh_vec3_t position;
+  f32 padding;
+} vertex_t;
+typedef struct {
+  u32 v0, v1, v2;               /* Vertex indices */
+  u32 material;
+} triangle_t;
+typedef struct {
+  u32 first, count;             /* Primitives, spheres then triangles */
+  u32 root, end;                /* Its BVH: root node, node after the last */
+} mesh_t;
+typedef struct {
+  f32 transform[3][4];          /* Mesh to world, rows of an affine matrix */
+  u32 mesh;
+  f32 spin;                     /* Radians per second about its y axis */
+  u32 padding[2];
+} instance_t;
+_Static_assert(sizeof(material_t) == 64, "material_t must match std430");
+_Static_assert(sizeof(sphere_t) == 32, "sphere_t must match std430");
+_Static_assert(sizeof(vertex_t) == 16, "vertex_t must match std430");
+_Static_assert(sizeof(triangle_t) == 16, "triangle_t must match std430");
+_Static_assert(sizeof(mesh_t) == 16, "mesh_t must be packed");
+_Static_assert(sizeof(instance_t) == 64, "instance_t must be packed");
+
+/* Consts */
+#define SCENE_MAGIC         0x314E4353u /* "SCN1" */
+#define SCENE_VERSION       2
+#define SCENE_ALIGNMENT     256 /* Covers any SSBO offset alignment */
+#define SCENE_MATERIALS     0
+#define SCENE_SPHERES       1
+#define SCENE_VERTICES      2
+#define SCENE_TRIANGLES     3
+#define SCENE_BVH_NODES     4
+#define SCENE_BVH_REFS      5
+#define SCENE_MESHES        6
+#define SCENE_INSTANCES     7
+#define SCENE_SECTIONS      8
+#define SCENE_MAX_INSTANCES 128 /* Top level fits a 16KB uniform block */
+#define SCENE_REF_BITS      24  /* Hits are instance << SCENE_REF_BITS | ref */
+#define SCENE_IDENTITY      {{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}}
+
+/* File layout */
+typedef struct {
+  u64 offset;                   /* From the start of the file */
+  u64 count;                    /* Elements, not bytes */
+} scene_section_t;
+typedef struct {
+  u32 magic;
+  u32 version;
+  scene_section_t sections[SCENE_SECTIONS];
+} scene_header_t;
+const size_t scene_element_sizes[SCENE_SECTIONS] = {
+  sizeof(material_t), sizeof(sphere_t), sizeof(vertex_t),
+  sizeof(triangle_t), sizeof(bvh_node_t), sizeof(u32),
+  sizeof(mesh_t), sizeof(instance_t),
+};
+
+/* Top level, std140 - mirrors the Tlas uniform block in common.compute */
+typedef struct {
+  f32 world_to_mesh[3][4];      /* Rows of the inverse transform */
+  u32 root, end;                /* The mesh's BVH nodes */
+  u32 padding[2];
+} tlas_instance_t;
+typedef struct {
+  bvh_node_t nodes[2 * SCENE_MAX_INSTANCES];      /* nodes[0].miss is the count */
+  tlas_instance_t instances[SCENE_MAX_INSTANCES]; /* In leaf order, leaves index these */
+} tlas_t;
+_Static_assert(sizeof(tlas_t) == 16384, "tlas_t must match std140");
+
+/* Scene - either built in or backed by a mapped file */
+typedef struct {
+  const material_t *materials;
+  u32 material_count;
+  const sphere_t *spheres;
+  u32 sphere_count;
+  const vertex_t *vertices;
+  u32 vertex_count;
+  const triangle_t *triangles;
+  u32 triangle_count;
+  bvh_t bvh;                    /* Every mesh's, back to back */
+  mesh_t *meshes;
+  u32 mesh_count;
+  const instance_t *instances;
+  u32 instance_count;
+  tlas_t tlas;                  /* Over instances, see scene_place_instances */
+  u32 tlas_instances[SCENE_MAX_INSTANCES]; /* Scene instance in each slot */
+  void *mapping;                /* File mapping, NH_NULL if built in */
+  size_t mapping_size;
+} scene_t;
+
+/* Built-in scene */
+#define MATERIAL_WALL(r, g, b) \
+  {{r, g, b}, 0.8f, {0.0f, 0.0f, 0.0f}, 0.0f, {0.0f, 0.0f, 0.0f}, 0.0f, 1.0f, 0.0f, {0.0f, 0.0f}}
+#define MATERIAL_BALL(r, g, b) \
+  {{r, g, b}, 0.75f, {0.0f, 0.0f, 0.0f}, 0.0f, {1.0f, 1.0f, 1.0f}, 0.3f, 1.0f, 0.0f, {0.0f, 0.0f}}
+#define MATERIAL_LIGHT \
+  {{0.0f, 0.0f, 0.0f}, 0.0f, {1.0f, 1.0f, 1.0f}, 1.0f, {0.0f, 0.0f, 0.0f}, 0.0f, 1.0f, 0.0f, {0.0f, 0.0f}}
+#define MATERIAL_GLASS(r, g, b) \
+  {{r, g, b}, 0.0f, {0.0f, 0.0f, 0.0f}, 0.0f, {1.0f, 1.0f, 1.0f}, 0.5f, 0.1f, 1.05f, {0.0f, 0.0f}}
+const material_t builtin_materials[] = {
+  MATERIAL_WALL(1.0f, 1.0f, 1.0f),
+  MATERIAL_WALL(1.0f, 0.0f, 0.0f),
+  MATERIAL_WALL(0.0f, 1.0f, 0.0f),
+  MATERIAL_LIGHT,
+  MATERIAL_BALL(1.0f, 0.0f, 1.0f),
+  MATERIAL_BALL(1.0f, 1.0f, 0.0f),
+  MATERIAL_GLASS(0.3f, 1.0f, 1.0f),
+  MATERIAL_BALL(1.0f, 0.0f, 0.0f),
+};
+const sphere_t builtin_spheres[] = {
+  /* Outer */
+  {{-3.0f, 0.0f, 5.0f}, 1.0f, 4, {0, 0, 0}},
+  {{ 3.0f, 0.0f, 5.0f}, 1.0f, 7, {0, 0, 0}},
+  /* Inner, about their instance's origin */
+  {{-1.0f, 0.0f, 0.0f}, 1.0f, 5, {0, 0, 0}},
+  {{ 1.0f, 0.0f, 0.0f}, 1.0f, 6, {0, 0, 0}},
+};
+const vertex_t builtin_vertices[] = {
+  /* Cornell box */
+  {{-5.0f, -1.0f, 3.0f}, 0.0f}, {{5.0f, -1.0f, 3.0f}, 0.0f},
+  {{-5.0f,  3.5f, 3.0f}, 0.0f}, {{5.0f,  3.5f, 3.0f}, 0.0f},
+  {{-5.0f, -1.0f, 7.0f}, 0.0f}, {{5.0f, -1.0f, 7.0f}, 0.0f},
+  {{-5.0f,  3.5f, 7.0f}, 0.0f}, {{5.0f,  3.5f, 7.0f}, 0.0f},
+  /* Light */
+  {{-1.0f, 3.0f, 4.0f}, 0.0f}, {{1.0f, 3.0f, 4.0f}, 0.0f},
+  {{ 1.0f, 3.0f, 6.0f}, 0.0f}, {{-1.0f, 3.0f, 6.0f}, 0.0f},
+};
+const triangle_t builtin_triangles[] = {
+  /* Bottom */
+  {0, 5, 1, 0}, {0, 4, 5, 0},
+  /* Top */
+  {2, 3, 7, 0}, {2, 7, 6, 0},
+  /* Left */
+  {0, 2, 4, 1}, {2, 6, 4, 1},
+  /* Right */
+  {1, 5, 3, 2}, {3, 5, 7, 2},
+  /* Back */
+  {4, 7, 5, 0}, {4, 6, 7, 0},
+  /* Front */
+  {0, 1, 3, 0}, {0, 3, 2, 0},
+  /* Light */
+  {8, 9, 10, 3}, {8, 10, 11, 3},
+};
+/* BVH nodes are filled in by scene_build_bvh */
+mesh_t builtin_meshes[] = {
+  {0, 2, 0, 0},                 /* Outer spheres */
+  {2, 2, 0, 0},                 /* Inner spheres */
+  {4, 14, 0, 0},                /* Cornell box */
+};
+const instance_t builtin_instances[] = {
+  {SCENE_IDENTITY, 0, 0.0f, {0, 0}},
+  {{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 5.0f}}, 1, 0.5f, {0, 0}},
+  {SCENE_IDENTITY, 2, 0.0f, {0, 0}},
+};
+
+/* Globals */
+const char *scene_error = "";   /* Reason the last load or write failed */
+
+/* Bounds of a primitive, spheres then triangles */
+static bvh_aabb_t scene_primitive_bounds(const scene_t *scene, u32 i) {
+  if (i < scene->sphere_count) {
+    const nh_vec3_t c = scene->spheres[i].center;
+    const f32 r = scene->spheres[i].radius;
+    return (bvh_aabb_t){{c.x - r, c.y - r, c.z - r}, {c.x + r, c.y + r, c.z + r}};
+  }
+  const triangle_t *triangle = &scene->triangles[i - scene->sphere_count];
+  bvh_aabb_t b = bvh_aabb_empty();
+  bvh_aabb_grow(&b, scene->vertices[triangle->v0].position);
+  bvh_aabb_grow(&b, scene->vertices[triangle->v1].position);
+  bvh_aabb_grow(&b, scene->vertices[triangle->v2].position);
+  return b;
+}
+/* Build every mesh's BVH, back to back in one node and ref list */
+bool scene_build_bvh(scene_t *scene) {
+  const u32 count = scene->sphere_count + scene->triangle_count;
+  u32 ref_count = 0;
+  for (u32 i = 0; i < scene->mesh_count; i++) {
+    const mesh_t *mesh = &scene->meshes[i];
+    if (mesh->first > count || mesh->count > count - mesh->first) {
+      scene_error = "bad mesh";
+      return false;
+    }
+    ref_count += mesh->count;
+  }
+  bvh_t *bvh = &scene->bvh;
+  bvh_aabb_t *bounds = (bvh_aabb_t *)malloc(sizeof(bvh_aabb_t) * (count + 1));
+  bvh->nodes = (bvh_node_t *)malloc(sizeof(bvh_node_t) * (2 * ref_count + scene->mesh_count + 1));
+  bvh->refs = (u32 *)malloc(sizeof(u32) * (ref_count + 1));
+  bvh->node_count = 0;
+  bvh->ref_count = 0;
+  bool success = bounds != NH_NULL && bvh->nodes != NH_NULL && bvh->refs != NH_NULL;
+  for (u32 i = 0; success && i < count; i++) {
+    bounds[i] = scene_primitive_bounds(scene, i);
+  }
+  for (u32 i = 0; success && i < scene->mesh_count; i++) {
+    mesh_t *mesh = &scene->meshes[i];
+    bvh_t part;
+    success = bvh_build(&part, bounds + mesh->first, mesh->count);
+    if (!success) break;
+    /* Miss links and leaf ranges move to where the part lands */
+    mesh->root = bvh->node_count;
+    for (u32 n = 0; n < part.node_count; n++) {
+      bvh_node_t node = part.nodes[n];
+      node.miss += mesh->root;
+      if (node.prims != 0) node.prims += bvh->ref_count << BVH_COUNT_BITS;
+      bvh->nodes[bvh->node_count++] = node;
+    }
+    for (u32 r = 0; r < part.ref_count; r++) {
+      bvh->refs[bvh->ref_count++] = mesh->first + part.refs[r];
+    }
+    mesh->end = bvh->node_count;
+    bvh_destroy(&part);
+  }
+  free(bounds);
+  if (!success) {
+    bvh_destroy(bvh);
+    scene_error = "out of memory";
+  }
+  return success;
+}
+/* Mesh to world transform of an instance, time seconds into its spin */
+static void scene_instance_transform(const instance_t *instance, f32 time, f32 m[3][4]) {
+  const f32 angle = instance->spin * time;
+  const f32 c = cosf(angle), s = sinf(angle);
+  for (u32 r = 0; r < 3; r++) {
+    const f32 *t = instance->transform[r];
+    m[r][0] = t[0] * c - t[2] * s;
+    m[r][1] = t[1];
+    m[r][2] = t[0] * s + t[2] * c;
+    m[r][3] = t[3];
+  }
+}
+static inline nh_vec3_t scene_transform_point(const f32 m[3][4], nh_vec3_t p) {
+  return (nh_vec3_t){
+    m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+    m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+    m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3],
+  };
+}
+/* Inverse of an affine transform */
+static void scene_invert_transform(const f32 m[3][4], f32 out[3][4]) {
+  const f32 a = m[0][0], b = m[0][1], c = m[0][2];
+  const f32 d = m[1][0], e = m[1][1], f = m[1][2];
+  const f32 g = m[2][0], h = m[2][1], k = m[2][2];
+  const f32 inv_det = 1.0f / (a * (e * k - f * h) - b * (d * k - f * g) + c * (d * h - e * g));
+  out[0][0] = (e * k - f * h) * inv_det;
+  out[0][1] = (c * h - b * k) * inv_det;
+  out[0][2] = (b * f - c * e) * inv_det;
+  out[1][0] = (f * g - d * k) * inv_det;
+  out[1][1] = (a * k - c * g) * inv_det;
+  out[1][2] = (c * d - a * f) * inv_det;
+  out[2][0] = (d * h - e * g) * inv_det;
+  out[2][1] = (b * g - a * h) * inv_det;
+  out[2][2] = (a * e - b * d) * inv_det;
+  for (u32 r = 0; r < 3; r++) {
+    out[r][3] = -(out[r][0] * m[0][3] + out[r][1] * m[1][3] + out[r][2] * m[2][3]);
+  }
+}
+/* Rebuild the top level with instances time seconds into their spin. Only
+ * instance bounds are touched: a mesh's corners, moved into the world */
+bool scene_place_instances(scene_t *scene, f32 time) {
+  const u32 count = scene->instance_count;
+  bvh_aabb_t bounds[SCENE_MAX_INSTANCES] = {0};
+  tlas_instance_t placed[SCENE_MAX_INSTANCES];
+  for (u32 i = 0; i < count; i++) {
+    const instance_t *instance = &scene->instances[i];
+    const mesh_t *mesh = &scene->meshes[instance->mesh];
+    const bvh_node_t *root = &scene->bvh.nodes[mesh->root];
+    f32 m[3][4];
+    scene_instance_transform(instance, time, m);
+    bounds[i] = bvh_aabb_empty();
+    if (mesh->count == 0) {
+      bvh_aabb_grow(&bounds[i], (nh_vec3_t){m[0][3], m[1][3], m[2][3]});
+    }
+    for (u32 corner = 0; mesh->count > 0 && corner < 8; corner++) {
+      const nh_vec3_t p = {
+        (corner & 1) ? root->max.x : root->min.x,
+        (corner & 2) ? root->max.y : root->min.y,
+        (corner & 4) ? root->max.z : root->min.z,
+      };
+      bvh_aabb_grow(&bounds[i], scene_transform_point(m, p));
+    }
+    scene_invert_transform(m, placed[i].world_to_mesh);
+    placed[i].root = mesh->root;
+    placed[i].end = mesh->end;
+    placed[i].padding[0] = placed[i].padding[1] = 0;
+  }
+  bvh_t top;
+  if (!bvh_build(&top, bounds, count)) {
+    scene_error = "out of memory";
+    return false;
+  }
+  /* Slots in leaf order, so leaves index them without refs */
+  memcpy(scene->tlas.nodes, top.nodes, sizeof(bvh_node_t) * top.node_count);
+  for (u32 i = 0; i < count; i++) {
+    scene->tlas.instances[i] = placed[top.refs[i]];
+    scene->tlas_instances[i] = top.refs[i];
+  }
+  bvh_destroy(&top);
+  return true;
+}
+/* Does anything move when animated? */
+bool scene_animated(const scene_t *scene) {
+  for (u32 i = 0; i < scene->instance_count; i++) {
+    if (scene->instances[i].spin != 0.0f) return true;
+  }
+  return false;
+}
+/* The scene above, BVH built on the spot */
+bool scene_builtin(scene_t *scene) {
+  memset(scene, 0, sizeof(scene_t));
+  scene->materials = builtin_materials;
+  scene->material_count = sizeof(builtin_materials) / sizeof(material_t);
+  scene->spheres = builtin_spheres;
+  scene->sphere_count = sizeof(builtin_spheres) / sizeof(sphere_t);
+  scene->vertices = builtin_vertices;
+  scene->vertex_count = sizeof(builtin_vertices) / sizeof(vertex_t);
+  scene->triangles = builtin_triangles;
+  scene->triangle_count = sizeof(builtin_triangles) / sizeof(triangle_t);
+  scene->meshes = builtin_meshes;
+  scene->mesh_count = sizeof(builtin_meshes) / sizeof(mesh_t);
+  scene->instances = builtin_instances;
+  scene->instance_count = sizeof(builtin_instances) / sizeof(instance_t);
+  if (!scene_build_bvh(scene)) return false;
+  if (!scene_place_instances(scene, 0.0f)) {
+    bvh_destroy(&scene->bvh);
+    return false;
+  }
+  return true;
+}
+/* Map a scene file, sections are used in place */
+bool scene_load(scene_t *scene, const char *path) {
+  memset(scene, 0, sizeof(scene_t));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    scene_error = "cannot open file";
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(scene_header_t)) {
+    close(fd);
+    scene_error = "file too small";
+    return false;
+  }
+  const size_t size = (size_t)st.st_size;
+  void *mapping = mmap(NH_NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    scene_error = "mmap failed";
+    return false;
+  }
+  /* Sections are read front to back when uploading */
+  posix_madvise(mapping, size, POSIX_MADV_SEQUENTIAL);
+  posix_madvise(mapping, size, POSIX_MADV_WILLNEED);
+
+  /* Validate header */
+  const scene_header_t *header = (const scene_header_t *)mapping;
+  const u8 *data = (const u8 *)mapping;
+  const char *error = NH_NULL;
+  if (header->magic != SCENE_MAGIC) error = "not a scene file";
+  else if (header->version != SCENE_VERSION) error = "unsupported version";
+  for (u32 i = 0; error == NH_NULL && i < SCENE_SECTIONS; i++) {
+    const scene_section_t *section = &header->sections[i];
+    if (section->offset % SCENE_ALIGNMENT != 0
+        || section->count > 0xFFFFFFFFu
+        || section->offset > size
+        || section->count * scene_element_sizes[i] > size - section->offset) {
+      error = "bad section";
+    }
+  }
+  if (error != NH_NULL) {
+    scene_error = error;
+    munmap(mapping, size);
+    return false;
+  }
+
+  /* Point into the mapping */
+  const scene_section_t *sections = header->sections;
+  scene->materials = (const material_t *)(data + sections[SCENE_MATERIALS].offset);
+  scene->material_count = (u32)sections[SCENE_MATERIALS].count;
+  scene->spheres = (const sphere_t *)(data + sections[SCENE_SPHERES].offset);
+  scene->sphere_count = (u32)sections[SCENE_SPHERES].count;
+  scene->vertices = (const vertex_t *)(data + sections[SCENE_VERTICES].offset);
+  scene->vertex_count = (u32)sections[SCENE_VERTICES].count;
+  scene->triangles = (const triangle_t *)(data + sections[SCENE_TRIANGLES].offset);
+  scene->triangle_count = (u32)sections[SCENE_TRIANGLES].count;
+  scene->bvh.nodes = (bvh_node_t *)(data + sections[SCENE_BVH_NODES].offset);
+  scene->bvh.node_count = (u32)sections[SCENE_BVH_NODES].count;
+  scene->bvh.refs = (u32 *)(data + sections[SCENE_BVH_REFS].offset);
+  scene->bvh.ref_count = (u32)sections[SCENE_BVH_REFS].count;
+  scene->meshes = (mesh_t *)(data + sections[SCENE_MESHES].offset);
+  scene->mesh_count = (u32)sections[SCENE_MESHES].count;
+  scene->instances = (const instance_t *)(data + sections[SCENE_INSTANCES].offset);
+  scene->instance_count = (u32)sections[SCENE_INSTANCES].count;
+  scene->mapping = mapping;
+  scene->mapping_size = size;
+
+  /* Everything that indexes another section */
+  const u32 primitive_count = scene->sphere_count + scene->triangle_count;
+  u64 ref_count = 0;
+  if (primitive_count > (1u << SCENE_REF_BITS)) error = "too many primitives";
+  else if (scene->instance_count > SCENE_MAX_INSTANCES) error = "too many instances";
+  for (u32 i = 0; error == NH_NULL && i < scene->mesh_count; i++) {
+    const mesh_t *mesh = &scene->meshes[i];
+    if (mesh->first > primitive_count || mesh->count > primitive_count - mesh->first
+        || mesh->root > mesh->end || mesh->end > scene->bvh.node_count
+        || (mesh->count > 0 && mesh->root == mesh->end)) {
+      error = "bad mesh";
+    }
+    ref_count += mesh->count;
+  }
+  if (error == NH_NULL && ref_count != scene->bvh.ref_count) error = "BVH does not match geometry";
+  /* Traversal follows miss links forward and stays in the mesh's nodes */
+  for (u32 i = 0; error == NH_NULL && i < scene->mesh_count; i++) {
+    const mesh_t *mesh = &scene->meshes[i];
+    for (u32 n = mesh->root; n < mesh->end; n++) {
+      const bvh_node_t *node = &scene->bvh.nodes[n];
+      const u32 first = node->prims >> BVH_COUNT_BITS, count = node->prims & BVH_COUNT_MASK;
+      if (node->miss <= n || node->miss > mesh->end || first > scene->bvh.ref_count
+          || count > scene->bvh.ref_count - first) {
+        error = "bad BVH node";
+        break;
+      }
+    }
+  }
+  for (u32 i = 0; error == NH_NULL && i < scene->bvh.ref_count; i++) {
+    if (scene->bvh.refs[i] >= primitive_count) error = "bad BVH ref";
+  }
+  for (u32 i = 0; error == NH_NULL && i < scene->sphere_count; i++) {
+    if (scene->spheres[i].material >= scene->material_count) error = "bad sphere";
+  }
+  for (u32 i = 0; error == NH_NULL && i < scene->triangle_count; i++) {
+    const triangle_t *triangle = &scene->triangles[i];
+    if (triangle->v0 >= scene->vertex_count || triangle->v1 >= scene->vertex_count
+        || triangle->v2 >= scene->vertex_count || triangle->material >= scene->material_count) {
+      error = "bad triangle";
+    }
+  }
+  for (u32 i = 0; error == NH_NULL && i < scene->instance_count; i++) {
+    if (scene->instances[i].mesh >= scene->mesh_count) error = "bad instance";
+  }
+  if (error == NH_NULL && !scene_place_instances(scene, 0.0f)) error = scene_error;
+  if (error != NH_NULL) {
+    scene_error = error;
+    munmap(mapping, size);
+    memset(scene, 0, sizeof(scene_t));
+    return false;
+  }
+  return true;
+}
+/* Write a scene file, the BVH must be built */
+bool scene_write(const scene_t *scene, const char *path) {
+  const void *data[SCENE_SECTIONS] = {
+    scene->materials, scene->spheres, scene->vertices,
+    scene->triangles, scene->bvh.nodes, scene->bvh.refs,
+    scene->meshes, scene->instances,
+  };
+  scene_header_t header = {SCENE_MAGIC, SCENE_VERSION, {{0, 0}}};
+  header.sections[SCENE_MATERIALS].count = scene->material_count;
+  header.sections[SCENE_SPHERES].count = scene->sphere_count;
+  header.sections[SCENE_VERTICES].count = scene->vertex_count;
+  header.sections[SCENE_TRIANGLES].count = scene->triangle_count;
+  header.sections[SCENE_BVH_NODES].count = scene->bvh.node_count;
+  header.sections[SCENE_BVH_REFS].count = scene->bvh.ref_count;
+  header.sections[SCENE_MESHES].count = scene->mesh_count;
+  header.sections[SCENE_INSTANCES].count = scene->instance_count;
+  u64 offset = SCENE_ALIGNMENT;
+  for (u32 i = 0; i < SCENE_SECTIONS; i++) {
+    header.sections[i].offset = offset;
+    offset += header.sections[i].count * scene_element_sizes[i];
+    offset = (offset + SCENE_ALIGNMENT - 1) / SCENE_ALIGNMENT * SCENE_ALIGNMENT;
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (file == NH_NULL) {
+    scene_error = "cannot create file";
+    return false;
+  }
+  static const u8 zeros[SCENE_ALIGNMENT] = {0};
+  bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+  u64 position = sizeof(header);
+  for (u32 i = 0; success && i < SCENE_SECTIONS; i++) {
+    const scene_section_t *section = &header.sections[i];
+    const size_t bytes = section->count * scene_element_sizes[i];
+    success = fwrite(zeros, 1, section->offset - position, file) == section->offset - position
+      && fwrite(data[i], 1, bytes, file) == bytes;
+    position = section->offset + bytes;
+  }
+  success = fclose(file) == 0 && success;
+  if (!success) scene_error = "write failed";
+  return success;
+}
+void scene_destroy(scene_t *scene) {
+  if (scene->mapping != NH_NULL) {
+    munmap(scene->mapping, scene->mapping_size);
+  } else {
+    bvh_destroy(&scene->bvh);
+  }
+  memset(scene, 0, sizeof(scene_t));
+}
+
+#endif /* SCENE_H */
@@ -0,0 +1,175 @@
+/* Include guard */
+#if !defined(UI_H)
+#define UI_H
+
+/* Includes */
+#include <nh_base.h>
+#include <ext/nh_logging.h>
+#include <stdlib.h>
+
+/* Project headers */
+#include "loadgl.h"
+
+/*
+ * Batched HUD - text and solid quads are written into one streaming vertex
+ * buffer during the frame and drawn with a single call by ui_end(). With
+ * buffer storage (OpenGL 4.4) the buffer is mapped once and split into
+ * UI_FRAMES regions, each guarded by a fence so the CPU never writes what
+ * the GPU is still reading. Without it, vertices are built in memory and
+ * uploaded into an orphaned buffer.
+ */
+
+/* Consts */
+#define UI_MAX_QUADS        2048 /* Per frame, the rest are dropped */
+#define UI_MAX_VERTICES     (UI_MAX_QUADS * 6)
+#define UI_FRAMES           3    /* Buffer regions in flight */
+#define UI_FENCE_TIMEOUT    1000000000 /* ns */
+
+/* Structs */
+typedef struct {
+  f32 x, y;                     /* Clip space */
+  f32 u, v;                     /* Font texture, negative for solid quads */
+  f32 r, g, b, a;
+} ui_vertex_t;
+typedef struct {
+  f32 u0, v0, u1, v1;           /* Top left, bottom right */
+} ui_glyph_t;
+typedef struct {
+  u32 program;                  /* ui.vertex + ui.fragment */
+  u32 vao, vbo;
+  ui_vertex_t *mapped;          /* Persistent mapping, NH_NULL if unsupported */
+  ui_vertex_t *vertices;        /* This frame's vertices */
+  GLsync fences[UI_FRAMES];     /* Last draw from each region */
+  u32 region;                   /* Region written this frame */
+  u32 count;                    /* Vertices this frame */
+  ui_glyph_t glyphs[256];       /* Font UVs by character */
+} ui_t;
+
+/* Font texture UVs for every character, unknown ones get the fallback cell */
+static void ui_build_glyphs(ui_t *ui, const char *chars, u32 cols, u32 rows, u32 fallback) {
+  const f32 w = 1.0f / (f32)cols, h = 1.0f / (f32)rows;
+  for (u32 c = 0; c < 256; c++) {
+    ui->glyphs[c] = (ui_glyph_t){
+      w * (f32)(fallback % cols), h * (f32)(fallback / cols),
+      w * (f32)(fallback % cols + 1), h * (f32)(fallback / cols + 1),
+    };
+  }
+  for (u32 i = 0; chars[i] != '\0' && i < cols * rows; i++) {
+    ui->glyphs[(u8)chars[i]] = (ui_glyph_t){
+      w * (f32)(i % cols), h * (f32)(i / cols),
+      w * (f32)(i % cols + 1), h * (f32)(i / cols + 1),
+    };
+  }
+}
+
+/* Create the vertex buffer and glyph table, takes ownership of program */
+bool ui_init(ui_t *ui, u32 program, const char *chars, u32 cols, u32 rows, u32 fallback) {
+  *ui = (ui_t){0};
+  ui->program = program;
+  ui_build_glyphs(ui, chars, cols, rows, fallback);
+  glGenVertexArrays(1, &ui->vao);
+  glBindVertexArray(ui->vao);
+  glGenBuffers(1, &ui->vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, ui->vbo);
+  if (hasBufferStorageGL()) {
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    const size_t size = sizeof(ui_vertex_t) * UI_MAX_VERTICES * UI_FRAMES;
+    glBufferStorage(GL_ARRAY_BUFFER, size, NH_NULL, flags);
+    ui->mapped = (ui_vertex_t *)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+  }
+  if (ui->mapped == NH_NULL) {
+    ui->vertices = (ui_vertex_t *)malloc(sizeof(ui_vertex_t) * UI_MAX_VERTICES);
+    if (ui->vertices == NH_NULL) return false;
+    glBufferData(GL_ARRAY_BUFFER, sizeof(ui_vertex_t) * UI_MAX_VERTICES, NH_NULL, GL_STREAM_DRAW);
+  }
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(ui_vertex_t), (void *)0);
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(ui_vertex_t), (void *)(2 * sizeof(f32)));
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(ui_vertex_t), (void *)(4 * sizeof(f32)));
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  NH_LOG_ENTRY("UI buffer: %s", ui->mapped != NH_NULL ? "persistent mapping" : "orphaned uploads");
+  return true;
+}
+/* Start a frame, waits if the GPU is still reading the next region */
+void ui_begin(ui_t *ui) {
+  ui->count = 0;
+  if (ui->mapped == NH_NULL) return;
+  ui->region = (ui->region + 1) % UI_FRAMES;
+  if (ui->fences[ui->region] != NH_NULL) {
+    glClientWaitSync(ui->fences[ui->region], GL_SYNC_FLUSH_COMMANDS_BIT, UI_FENCE_TIMEOUT);
+    glDeleteSync(ui->fences[ui->region]);
+    ui->fences[ui->region] = NH_NULL;
+  }
+  ui->vertices = ui->mapped + ui->region * UI_MAX_VERTICES;
+}
+/* Axis-aligned quad, u0 < 0 for a solid color */
+void ui_quad(ui_t *ui, f32 x0, f32 y0, f32 x1, f32 y1, ui_glyph_t uv, nh_vec3_t color) {
+  if (ui->count + 6 > UI_MAX_VERTICES) return;
+  ui_vertex_t *v = ui->vertices + ui->count;
+  /* y0 is the bottom edge, which samples the bottom of the glyph (v1) */
+  v[0] = (ui_vertex_t){x0, y0, uv.u0, uv.v1, color.x, color.y, color.z, 1.0f};
+  v[1] = (ui_vertex_t){x1, y0, uv.u1, uv.v1, color.x, color.y, color.z, 1.0f};
+  v[2] = (ui_vertex_t){x1, y1, uv.u1, uv.v0, color.x, color.y, color.z, 1.0f};
+  v[3] = v[0];
+  v[4] = v[2];
+  v[5] = (ui_vertex_t){x0, y1, uv.u0, uv.v0, color.x, color.y, color.z, 1.0f};
+  ui->count += 6;
+}
+/* Solid quad */
+void ui_rect(ui_t *ui, f32 x0, f32 y0, f32 x1, f32 y1, nh_vec3_t color) {
+  ui_quad(ui, x0, y0, x1, y1, (ui_glyph_t){-1.0f, -1.0f, -1.0f, -1.0f}, color);
+}
+/* One glyph of half-size scale per character, centred (i + 1) * scale from pos */
+f32 ui_text(ui_t *ui, const char *str, nh_vec2_t pos, f32 scale) {
+  f32 size = 0.0f;
+  for (u32 i = 0; str[i] != '\0'; i++) {
+    const f32 x = pos.x + (f32)(i + 1) * scale;
+    ui_quad(ui, x - scale, pos.y - scale, x + scale, pos.y + scale,
+        ui->glyphs[(u8)str[i]], (nh_vec3_t){1.0f, 1.0f, 1.0f});
+    size += scale;
+  }
+  return size;
+}
+/* Draw everything queued this frame */
+void ui_end(ui_t *ui, u32 font_texture) {
+  if (ui->count == 0) return;
+  u32 first = 0;
+  glBindBuffer(GL_ARRAY_BUFFER, ui->vbo);
+  if (ui->mapped != NH_NULL) {
+    first = ui->region * UI_MAX_VERTICES;
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, sizeof(ui_vertex_t) * UI_MAX_VERTICES, NH_NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(ui_vertex_t) * ui->count, ui->vertices);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glUseProgram(ui->program);
+  glBindTexture(GL_TEXTURE_2D, font_texture);
+  glBindVertexArray(ui->vao);
+  glDrawArrays(GL_TRIANGLES, first, ui->count);
+  glBindVertexArray(0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  if (ui->mapped != NH_NULL) {
+    ui->fences[ui->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+}
+void ui_destroy(ui_t *ui) {
+  for (u32 i = 0; i < UI_FRAMES; i++) {
+    if (ui->fences[i] != NH_NULL) glDeleteSync(ui->fences[i]);
+  }
+  if (ui->mapped != NH_NULL) {
+    glBindBuffer(GL_ARRAY_BUFFER, ui->vbo);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  } else {
+    free(ui->vertices);
+  }
+  glDeleteBuffers(1, &ui->vbo);
+  glDeleteVertexArrays(1, &ui->vao);
+  glDeleteProgram(ui->program);
+  *ui = (ui_t){0};
+}
+
+#endif /* UI_H */
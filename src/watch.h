@@ -0,0 +1,83 @@
+/* Include guard */
+#if !defined(WATCH_H)
+#define WATCH_H
+
+/* Includes */
+#include <nh_base.h>
+#include <string.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Files changing in a directory, from inotify. Editors either write the file
+ * in place or write a temporary and rename it over the file, so a write
+ * being closed and a file moved in both count. Events are read without
+ * blocking, a frame just takes whatever has come in since the last one.
+ * Linux only - elsewhere watch_init fails and nothing is ever reported.
+ */
+
+/* Consts */
+#define WATCH_BUFFER_SIZE   4096
+
+/* Structs */
+typedef struct {
+  i32 fd;                       /* inotify instance, -1 if not watching */
+  _Alignas(8) u8 buffer[WATCH_BUFFER_SIZE]; /* Events read, not handed out yet */
+  size_t size, offset;          /* Bytes in buffer, next event */
+} watch_t;
+
+/* Watch a directory, false if it can't be */
+bool watch_init(watch_t *watch, const char *dir) {
+  *watch = (watch_t){0};
+  watch->fd = -1;
+#if defined(__linux__)
+  watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch->fd < 0) return false;
+  if (inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(watch->fd);
+    watch->fd = -1;
+    return false;
+  }
+  return true;
+#else
+  (void)dir;
+  return false;
+#endif
+}
+void watch_destroy(watch_t *watch) {
+#if defined(__linux__)
+  if (watch->fd >= 0) close(watch->fd);
+#endif
+  watch->fd = -1;
+}
+/* Next changed file's name, false once there are none - never blocks.
+ * A file saved twice may come up twice */
+bool watch_next(watch_t *watch, char *name, size_t size) {
+#if defined(__linux__)
+  if (watch->fd < 0 || size == 0) return false;
+  for (;;) {
+    if (watch->offset >= watch->size) {
+      const ssize_t bytes = read(watch->fd, watch->buffer, sizeof(watch->buffer));
+      if (bytes <= 0) return false;
+      watch->size = (size_t)bytes;
+      watch->offset = 0;
+    }
+    const struct inotify_event *event = (const struct inotify_event *)(watch->buffer + watch->offset);
+    watch->offset += sizeof(struct inotify_event) + event->len;
+    /* The directory itself has no name, the queue overflowing neither */
+    if (event->len == 0 || event->name[0] == '\0') continue;
+    strncpy(name, event->name, size - 1);
+    name[size - 1] = '\0';
+    return true;
+  }
+#else
+  (void)watch;
+  (void)name;
+  (void)size;
+  return false;
+#endif
+}
+
+#endif /* WATCH_H */